@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstddef>
+
+// every allocation is counted, so memory of a structure is the difference before and after it is filled
+extern std::size_t allocated;
+// count of allocations made so far
+extern std::size_t allocations;
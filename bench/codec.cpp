@@ -0,0 +1,111 @@
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "ph/message.h"
+#include "ph/message_pool.h"
+#include "bench.h"
+
+namespace {
+
+    using bench_clock = std::chrono::steady_clock;
+    using buffer_t = hope::io::event_loop::fixed_size_buffer;
+
+    // request is written to a chunk and read back by the other side, the way client and hub do it,
+    // fill sets the fields of the reused request
+    template<typename T, typename TFill>
+    void round_trip(const char* what, std::size_t requests, TFill&& fill, buffer_t& buffer, ph::message_pool& pool) {
+        T request;
+        std::size_t bytes = 0;
+        const auto start = bench_clock::now();
+        for (std::size_t i = 0; i < requests; ++i) {
+            request.reset();
+            fill(request);
+            ph::event_loop_stream_wrapper out(buffer);
+            request.write(out);
+            bytes += buffer.count();
+            ph::event_loop_stream_wrapper in(buffer);
+            auto* received = pool.peek_request(in);
+            received->read(in);
+            pool.release(received, true);
+        }
+        const auto seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+        std::cout << what << ": " << requests / seconds << " requests/s, "
+            << bytes / requests << " bytes per chunk\n";
+    }
+
+    // the way the hub picked a handler before: table of type erased functions indexed by message type
+    using exec_t = std::function<void(ph::message* msg)>;
+
+    std::size_t handle(const ph::get_patches_request& request) { return request.tag.size(); }
+    std::size_t handle(const ph::delete_patch_request& request) { return request.tag.size(); }
+    std::size_t handle(const ph::get_batch_request& request) { return request.tags.size(); }
+    std::size_t handle(const ph::message&) { return 1; }
+
+}
+
+void bench_codec(std::size_t requests) {
+    std::cout << "// ----------- Small requests round trip, " << requests << " times // -----------\n";
+    auto buffer = std::make_unique<buffer_t>();
+    ph::message_pool pool;
+
+    round_trip<ph::list_patches_request>("list", requests, [](auto&) { }, *buffer, pool);
+    round_trip<ph::get_patches_request>("get", requests, [](auto& request) {
+        request.tag = "WindowsClient_100500";
+    }, *buffer, pool);
+    round_trip<ph::delete_patch_request>("delete", requests, [](auto& request) {
+        request.tag = "WindowsClient_100500";
+    }, *buffer, pool);
+    round_trip<ph::get_batch_request>("batch of 3 tags", requests, [](auto& request) {
+        request.tags.resize(3);
+        request.tags[0] = "WindowsClient_100500";
+        request.tags[1] = "WindowsDLC_100500";
+        request.tags[2] = "WindowsServer_100500";
+    }, *buffer, pool);
+
+    std::cout << "// ----------- Handler dispatch, " << requests << " times // -----------\n";
+    std::vector<std::unique_ptr<ph::message>> received;
+    received.emplace_back(std::make_unique<ph::list_patches_request>());
+    received.emplace_back(std::make_unique<ph::get_patches_request>());
+    received.emplace_back(std::make_unique<ph::delete_patch_request>());
+    received.emplace_back(std::make_unique<ph::get_batch_request>());
+    static_cast<ph::get_patches_request&>(*received[1]).tag = "WindowsClient_100500";
+
+    std::size_t sum = 0;
+    std::array<exec_t, std::size_t(ph::message::etype::count)> exec;
+    exec[std::size_t(ph::message::etype::list_patches)] = [&](ph::message* msg) {
+        sum += handle(*static_cast<ph::list_patches_request*>(msg));
+    };
+    exec[std::size_t(ph::message::etype::get_patches)] = [&](ph::message* msg) {
+        sum += handle(*static_cast<ph::get_patches_request*>(msg));
+    };
+    exec[std::size_t(ph::message::etype::delete_patch)] = [&](ph::message* msg) {
+        sum += handle(*static_cast<ph::delete_patch_request*>(msg));
+    };
+    exec[std::size_t(ph::message::etype::get_batch)] = [&](ph::message* msg) {
+        sum += handle(*static_cast<ph::get_batch_request*>(msg));
+    };
+    auto start = bench_clock::now();
+    for (std::size_t i = 0; i < requests; ++i) {
+        auto* msg = received[i % received.size()].get();
+        exec[std::size_t(msg->get_type())](msg);
+    }
+    const auto table = bench_clock::now() - start;
+    start = bench_clock::now();
+    for (std::size_t i = 0; i < requests; ++i) {
+        sum += ph::visit_request(*received[i % received.size()], [](auto& request) {
+            return handle(request);
+        });
+    }
+    const auto visit = bench_clock::now() - start;
+    if (sum != requests / 4 * (1 + 20 + 0 + 0) * 2) {
+        std::cout << "Dispatch mismatch\n";
+        std::exit(-1);
+    }
+    std::cout << "function table: " << std::chrono::duration<double, std::nano>(table).count() / requests
+        << " ns, visit: " << std::chrono::duration<double, std::nano>(visit).count() / requests << " ns\n";
+}
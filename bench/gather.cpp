@@ -0,0 +1,174 @@
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "ph/message.h"
+#include "bench.h"
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+namespace {
+
+    using bench_clock = std::chrono::steady_clock;
+    using buffer_t = hope::io::event_loop::fixed_size_buffer;
+
+    // loopback tcp connection, the other end is drained by a thread the way a hub reads it
+    struct loopback final {
+        loopback() {
+            const auto listener = ::socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            socklen_t size = sizeof(address);
+            ::bind(listener, (sockaddr*)&address, size);
+            ::listen(listener, 1);
+            ::getsockname(listener, (sockaddr*)&address, &size);
+            fd = ::socket(AF_INET, SOCK_STREAM, 0);
+            ::connect(fd, (sockaddr*)&address, size);
+            const auto peer = ::accept(listener, nullptr, nullptr);
+            ::close(listener);
+            drain = std::thread([peer] {
+                std::vector<uint8_t> sink(256 * 1024);
+                while (::recv(peer, sink.data(), sink.size(), 0) > 0) { }
+                ::close(peer);
+            });
+        }
+        ~loopback() {
+            ::shutdown(fd, SHUT_WR);
+            drain.join();
+            ::close(fd);
+        }
+        void send(const void* data, std::size_t size) {
+            ++sends;
+            while (size > 0) {
+                const auto sent = ::send(fd, data, size, MSG_NOSIGNAL);
+                if (sent <= 0) {
+                    throw std::runtime_error("send");
+                }
+                data = (const uint8_t*)data + sent;
+                size -= std::size_t(sent);
+            }
+        }
+        // the whole chunk with a single call, what a gather write of the stream would do
+        void send(const std::vector<ph::chunk_segment>& segments) {
+            ++sends;
+            std::vector<iovec> pieces;
+            for (const auto& [data, size] : segments) {
+                pieces.push_back({ (void*)data, size });
+            }
+            for (std::size_t first = 0; first < pieces.size();) {
+                auto sent = ::writev(fd, pieces.data() + first, int(pieces.size() - first));
+                if (sent <= 0) {
+                    throw std::runtime_error("writev");
+                }
+                for (; first < pieces.size() && std::size_t(sent) >= pieces[first].iov_len; ++first) {
+                    sent -= ssize_t(pieces[first].iov_len);
+                }
+                if (first < pieces.size()) {
+                    pieces[first].iov_base = (uint8_t*)pieces[first].iov_base + sent;
+                    pieces[first].iov_len -= std::size_t(sent);
+                }
+            }
+        }
+
+        int fd{ -1 };
+        std::thread drain;
+        std::size_t sends{ 0 };
+    };
+
+    // upload of in memory patches, the way client serializes it, returns seconds
+    template<typename TSerialize>
+    double upload(const std::vector<uint8_t>& content, std::size_t patches, TSerialize&& serialize) {
+        ph::upload_patch_request request;
+        for (std::size_t i = 0; i < patches; ++i) {
+            auto p = std::make_shared<ph::patch>();
+            p->tag = "WindowsClient_100500";
+            p->name = "PH_Redist_pakchunk" + std::to_string(i) + "-Windows.pak";
+            p->file_size = content.size();
+            p->hash = ph::hasher::hash(content.data(), content.size());
+            p->data = (uint8_t*)content.data();
+            request.patches.emplace_back(std::move(p));
+        }
+        const auto start = bench_clock::now();
+        serialize(request);
+        const auto seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+        for (auto& p : request.patches) {
+            p->data = nullptr;
+        }
+        return seconds;
+    }
+
+}
+#endif
+
+// client uploads sent to a loopback socket: a chunk copied to the buffer and sent at once,
+// segments sent one by one as client_impl::serialize does, and segments gathered by one writev
+void bench_gather(std::size_t patch_size, std::size_t patches) {
+    std::cout << "// ----------- Upload of " << patches << " patches x " << patch_size / 1024 << " kb // -----------\n";
+#ifdef _WIN32
+    std::cout << "needs posix sockets, skipped\n";
+#else
+    std::vector<uint8_t> content(patch_size, 42);
+    auto buffer = std::make_unique<buffer_t>();
+    const auto mb = double(patch_size * patches) / (1024 * 1024);
+
+    std::size_t copy_sends = 0;
+    const auto copy = upload(content, patches, [&](ph::message& request) {
+        loopback socket;
+        auto complete = false;
+        while (!complete) {
+            ph::event_loop_stream_wrapper stream(*buffer);
+            complete = request.write(stream);
+            const auto [data, size] = buffer->used_chunk();
+            socket.send(data, size);
+            buffer->reset();
+        }
+        copy_sends = socket.sends;
+    });
+    std::size_t segment_sends = 0;
+    std::size_t chunks = 0;
+    const auto segmented = upload(content, patches, [&](ph::message& request) {
+        loopback socket;
+        std::vector<ph::chunk_segment> segments;
+        auto complete = false;
+        while (!complete) {
+            ph::event_loop_stream_wrapper stream(*buffer, segments);
+            complete = request.write(stream);
+            for (const auto& [data, size] : segments) {
+                socket.send(data, size);
+            }
+            buffer->reset();
+            ++chunks;
+        }
+        segment_sends = socket.sends;
+    });
+    std::size_t gather_sends = 0;
+    const auto gathered = upload(content, patches, [&](ph::message& request) {
+        loopback socket;
+        std::vector<ph::chunk_segment> segments;
+        auto complete = false;
+        while (!complete) {
+            ph::event_loop_stream_wrapper stream(*buffer, segments);
+            complete = request.write(stream);
+            socket.send(segments);
+            buffer->reset();
+        }
+        gather_sends = socket.sends;
+    });
+    std::cout << "copy to buffer: " << mb / copy << " mb/s, " << copy_sends << " sends\n";
+    std::cout << "segment by segment: " << mb / segmented << " mb/s, " << segment_sends << " sends, "
+        << chunks << " chunks\n";
+    std::cout << "writev: " << mb / gathered << " mb/s, " << gather_sends << " sends\n";
+#endif
+}
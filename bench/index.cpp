@@ -0,0 +1,157 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ph/message.h"
+#include "ph/patch_index.h"
+#include "bench.h"
+
+namespace {
+
+    using bench_clock = std::chrono::steady_clock;
+    using plist_t = std::vector<std::shared_ptr<ph::patch>>;
+
+    // layout the service used before: tag -> vector of patches, names compared one by one
+    struct legacy_registry final {
+        void put(const std::shared_ptr<ph::patch>& p) {
+            auto& entry = registry[p->tag];
+            for (auto& maybepatch : entry) {
+                if (maybepatch->name == p->name) {
+                    maybepatch = p;
+                    return;
+                }
+            }
+            entry.emplace_back(p);
+        }
+        std::shared_ptr<ph::patch> find(const std::string& tag, const std::string& name) const {
+            if (const auto entry = registry.find(tag); entry != registry.end()) {
+                for (const auto& stored : entry->second) {
+                    if (stored->name == name) {
+                        return stored;
+                    }
+                }
+            }
+            return nullptr;
+        }
+        std::unordered_map<std::string, plist_t> registry;
+    };
+
+    double ms(bench_clock::duration d) {
+        return std::chrono::duration<double, std::milli>(d).count();
+    }
+
+    void report(const char* what, double legacy, double index) {
+        std::cout << what << ": legacy " << legacy << ", index " << index << "\n";
+    }
+
+}
+
+void bench_index(std::size_t revisions, std::size_t files) {
+    std::cout << "// ----------- Registry of " << revisions << " revisions x " << files << " files // -----------\n";
+    plist_t patches;
+    patches.reserve(revisions * files);
+    const auto patches_before = allocated;
+    for (std::size_t rev = 0; rev < revisions; ++rev) {
+        for (std::size_t i = 0; i < files; ++i) {
+            auto p = std::make_shared<ph::patch>();
+            p->tag = "WindowsClient_" + std::to_string(100000 + rev);
+            p->name = "PH_Redist_pakchunk" + std::to_string(i) + "-Windows.pak";
+            p->file_size = 1024 * i;
+            p->hash = rev * files + i + 1;
+            patches.emplace_back(std::move(p));
+        }
+    }
+    const auto entries = (double)patches.size();
+    // shared by both layouts, given for scale
+    const auto patch_memory = allocated - patches_before;
+
+    // put, like restore and uploads do
+    auto before = allocated;
+    auto start = bench_clock::now();
+    legacy_registry legacy;
+    for (const auto& p : patches) {
+        legacy.put(p);
+    }
+    const auto legacy_put = bench_clock::now() - start;
+    const auto legacy_memory = allocated - before;
+
+    before = allocated;
+    start = bench_clock::now();
+    ph::patch_index index;
+    for (const auto& p : patches) {
+        index.put(p);
+    }
+    const auto index_put = bench_clock::now() - start;
+    const auto index_memory = allocated - before;
+
+    report("put, ms", ms(legacy_put), ms(index_put));
+    report("registry memory per entry, bytes", legacy_memory / entries, index_memory / entries);
+    std::cout << "patch object itself, bytes: " << patch_memory / entries << "\n";
+
+    // list, every patch is collected to the response
+    constexpr static auto lists = 20;
+    start = bench_clock::now();
+    for (auto i = 0; i < lists; ++i) {
+        plist_t response;
+        for (const auto& [_, array] : legacy.registry) {
+            for (const auto& p : array) {
+                response.emplace_back(p);
+            }
+        }
+    }
+    const auto legacy_list = bench_clock::now() - start;
+    start = bench_clock::now();
+    for (auto i = 0; i < lists; ++i) {
+        plist_t response;
+        response.reserve(index.size());
+        index.for_each([&](const auto& p) {
+            response.emplace_back(p);
+        });
+    }
+    const auto index_list = bench_clock::now() - start;
+    report("list, ms", ms(legacy_list) / lists, ms(index_list) / lists);
+
+    // lookup by tag and name, as replace on upload does
+    std::size_t found = 0;
+    start = bench_clock::now();
+    for (const auto& p : patches) {
+        found += legacy.find(p->tag, p->name) != nullptr;
+    }
+    const auto legacy_find = bench_clock::now() - start;
+    start = bench_clock::now();
+    for (const auto& p : patches) {
+        found += index.find(p->tag, p->name) != nullptr;
+    }
+    const auto index_find = bench_clock::now() - start;
+    report("lookup by tag and name, ns", ms(legacy_find) * 1e6 / entries, ms(index_find) * 1e6 / entries);
+
+    // upload offer of one revision, content is looked up by hash
+    start = bench_clock::now();
+    {
+        std::unordered_map<uint64_t, std::shared_ptr<ph::patch>> content;
+        for (const auto& [_, array] : legacy.registry) {
+            for (const auto& p : array) {
+                content.emplace(p->hash, p);
+            }
+        }
+        for (std::size_t i = 0; i < files; ++i) {
+            found += content.count(patches[i]->hash);
+        }
+    }
+    const auto legacy_offer = bench_clock::now() - start;
+    start = bench_clock::now();
+    for (std::size_t i = 0; i < files; ++i) {
+        found += index.find_content(patches[i]->hash, patches[i]->file_size) != nullptr;
+    }
+    const auto index_offer = bench_clock::now() - start;
+    report("offer of one revision, ms", ms(legacy_offer), ms(index_offer));
+
+    if (found != patches.size() * 2 + files * 2) {
+        std::cout << "Lookup mismatch\n";
+        std::exit(-1);
+    }
+}
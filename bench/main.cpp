@@ -0,0 +1,46 @@
+#include <cstdlib>
+#include <new>
+
+#include "hope_logger/logger.h"
+#include "bench.h"
+
+void bench_index(std::size_t revisions, std::size_t files);
+void bench_messages(std::size_t requests);
+void bench_codec(std::size_t requests);
+void bench_gather(std::size_t patch_size, std::size_t patches);
+
+hope::log::logger* glob_logger;
+
+std::size_t allocated = 0;
+std::size_t allocations = 0;
+
+void* operator new(std::size_t size) {
+    auto* block = (std::size_t*)std::malloc(size + sizeof(std::max_align_t));
+    if (block == nullptr) {
+        throw std::bad_alloc();
+    }
+    *block = size;
+    allocated += size;
+    ++allocations;
+    return (uint8_t*)block + sizeof(std::max_align_t);
+}
+
+void operator delete(void* ptr) noexcept {
+    if (ptr != nullptr) {
+        auto* block = (std::size_t*)((uint8_t*)ptr - sizeof(std::max_align_t));
+        allocated -= *block;
+        std::free(block);
+    }
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    operator delete(ptr);
+}
+
+int main() {
+    bench_index(100, 100);
+    bench_index(2000, 100);
+    bench_messages(200000);
+    bench_codec(1000000);
+    bench_gather(64 * 1024 * 1024, 4);
+}
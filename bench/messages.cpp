@@ -0,0 +1,114 @@
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "ph/message.h"
+#include "ph/message_pool.h"
+#include "ph/patch_index.h"
+#include "bench.h"
+
+namespace {
+
+    using bench_clock = std::chrono::steady_clock;
+    using buffer_t = hope::io::event_loop::fixed_size_buffer;
+
+    // fresh buffer in the same storage, like a connection gets for every chunk
+    struct reusable_buffer final {
+        reusable_buffer() : storage(new std::max_align_t[sizeof(buffer_t) / sizeof(std::max_align_t) + 1]) { }
+        buffer_t& fresh() {
+            // default init, the storage is not zeroed
+            return *new (storage.get()) buffer_t;
+        }
+        std::unique_ptr<std::max_align_t[]> storage;
+    };
+
+    // small request the way the hub handles it: request is read, response is found in the index
+    // and written to the outgoing buffer; make/drop stand for allocation strategy
+    template<typename TPeek, typename TMakeResponse, typename TDrop>
+    void handle(const std::vector<uint8_t>& request_bytes, reusable_buffer& in, reusable_buffer& out,
+        const ph::patch_index& index, TPeek&& peek, TMakeResponse&& make_response, TDrop&& drop) {
+        auto& in_buffer = in.fresh();
+        in_buffer.write(request_bytes.data(), request_bytes.size());
+        ph::event_loop_stream_wrapper in_stream(in_buffer);
+        auto* request = peek(in_stream);
+        request->read(in_stream);
+        auto* response = make_response();
+        index.get(static_cast<ph::get_patches_request*>(request)->tag, response->patches);
+        response->set_version(request->get_version());
+        drop(request, true);
+        auto& out_buffer = out.fresh();
+        ph::event_loop_stream_wrapper out_stream(out_buffer);
+        if (!response->write(out_stream)) {
+            std::cout << "Response does not fit a chunk\n";
+            std::exit(-1);
+        }
+        drop(response, false);
+    }
+
+    template<typename THandle>
+    void run(const char* what, std::size_t requests, THandle&& handle) {
+        // warm up, pools and containers reach their steady size
+        for (auto i = 0; i < 100; ++i) {
+            handle();
+        }
+        const auto allocations_before = allocations;
+        const auto start = bench_clock::now();
+        for (std::size_t i = 0; i < requests; ++i) {
+            handle();
+        }
+        const auto seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+        std::cout << what << ": " << requests / seconds << " requests/s, "
+            << double(allocations - allocations_before) / requests << " allocations per request\n";
+    }
+
+}
+
+void bench_messages(std::size_t requests) {
+    std::cout << "// ----------- Small get requests, " << requests << " times // -----------\n";
+    // few small patches in a tag, payload goes in the same chunk
+    std::vector<uint8_t> content(256, 42);
+    ph::patch_index index;
+    for (auto i = 0; i < 4; ++i) {
+        auto p = std::make_shared<ph::patch>();
+        p->tag = "WindowsClient_100500";
+        p->name = "PH_Redist_config" + std::to_string(i) + ".ini";
+        p->file_size = content.size();
+        p->hash = ph::hasher::hash(content.data(), content.size());
+        p->data = content.data();
+        index.put(std::move(p));
+    }
+
+    // what the client sends
+    std::vector<uint8_t> request_bytes;
+    {
+        auto buffer = std::make_unique<buffer_t>();
+        ph::event_loop_stream_wrapper stream(*buffer);
+        ph::get_patches_request request;
+        request.tag = "WindowsClient_100500";
+        request.write(stream);
+        const auto [data, size] = buffer->used_chunk();
+        request_bytes.assign((const uint8_t*)data, (const uint8_t*)data + size);
+    }
+
+    reusable_buffer in, out;
+    run("new/delete", requests, [&] {
+        handle(request_bytes, in, out, index,
+            [](auto& stream) { return ph::message::peek_request(stream); },
+            [] { return new ph::get_patches_response; },
+            [](ph::message* msg, bool) { delete msg; });
+    });
+    ph::message_pool pool;
+    run("message pool", requests, [&] {
+        handle(request_bytes, in, out, index,
+            [&](auto& stream) { return pool.peek_request(stream); },
+            [&] { return pool.acquire<ph::get_patches_response>(); },
+            [&](ph::message* msg, bool request) { pool.release(msg, request); });
+    });
+
+    index.for_each([](const auto& p) {
+        p->data = nullptr;
+    });
+}
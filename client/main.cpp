@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
@@ -7,9 +8,6 @@
 #include "consolelib/disco.h"
 #include "hope-io/net/init.h"
 
-char* load_file(const std::string& filename, uint32_t& size);
-void write_to_file(const std::string& filename, void* data, uint32_t size);
-
 int main(int argc, char *argv[]) {
     std::string ip = "127.0.0.1";
     if (argc > 1) {
@@ -49,10 +47,11 @@ int main(int argc, char *argv[]) {
                     auto p = std::make_shared<ph::patch>();
                     p->name = "PH_Redist_" + entry.path().filename().string();
                     p->tag = platform + "_" + std::to_string(revision);
-                    p->data = (uint8_t*)load_file(entry.path().string(), p->file_size);
-                    if (p->data == nullptr) {
+                    p->source = ph::create_file_source(entry.path().string());
+                    if (p->source == nullptr) {
                         std::cout << "Cannot load file[" << entry.path().string() << "]\n";
                     } else {
+                        p->file_size = p->source->size();
                         plist.push_back(std::move(p));
                         std::cout << entry.path().string() << "\n";
                     }
@@ -74,10 +73,11 @@ int main(int argc, char *argv[]) {
         auto patch = std::make_shared<ph::patch>();
         patch->name = p.filename().string();
         patch->tag = platform + "_" + std::to_string(revision);
-        patch->data = (uint8_t*)load_file(p.string(), patch->file_size);
-        if (patch->data == nullptr) {
+        patch->source = ph::create_file_source(p.string());
+        if (patch->source == nullptr) {
             std::cout << "Cannot load file\n";
         } else {
+            patch->file_size = patch->source->size();
             const auto uplaoded = client->upload({patch} );
             std::cout << "Uploaded patches:\n";
             for (const auto& p : uplaoded) {
@@ -85,14 +85,86 @@ int main(int argc, char *argv[]) {
             }
         }
     });
+    invoker.create_function("upload_parallel", [client](const std::string& platform,
+        std::size_t revision, const std::string& filepath, std::size_t connections) {
+        std::cout << "Upload patch file[" << filepath << "] over " << connections << " connections...\n";
+        const auto uploaded = client->upload_parallel(platform + "_" + std::to_string(revision), filepath, connections);
+        std::cout << "Uploaded patches:\n";
+        for (const auto& p : uploaded) {
+            p->print();
+        }
+    });
     invoker.create_function("download", [client](const std::string& platform, std::size_t revision, const std::string& outdir) {
         std::cout << "Download patch files[" << platform << "]" "[" << revision <<"]" << " to[" << outdir << "]...\n";
         const auto tag = platform + "_" + std::to_string(revision);
-        const auto downloaded = client->download(tag);
+        // every chunk lands in the preallocated file as soon as it is read from socket
+        const auto downloaded = client->download(tag, [&outdir](const ph::patch& p) {
+            return ph::create_file_sink(outdir + "/" + p.name, p.file_size);
+        });
+        for (const auto& p : downloaded) {
+            p->print();
+        }
+    });
+    invoker.create_function("upload_local", [client](const std::string& platform,
+        std::size_t revision, const std::string& filepath) {
+        std::cout << "Upload local patch file[" << filepath << "]...\n";
+        const auto uploaded = client->upload_files(platform + "_" + std::to_string(revision), { filepath });
+        std::cout << "Uploaded patches:\n";
+        for (const auto& p : uploaded) {
+            p->print();
+        }
+    });
+    invoker.create_function("download_local", [client](const std::string& platform, std::size_t revision, const std::string& outdir) {
+        std::cout << "Copy local patch files[" << platform << "]" "[" << revision <<"]" << " to[" << outdir << "]...\n";
+        const auto downloaded = client->download_files(platform + "_" + std::to_string(revision), outdir);
+        for (const auto& p : downloaded) {
+            p->print();
+        }
+    });
+    invoker.create_function("sync", [client](const std::string& platform, std::size_t revision, const std::string& outdir) {
+        std::cout << "Sync patch files[" << platform << "]" "[" << revision <<"]" << " to[" << outdir << "]...\n";
+        const auto tag = platform + "_" + std::to_string(revision);
+        ph::client::plist_t local;
+        try {
+            for (const auto& entry : std::filesystem::directory_iterator(outdir)) {
+                if (entry.is_regular_file()) {
+                    if (auto source = ph::create_file_source(entry.path().string())) {
+                        auto p = std::make_shared<ph::patch>();
+                        p->name = entry.path().filename().string();
+                        p->tag = tag;
+                        p->file_size = source->size();
+                        p->hash = ph::hash_source(*source);
+                        local.push_back(std::move(p));
+                    }
+                }
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << "\n";
+        }
+        const auto downloaded = client->sync(tag, local, [&outdir](const ph::patch& p) {
+            return ph::create_file_sink(outdir + "/" + p.name, p.file_size);
+        });
+        std::cout << "Local files:" << local.size() << " Downloaded:" << downloaded.size() << '\n';
+        for (const auto& p : downloaded) {
+            p->print();
+        }
+    });
+    invoker.create_function("download_tags", [client](const std::string& tags, const std::string& outdir) {
+        std::cout << "Download patch files[" << tags << "]" << " to[" << outdir << "]...\n";
+        std::vector<std::string> tag_list;
+        std::size_t begin = 0;
+        while (begin <= tags.size()) {
+            const auto end = std::min(tags.find(',', begin), tags.size());
+            if (end > begin) {
+                tag_list.emplace_back(tags.substr(begin, end - begin));
+            }
+            begin = end + 1;
+        }
+        const auto downloaded = client->download_batch(tag_list, [&outdir](const ph::patch& p) {
+            return ph::create_file_sink(outdir + "/" + p.name, p.file_size);
+        });
         for (const auto& p : downloaded) {
             p->print();
-            const std::string path = outdir + "/" + p->name;
-            write_to_file(path, p->data, p->file_size);
         }
     });
     invoker.create_function("delete", [client](const std::string& platform, std::size_t revision) {
@@ -114,15 +186,26 @@ int main(int argc, char *argv[]) {
             "-delete all patches for specified revision and platform\n";
         std::cout << R"([upload_file("PlatformName", Revision, "FullPath")])" <<
             "-uploads patch for specified revision and platform\n";
+        std::cout << R"([upload_parallel("PlatformName", Revision, "FullPath", Connections)])" <<
+            "-uploads a large patch in parts sent over several connections at once\n";
         std::cout << R"([upload_from_dir("PlatformName", Revision, "DirPath")])" <<
             "-uploads patches for specified revision and platform\n";
         std::cout << R"([download("PlatformName", Revision, "OutPath")])" <<
             "-downloads patches for specified revision and platform, stores to out dir\n";
+        std::cout << R"([upload_local("PlatformName", Revision, "FullPath")])" <<
+            "-hub on the same host copies the file from its local dir by itself, nothing goes through the socket\n";
+        std::cout << R"([download_local("PlatformName", Revision, "OutPath")])" <<
+            "-copies patches from the cache of the hub on the same host, stores to out dir\n";
+        std::cout << R"([sync("PlatformName", Revision, "OutPath")])" <<
+            "-downloads only patches which are missing in out dir or differ from local files\n";
+        std::cout << R"([download_tags("Tag1,Tag2", "OutPath")])" <<
+            "-downloads patches of all listed tags with one request, stores to out dir\n";
         std::cout << "// ------------------- Examples -------------------//\n";
         std::cout << "delete(\"WindowsClient\", 321800)\n";
         std::cout << "upload_file(\"WindowsClient\", 321800, \"c:/patches/your_app/paks/win0.pak\")\n";
         std::cout << "upload_from_dir(\"WindowsClient\", 321800, \"c:/patches/your_app/paks\")\n";
         std::cout << "download(\"WindowsClient\", 321800, \"c:/game/content/paks/mods\")\n";
+        std::cout << "download_tags(\"WindowsClient_321800,WindowsDLC_321800\", \"c:/game/content/paks/mods\")\n";
     });
     while (!exit) {
         std::string query;
@@ -142,24 +225,3 @@ int main(int argc, char *argv[]) {
 
     return 0;
 }
-
-char* load_file(const std::string& filename, uint32_t& size) {
-    std::ifstream file(filename, std::ios::binary | std::ios::ate);
-    if (!file) return nullptr;
-
-    size = file.tellg();
-    file.seekg(0, std::ios::beg);
-
-    char* buffer = new char[size];
-    if (!file.read(buffer, size)) {
-        delete[] buffer;
-        return nullptr;
-    }
-    return buffer;
-}
-
-void write_to_file(const std::string& filename, void* data, uint32_t size) {
-    std::ofstream file(filename, std::ios::binary);
-    file.write((char*)(data), size);
-    file.close();
-}
@@ -0,0 +1,169 @@
+#include "block_cache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+    void read_block(ph::patch_source& source, uint64_t offset, uint8_t* out, std::size_t size) {
+        for (std::size_t read = 0; read < size;) {
+            const auto count = source.read(offset + read, out + read, size - read);
+            if (count == 0) {
+                throw std::runtime_error("Patch source ended early");
+            }
+            read += count;
+        }
+    }
+
+}
+
+class ph::block_cache::shared_source final : public patch_source {
+public:
+    shared_source(block_cache& in_cache, std::shared_ptr<patch_source> in_source)
+        : m_cache(in_cache), m_source(std::make_shared<guarded_source>()), m_size(in_source->size())
+        , m_id(m_cache.m_next_id++) {
+        m_source->source = std::move(in_source);
+    }
+
+    virtual ~shared_source() override {
+        m_cache.drop(m_id, m_size);
+    }
+
+    // does not cross a block, the reader asks for the rest
+    virtual std::size_t read(uint64_t offset, uint8_t* out, std::size_t size) override {
+        if (m_cache.m_budget == 0) {
+            std::lock_guard lock(m_source->mutex);
+            const auto count = m_source->source->read(offset, out, size);
+            m_cache.m_read_bytes.fetch_add(count, std::memory_order_relaxed);
+            return count;
+        }
+        const auto& b = m_cache.find(m_id, *m_source, offset / m_cache.m_block_size);
+        const auto position = std::size_t(offset % m_cache.m_block_size);
+        const auto count = std::min(size, b.size - position);
+        std::memcpy(out, b.data.get() + position, count);
+        return count;
+    }
+
+    virtual uint64_t size() const override {
+        return m_size;
+    }
+
+    // every missing block is asked for, the reader waits for the first one
+    virtual bool ready(uint64_t offset, std::size_t size, std::function<void()> resume) override {
+        // a broken source is read in place, so the reader learns what is wrong
+        if (m_cache.m_budget == 0 || !m_cache.m_executor || m_source->failed.load(std::memory_order_relaxed)) {
+            return true;
+        }
+        auto ready = true;
+        const auto end = std::min(offset + size, m_size);
+        for (auto index = offset / m_cache.m_block_size; index * m_cache.m_block_size < end; ++index) {
+            if (!m_cache.load(m_id, m_source, index, ready ? resume : nullptr)) {
+                ready = false;
+            }
+        }
+        return ready;
+    }
+
+private:
+    block_cache& m_cache;
+    const std::shared_ptr<guarded_source> m_source;
+    const uint64_t m_size;
+    const uint64_t m_id;
+};
+
+std::shared_ptr<ph::patch_source> ph::block_cache::share(std::shared_ptr<patch_source> source) {
+    if (source == nullptr) {
+        return source;
+    }
+    return std::make_shared<shared_source>(*this, std::move(source));
+}
+
+const ph::block_cache::block& ph::block_cache::find(uint64_t id, guarded_source& source, uint64_t index) {
+    const key k{ id, index };
+    if (const auto cached = m_blocks.find(k); cached != m_blocks.end()) {
+        m_lru.splice(m_lru.begin(), m_lru, cached->second);
+        return *cached->second;
+    }
+    // nobody asked whether it is ready, or it is gone since; read in place
+    const auto offset = index * m_block_size;
+    std::lock_guard lock(source.mutex);
+    const auto size = (std::size_t)std::min<uint64_t>(m_block_size, source.source->size() - offset);
+    std::unique_ptr<uint8_t[]> data(new uint8_t[size]);
+    read_block(*source.source, offset, data.get(), size);
+    m_read_bytes.fetch_add(size, std::memory_order_relaxed);
+    insert(k, std::move(data), size);
+    return m_lru.front();
+}
+
+bool ph::block_cache::load(uint64_t id, const std::shared_ptr<guarded_source>& source, uint64_t index,
+    std::function<void()> resume) {
+    const key k{ id, index };
+    if (const auto cached = m_blocks.find(k); cached != m_blocks.end()) {
+        m_lru.splice(m_lru.begin(), m_lru, cached->second);
+        return true;
+    }
+    auto [loading, inserted] = m_loading.try_emplace(k);
+    if (resume) {
+        loading->second.waiting.push_back(std::move(resume));
+    }
+    if (!inserted) {
+        return false;
+    }
+    auto buffer = std::make_shared<std::unique_ptr<uint8_t[]>>();
+    auto size = std::make_shared<std::size_t>(0);
+    m_executor([this, source, buffer, size, offset = index * m_block_size] {
+        try {
+            std::lock_guard lock(source->mutex);
+            *size = (std::size_t)std::min<uint64_t>(m_block_size, source->source->size() - offset);
+            std::unique_ptr<uint8_t[]> data(new uint8_t[*size]);
+            read_block(*source->source, offset, data.get(), *size);
+            m_read_bytes.fetch_add(*size, std::memory_order_relaxed);
+            *buffer = std::move(data);
+        } catch (const std::exception&) {
+            source->failed.store(true, std::memory_order_relaxed);
+        }
+    }, [this, k, buffer, size] {
+        loaded(k, std::move(*buffer), *size);
+    });
+    return false;
+}
+
+void ph::block_cache::loaded(const key& k, std::unique_ptr<uint8_t[]> data, std::size_t size) {
+    auto done = m_loading.extract(k);
+    if (done.empty()) {
+        return;
+    }
+    if (data != nullptr && !done.mapped().dropped && m_blocks.count(k) == 0) {
+        insert(k, std::move(data), size);
+    }
+    for (auto& resume : done.mapped().waiting) {
+        resume();
+    }
+}
+
+void ph::block_cache::insert(const key& k, std::unique_ptr<uint8_t[]> data, std::size_t size) {
+    m_lru.push_front(block{ k, std::move(data), size });
+    m_blocks.emplace(k, m_lru.begin());
+    m_resident += size;
+    // the block just read stays even if it alone is over the budget
+    while (m_resident > m_budget && m_lru.size() > 1) {
+        m_resident -= m_lru.back().size;
+        m_blocks.erase(m_lru.back().k);
+        m_lru.pop_back();
+    }
+}
+
+void ph::block_cache::drop(uint64_t id, uint64_t size) {
+    for (uint64_t index = 0; index * m_block_size < size && !(m_blocks.empty() && m_loading.empty()); ++index) {
+        const key k{ id, index };
+        if (const auto loading = m_loading.find(k); loading != m_loading.end()) {
+            loading->second.dropped = true;
+        }
+        if (const auto cached = m_blocks.find(k); cached != m_blocks.end()) {
+            m_resident -= cached->second->size;
+            m_lru.erase(cached->second);
+            m_blocks.erase(cached);
+        }
+    }
+}
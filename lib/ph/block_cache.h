@@ -0,0 +1,105 @@
+/* Copyright (C) 2025 Gleb Bezborodov - All Rights Reserved
+* You may use, distribute and modify this code under the
+ * terms of the MIT license.
+ *
+ * You should have received a copy of the MIT license with
+ * this file. If not, please write to: bezborodoff.gleb@gmail.com, or visit : https://github.com/glensand/patch-hub
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "patch_source.h"
+
+namespace ph {
+
+    // disk blocks of patches served from disk, shared by all downloads of a patch: however many clients
+    // read it at once, every block is read from the disk once and copied from memory afterwards.
+    // Least recently used blocks over the budget are dropped. Shared sources are read on one thread
+    // and must not outlive the cache; read_bytes() is thread safe.
+    // With an executor, ready() of a shared source brings missing blocks through it: one disk read per block
+    // however many readers wait for it, they are all resumed once it is in
+    class block_cache final {
+    public:
+        // runs read somewhere else, then done back on the thread of the cache
+        using executor_t = std::function<void(std::function<void()> read, std::function<void()> done)>;
+
+        explicit block_cache(uint64_t budget, std::size_t block_size = 1024 * 1024, executor_t executor = {})
+            : m_budget(budget), m_block_size(block_size), m_executor(std::move(executor)) { }
+        block_cache(const block_cache&) = delete;
+        block_cache& operator=(const block_cache&) = delete;
+
+        // reads of the source go through the cache, with zero budget they are only counted
+        std::shared_ptr<patch_source> share(std::shared_ptr<patch_source> source);
+
+        // bytes read from underlying sources
+        uint64_t read_bytes() const { return m_read_bytes.load(std::memory_order_relaxed); }
+        uint64_t resident() const { return m_resident; }
+
+    private:
+        class shared_source;
+
+        // underlying source, read by the executor and by the cache thread in turn
+        struct guarded_source final {
+            std::mutex mutex;
+            std::shared_ptr<patch_source> source;
+            std::atomic_bool failed{ false };
+        };
+
+        struct key final {
+            uint64_t source;
+            uint64_t index;
+            bool operator==(const key& other) const noexcept {
+                return source == other.source && index == other.index;
+            }
+        };
+        struct key_hash final {
+            std::size_t operator()(const key& k) const noexcept {
+                return std::hash<uint64_t>{}(k.source * 0x9e3779b97f4a7c15ULL ^ k.index);
+            }
+        };
+        struct block final {
+            key k;
+            std::unique_ptr<uint8_t[]> data;
+            std::size_t size;
+        };
+        using lru_t = std::list<block>;
+
+        // block of the source holding the offset, read from the source if it is not cached
+        const block& find(uint64_t id, guarded_source& source, uint64_t index);
+        // true if the block is cached, otherwise its read is started unless it is already going
+        bool load(uint64_t id, const std::shared_ptr<guarded_source>& source, uint64_t index,
+            std::function<void()> resume);
+        void loaded(const key& k, std::unique_ptr<uint8_t[]> data, std::size_t size);
+        void insert(const key& k, std::unique_ptr<uint8_t[]> data, std::size_t size);
+        // source is gone, so are its blocks
+        void drop(uint64_t id, uint64_t size);
+
+        // most recently used first
+        lru_t m_lru;
+        std::unordered_map<key, lru_t::iterator, key_hash> m_blocks;
+        struct loading final {
+            std::vector<std::function<void()>> waiting;
+            // source is gone meanwhile, its readers are resumed anyway and read whatever replaced it
+            bool dropped{ false };
+        };
+        // blocks being read by the executor
+        std::unordered_map<key, loading, key_hash> m_loading;
+        const uint64_t m_budget;
+        const std::size_t m_block_size;
+        const executor_t m_executor;
+        uint64_t m_resident{ 0 };
+        uint64_t m_next_id{ 0 };
+        std::atomic<uint64_t> m_read_bytes{ 0 };
+    };
+
+}
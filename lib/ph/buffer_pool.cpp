@@ -0,0 +1,52 @@
+#include "buffer_pool.h"
+
+ph::buffer_pool::~buffer_pool() {
+    for (auto* buffer : m_free) {
+        delete buffer;
+    }
+}
+
+ph::buffer_pool::handle ph::buffer_pool::acquire() {
+    buffer_t* buffer = nullptr;
+    {
+        std::lock_guard lock(m_mutex);
+        if (!m_free.empty()) {
+            buffer = m_free.back();
+            m_free.pop_back();
+        } else {
+            ++m_created;
+        }
+    }
+    if (buffer == nullptr) {
+        // default init, payload part is not zeroed
+        buffer = new buffer_t;
+    }
+    buffer->reset();
+    return handle(buffer, deleter{ this });
+}
+
+void ph::buffer_pool::release(buffer_t* buffer) {
+    {
+        std::lock_guard lock(m_mutex);
+        if (m_free.size() < m_max_idle) {
+            m_free.push_back(buffer);
+            return;
+        }
+    }
+    delete buffer;
+}
+
+std::size_t ph::buffer_pool::idle() const {
+    std::lock_guard lock(m_mutex);
+    return m_free.size();
+}
+
+std::size_t ph::buffer_pool::created() const {
+    std::lock_guard lock(m_mutex);
+    return m_created;
+}
+
+ph::buffer_pool& ph::buffer_pool::shared() {
+    static buffer_pool pool;
+    return pool;
+}
@@ -0,0 +1,57 @@
+/* Copyright (C) 2025 Gleb Bezborodov - All Rights Reserved
+* You may use, distribute and modify this code under the
+ * terms of the MIT license.
+ *
+ * You should have received a copy of the MIT license with
+ * this file. If not, please write to: bezborodoff.gleb@gmail.com, or visit : https://github.com/glensand/patch-hub
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "hope-io/net/event_loop.h"
+
+namespace ph {
+
+    // chunk buffers shared by transfers: a buffer is held only while a message is sent or received,
+    // so memory follows count of transfers in flight, not count of clients. Thread safe
+    class buffer_pool final {
+    public:
+        using buffer_t = hope::io::event_loop::fixed_size_buffer;
+
+        struct deleter final {
+            void operator()(buffer_t* buffer) const { pool->release(buffer); }
+            buffer_pool* pool;
+        };
+        using handle = std::unique_ptr<buffer_t, deleter>;
+
+        // idle buffers above the limit are freed
+        explicit buffer_pool(std::size_t max_idle = 4) : m_max_idle(max_idle) { }
+        buffer_pool(const buffer_pool&) = delete;
+        buffer_pool& operator=(const buffer_pool&) = delete;
+        ~buffer_pool();
+
+        // buffer is reset, the pool must outlive it
+        handle acquire();
+
+        std::size_t idle() const;
+        // buffers ever allocated by the pool
+        std::size_t created() const;
+
+        // the one used by clients
+        static buffer_pool& shared();
+
+    private:
+        void release(buffer_t* buffer);
+
+        mutable std::mutex m_mutex;
+        std::vector<buffer_t*> m_free;
+        const std::size_t m_max_idle;
+        std::size_t m_created{ 0 };
+    };
+
+}
@@ -1,41 +1,126 @@
 #include "client.h"
 
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
 
 #include "hope-io/net/stream.h"
+#include "patch_sink.h"
+#include "patch_source.h"
 #include "hope-io/net/factory.h"
 #include "message.h"
+#include "buffer_pool.h"
+#include "hash_ring.h"
 #include "hope-io/net/event_loop.h"
 
 namespace {
 
+    // bytes of the origin starting at the offset, a part of a patch sent on its own
+    class range_source final : public ph::patch_source {
+    public:
+        range_source(std::shared_ptr<ph::patch_source> in_origin, uint64_t in_offset, uint64_t in_size)
+            : m_origin(std::move(in_origin)), m_offset(in_offset), m_size(in_size) { }
+
+        virtual std::size_t read(uint64_t offset, uint8_t* out, std::size_t size) override {
+            return m_origin->read(m_offset + offset, out, size);
+        }
+        virtual uint64_t size() const override {
+            return m_size;
+        }
+
+    private:
+        std::shared_ptr<ph::patch_source> m_origin;
+        uint64_t m_offset{ 0 };
+        uint64_t m_size{ 0 };
+    };
+
     // so, as i can see i need to implement eventloop client
     // or some static method to peek chunk from stream as it done in read_chunk method
     class client_impl final : public ph::client {
     public:
-        client_impl(std::string ip, int port)
-                : m_host(std::move(ip)), m_port(port) {
-            m_stream = hope::io::create_stream();
+        client_impl(std::string ip, int port, uint8_t version)
+                : m_host(std::move(ip)), m_port(port), m_version(version) {
+            m_stream.reset(hope::io::create_stream());
         }
         virtual plist_t list() override {
             ph::list_patches_request req;
+            req.set_version(m_version);
             m_stream->connect(m_host, m_port);
             serialize(req);
             auto response = deserialize<ph::list_patches_response>();
             m_stream->disconnect();
             return response->patches;
         }
+        virtual plist_t list(const std::vector<std::string>& tags) override {
+            ph::list_patches_request req;
+            req.set_version(m_version);
+            req.tags.value = tags;
+            m_stream->connect(m_host, m_port);
+            serialize(req);
+            auto response = deserialize<ph::list_patches_response>();
+            m_stream->disconnect();
+            if (m_version < ph::protocol::filtered && !tags.empty()) {
+                // hubs before it list every tag
+                auto& patches = response->patches;
+                patches.erase(std::remove_if(begin(patches), end(patches), [&tags](const auto& p) {
+                    return std::find(begin(tags), end(tags), p->tag) == end(tags);
+                }), end(patches));
+            }
+            return response->patches;
+        }
         virtual plist_t download(const std::string& tag) override {
+            return download(tag, sink_factory_t{});
+        }
+        virtual plist_t download(const std::string& tag, const sink_factory_t& sinks) override {
             ph::get_patches_request req;
+            req.set_version(m_version);
             req.tag = tag;
             m_stream->connect(m_host, m_port);
             serialize(req);
-            auto response = deserialize<ph::get_patches_response>();
+            auto response = deserialize<ph::get_patches_response>([&sinks](ph::get_patches_response& msg) {
+                msg.sink_factory = sinks;
+            });
+            m_stream->disconnect();
+            return response->patches;
+        }
+        virtual plist_t download_batch(const std::vector<std::string>& tags) override {
+            return download_batch(tags, sink_factory_t{});
+        }
+        virtual plist_t download_batch(const std::vector<std::string>& tags, const sink_factory_t& sinks) override {
+            ph::get_batch_request req;
+            req.set_version(m_version);
+            req.tags = tags;
+            m_stream->connect(m_host, m_port);
+            serialize(req);
+            auto response = deserialize<ph::get_batch_response>([&sinks](ph::get_batch_response& msg) {
+                msg.sink_factory = sinks;
+            });
+            m_stream->disconnect();
+            return response->patches;
+        }
+        virtual plist_t sync(const std::string& tag, const plist_t& local, const sink_factory_t& sinks) override {
+            ph::sync_request req;
+            req.set_version(m_version);
+            req.tag = tag;
+            req.local = local;
+            m_stream->connect(m_host, m_port);
+            serialize(req);
+            auto response = deserialize<ph::sync_response>([&sinks](ph::sync_response& msg) {
+                msg.sink_factory = sinks;
+            });
             m_stream->disconnect();
             return response->patches;
         }
         virtual plist_t upload(const plist_t& plist) override {
             ph::upload_patch_request request;
+            request.set_version(m_version);
             request.patches = plist;
             m_stream->connect(m_host, m_port);
             serialize(request);
@@ -43,8 +128,42 @@ namespace {
             m_stream->disconnect();
             return response->patches;
         }
+        virtual plist_t upload_changed(const plist_t& plist) override {
+            ph::offer_request offer;
+            offer.set_version(m_version);
+            for (const auto& p : plist) {
+                auto meta = std::make_shared<ph::patch>();
+                meta->name = p->name;
+                meta->tag = p->tag;
+                meta->file_size = p->file_size;
+                meta->hash = p->data != nullptr ? ph::hasher::hash(p->data, p->file_size) : ph::hash_source(*p->source);
+                offer.patches.push_back(std::move(meta));
+            }
+            m_stream->connect(m_host, m_port);
+            serialize(offer);
+            auto offer_response = deserialize<ph::offer_response>();
+            m_stream->disconnect();
+
+            std::unordered_set<std::string> missing;
+            for (const auto& p : offer_response->missing) {
+                missing.emplace(p->tag + "/" + p->name);
+            }
+            plist_t to_upload;
+            plist_t linked;
+            for (std::size_t i = 0; i < plist.size(); ++i) {
+                if (missing.count(plist[i]->tag + "/" + plist[i]->name) != 0) {
+                    to_upload.push_back(plist[i]);
+                } else {
+                    linked.push_back(offer.patches[i]);
+                }
+            }
+            auto result = to_upload.empty() ? plist_t{} : upload(to_upload);
+            result.insert(end(result), begin(linked), end(linked));
+            return result;
+        }
         virtual plist_t pdelete(const std::string& tag) override {
             ph::delete_patch_request request;
+            request.set_version(m_version);
             request.tag = tag;
             m_stream->connect(m_host, m_port);
             serialize(request);
@@ -52,36 +171,243 @@ namespace {
             m_stream->disconnect();
             return response->removed_patches;
         }
+        virtual changes subscribe(const std::string& prefix, uint64_t after, std::chrono::milliseconds timeout) override {
+            ph::subscribe_request request;
+            request.set_version(m_version);
+            request.prefix = prefix;
+            request.after = after;
+            request.timeout = (uint32_t)std::clamp<int64_t>(timeout.count(), 0, UINT32_MAX);
+            m_stream->connect(m_host, m_port);
+            serialize(request);
+            auto response = deserialize<ph::subscribe_response>();
+            m_stream->disconnect();
+            return changes{ response->sequence, response->missed != 0, std::move(response->tags) };
+        }
+        virtual plist_t upload_files(const std::string& tag, const std::vector<std::string>& paths) override {
+            ph::local_upload_request request;
+            request.set_version(m_version);
+            for (const auto& path : paths) {
+                auto p = std::make_shared<ph::patch>();
+                p->name = std::filesystem::path(path).filename().string();
+                p->tag = tag;
+                p->file_size = std::filesystem::file_size(path);
+                request.patches.push_back(std::move(p));
+                request.paths.push_back(std::filesystem::absolute(path).string());
+            }
+            try {
+                m_stream->connect(m_host, m_port);
+                serialize(request);
+                auto response = deserialize<ph::local_upload_response>();
+                m_stream->disconnect();
+                if (response->patches.size() == request.patches.size()) {
+                    return response->patches;
+                }
+            } catch (const std::exception&) {
+                // e.g. hub before the fast path closes the connection
+                m_stream->disconnect();
+            }
+            plist_t plist;
+            for (std::size_t i = 0; i < paths.size(); ++i) {
+                auto& p = request.patches[i];
+                p->source = ph::create_file_source(paths[i]);
+                if (p->source == nullptr) {
+                    throw std::runtime_error("Cannot open file: " + paths[i]);
+                }
+                plist.push_back(p);
+            }
+            return upload(plist);
+        }
+        virtual plist_t download_files(const std::string& tag, const std::string& dir) override {
+            ph::local_download_request request;
+            request.set_version(m_version);
+            request.tag = tag;
+            std::unique_ptr<ph::local_download_response> response;
+            try {
+                m_stream->connect(m_host, m_port);
+                serialize(request);
+                response = deserialize<ph::local_download_response>();
+                m_stream->disconnect();
+            } catch (const std::exception&) {
+                m_stream->disconnect();
+            }
+            if (response != nullptr && response->paths.size() == response->patches.size() && copy(*response, dir)) {
+                return response->patches;
+            }
+            return download(tag, [&dir](const ph::patch& p) {
+                return ph::create_file_sink(dir + "/" + p.name, p.file_size);
+            });
+        }
+        virtual plist_t upload_parallel(const std::string& tag, const std::string& path, std::size_t connections,
+            uint64_t part_size) override {
+            auto p = std::make_shared<ph::patch>();
+            p->name = std::filesystem::path(path).filename().string();
+            p->tag = tag;
+            p->file_size = std::filesystem::file_size(path);
+            const auto parts = part_size == 0 ? 1 : (p->file_size + part_size - 1) / part_size;
+            uint64_t id = 0;
+            if (connections > 1 && parts > 1) {
+                ph::upload_begin_request begin;
+                begin.set_version(m_version);
+                begin.tag = tag;
+                begin.name = p->name;
+                begin.file_size = p->file_size;
+                try {
+                    m_stream->connect(m_host, m_port);
+                    serialize(begin);
+                    auto response = deserialize<ph::upload_begin_response>();
+                    m_stream->disconnect();
+                    id = response->upload;
+                } catch (const std::exception&) {
+                    // e.g. hub before parallel uploads closes the connection
+                    m_stream->disconnect();
+                }
+            }
+            if (id == 0) {
+                p->source = ph::create_file_source(path);
+                if (p->source == nullptr) {
+                    throw std::runtime_error("Cannot open file: " + path);
+                }
+                return upload({ p });
+            }
+            // connections take the next part until none is left, so slow ones do not hold the rest back
+            std::atomic<uint64_t> next{ 0 };
+            std::mutex mutex;
+            std::exception_ptr failure;
+            const auto send = [&](client_impl& c) {
+                try {
+                    for (auto i = next++; i < parts; i = next++) {
+                        const auto offset = i * part_size;
+                        c.upload_part(id, *p, path, offset, std::min(part_size, p->file_size - offset));
+                    }
+                } catch (...) {
+                    std::lock_guard lock(mutex);
+                    failure = std::current_exception();
+                    next = parts;
+                }
+            };
+            std::vector<std::thread> threads;
+            for (uint64_t i = 1; i < std::min<uint64_t>(connections, parts); ++i) {
+                threads.emplace_back([&] {
+                    client_impl c(m_host, m_port, m_version);
+                    send(c);
+                });
+            }
+            send(*this);
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            if (failure != nullptr) {
+                std::rethrow_exception(failure);
+            }
+            ph::upload_commit_request commit;
+            commit.set_version(m_version);
+            commit.upload = id;
+            m_stream->connect(m_host, m_port);
+            serialize(commit);
+            auto response = deserialize<ph::upload_commit_response>();
+            m_stream->disconnect();
+            if (response->patches.empty()) {
+                throw std::runtime_error("Upload is not committed: " + tag + "/" + p->name);
+            }
+            return response->patches;
+        }
     private:
+        // every part reads the file on its own, file sources are not shared between connections
+        void upload_part(uint64_t id, const ph::patch& p, const std::string& path, uint64_t offset, uint64_t size) {
+            auto source = ph::create_file_source(path);
+            if (source == nullptr) {
+                throw std::runtime_error("Cannot open file: " + path);
+            }
+            auto part = std::make_shared<ph::patch>();
+            part->name = p.name;
+            part->tag = p.tag;
+            part->file_size = size;
+            part->source = std::make_shared<range_source>(std::move(source), offset, size);
+            ph::upload_part_request request;
+            request.set_version(m_version);
+            request.upload = id;
+            request.offset = offset;
+            request.patches.push_back(std::move(part));
+            m_stream->connect(m_host, m_port);
+            serialize(request);
+            auto response = deserialize<ph::upload_part_response>();
+            m_stream->disconnect();
+            if (response->received == 0) {
+                throw std::runtime_error("Upload part is not taken: " + p.tag + "/" + p.name);
+            }
+        }
+        // files of the hub cache are copied, not linked, a change of the copy must not reach the hub
+        static bool copy(const ph::local_download_response& response, const std::string& dir) {
+            std::error_code ec;
+            std::filesystem::create_directories(dir, ec);
+            for (std::size_t i = 0; i < response.patches.size(); ++i) {
+                const auto& p = *response.patches[i];
+                if (response.paths[i].empty()) {
+                    return false;
+                }
+                // the file may have been replaced since the hub answered, bytes are checked as they are copied
+                const auto source = ph::create_held_file_source(response.paths[i]);
+                if (source == nullptr || source->size() != p.file_size) {
+                    return false;
+                }
+                const auto sink = ph::create_file_sink(dir + "/" + p.name, p.file_size);
+                try {
+                    if (sink == nullptr || ph::hash_copy(*source, *sink) != p.hash) {
+                        return false;
+                    }
+                } catch (const std::exception&) {
+                    return false;
+                }
+            }
+            return true;
+        }
         void serialize(ph::message& req) const {
-            hope::io::event_loop::fixed_size_buffer b;
+            const auto b = ph::buffer_pool::shared().acquire();
+            // payload of patches in memory goes to the socket right from the patch. The stream has no gather write,
+            // a chunk goes out in a few writes; with chunks this large that measures the same as one writev
+            // on a loopback socket (bench/gather.cpp)
+            std::vector<ph::chunk_segment> segments;
             bool complete = false;
             while (!complete) {
-                ph::event_loop_stream_wrapper stream(b);
+                ph::event_loop_stream_wrapper stream(*b, segments);
                 complete = req.write(stream);
-                const auto [dat, count] = b.used_chunk();
-                m_stream->write(dat, count);
-                b.reset();
+                for (const auto& [dat, count] : segments) {
+                    m_stream->write(dat, count);
+                }
+                b->reset();
             }
         }
+        // prepare is called before the first read, e.g. to attach sinks
         template<typename T>
-        T* deserialize() const {
-            hope::io::event_loop::fixed_size_buffer b;
+        std::unique_ptr<T> deserialize(const std::function<void(T&)>& prepare = {}) const {
+            const auto buffer = ph::buffer_pool::shared().acquire();
+            auto& b = *buffer;
             read_chunk(b);
-            ph::event_loop_stream_wrapper stream(b);
-            auto msg = ph::message::peek_response(stream);
-            auto complete = false;
+            ph::event_loop_stream_wrapper first_stream(b);
+            std::unique_ptr<ph::message> peeked(ph::message::peek_response(first_stream));
+            // the connection is not what it was taken for, or the stream is damaged
+            if (peeked == nullptr || peeked->get_type() != T{}.get_type()) {
+                throw std::runtime_error("Unexpected response type");
+            }
+            auto msg = std::unique_ptr<T>(static_cast<T*>(peeked.release()));
+            if (prepare) {
+                prepare(*msg);
+            }
+            auto complete = msg->read(first_stream);
             while (!complete) {
+                read_chunk(b);
+                // every chunk starts with its own frame header, so the stream state starts over
+                ph::event_loop_stream_wrapper stream(b);
                 complete = msg->read(stream);
-                if (!complete) {
-                    read_chunk(b);
-                }
             }
-            return (T*)msg;
+            return msg;
         }
         void read_chunk(hope::io::event_loop::fixed_size_buffer& b) const {
             b.reset();
             const auto size = m_stream->read<uint32_t>();
+            if (size < sizeof(size) || size > b.free_space()) {
+                throw std::runtime_error("Chunk does not fit the buffer: " + std::to_string(size));
+            }
             b.write(&size, sizeof(size));
             const auto [dat, count] = b.free_chunk();
             if (size - sizeof(size) > 0) {
@@ -89,13 +415,196 @@ namespace {
                 b.handle_write(size - sizeof(size));
             }
         }
-        hope::io::stream* m_stream{ nullptr };
+        std::unique_ptr<hope::io::stream> m_stream;
         std::string m_host;
         int m_port{ 0 };
+        uint8_t m_version{ ph::protocol::current };
+    };
+
+    class replicated_client final : public ph::client {
+    public:
+        replicated_client(const endpoint& primary, const std::vector<endpoint>& replicas, uint8_t version)
+            : m_primary(primary), m_replicas(replicas), m_version(version) {
+            m_primary_client.reset(create(primary.host, primary.port, version));
+            for (const auto& replica : m_replicas) {
+                m_replica_clients.emplace_back(create(replica.host, replica.port, version));
+            }
+        }
+        virtual plist_t list() override {
+            return read([](client& c) { return c.list(); });
+        }
+        virtual plist_t list(const std::vector<std::string>& tags) override {
+            return read([&tags](client& c) { return c.list(tags); });
+        }
+        virtual plist_t download(const std::string& tag) override {
+            return read([&tag](client& c) { return c.download(tag); });
+        }
+        virtual plist_t download(const std::string& tag, const sink_factory_t& sinks) override {
+            return read([&](client& c) { return c.download(tag, sinks); });
+        }
+        virtual plist_t download_batch(const std::vector<std::string>& tags) override {
+            return read([&tags](client& c) { return c.download_batch(tags); });
+        }
+        virtual plist_t download_batch(const std::vector<std::string>& tags, const sink_factory_t& sinks) override {
+            return read([&](client& c) { return c.download_batch(tags, sinks); });
+        }
+        virtual plist_t sync(const std::string& tag, const plist_t& local, const sink_factory_t& sinks) override {
+            return read([&](client& c) { return c.sync(tag, local, sinks); });
+        }
+        virtual plist_t upload(const plist_t& plist) override {
+            return m_primary_client->upload(plist);
+        }
+        virtual plist_t upload_changed(const plist_t& plist) override {
+            return m_primary_client->upload_changed(plist);
+        }
+        virtual plist_t pdelete(const std::string& tag) override {
+            return m_primary_client->pdelete(tag);
+        }
+        virtual plist_t upload_files(const std::string& tag, const std::vector<std::string>& paths) override {
+            return m_primary_client->upload_files(tag, paths);
+        }
+        virtual plist_t download_files(const std::string& tag, const std::string& dir) override {
+            return read([&](client& c) { return c.download_files(tag, dir); });
+        }
+        virtual plist_t upload_parallel(const std::string& tag, const std::string& path, std::size_t connections,
+            uint64_t part_size) override {
+            return m_primary_client->upload_parallel(tag, path, connections, part_size);
+        }
+        virtual changes subscribe(const std::string& prefix, uint64_t after, std::chrono::milliseconds timeout) override {
+            // sequences are the primary's own, replicas count theirs
+            return m_primary_client->subscribe(prefix, after, timeout);
+        }
+    private:
+        template<typename TRead>
+        plist_t read(TRead&& f) {
+            for (std::size_t i = 0; i < m_replica_clients.size(); ++i) {
+                const auto id = m_next++ % m_replica_clients.size();
+                try {
+                    return f(*m_replica_clients[id]);
+                } catch (const std::exception&) {
+                    // connection is left in whatever state it failed in, the next request starts over
+                    m_replica_clients[id].reset(create(m_replicas[id].host, m_replicas[id].port, m_version));
+                }
+            }
+            return f(*m_primary_client);
+        }
+
+        const endpoint m_primary;
+        const std::vector<endpoint> m_replicas;
+        const uint8_t m_version;
+        std::unique_ptr<client> m_primary_client;
+        std::vector<std::unique_ptr<client>> m_replica_clients;
+        std::size_t m_next{ 0 };
+    };
+
+    class sharded_client final : public ph::client {
+    public:
+        sharded_client(const std::vector<endpoint>& nodes, uint8_t version, std::size_t virtual_nodes)
+            : m_ring(virtual_nodes) {
+            for (const auto& node : nodes) {
+                const auto size = m_ring.size();
+                m_ring.add(node.host + ":" + std::to_string(node.port));
+                if (m_ring.size() != size) {
+                    m_clients.emplace_back(create(node.host, node.port, version));
+                }
+            }
+        }
+        virtual plist_t list() override {
+            plist_t merged;
+            // a tag moved between nodes may still be listed by both
+            std::unordered_set<std::string> seen;
+            for (const auto& c : m_clients) {
+                for (auto& p : c->list()) {
+                    if (seen.emplace(p->tag + "/" + p->name).second) {
+                        merged.push_back(std::move(p));
+                    }
+                }
+            }
+            return merged;
+        }
+        virtual plist_t list(const std::vector<std::string>& tags) override {
+            if (tags.empty()) {
+                return list();
+            }
+            return split(tags, [](const std::string& tag) -> const std::string& { return tag; },
+                [](client& c, const std::vector<std::string>& owned) { return c.list(owned); });
+        }
+        virtual plist_t download(const std::string& tag) override {
+            return owner(tag).download(tag);
+        }
+        virtual plist_t download(const std::string& tag, const sink_factory_t& sinks) override {
+            return owner(tag).download(tag, sinks);
+        }
+        virtual plist_t download_batch(const std::vector<std::string>& tags) override {
+            return download_batch(tags, sink_factory_t{});
+        }
+        virtual plist_t download_batch(const std::vector<std::string>& tags, const sink_factory_t& sinks) override {
+            return split(tags, [](const std::string& tag) -> const std::string& { return tag; },
+                [&sinks](client& c, const std::vector<std::string>& owned) { return c.download_batch(owned, sinks); });
+        }
+        virtual plist_t sync(const std::string& tag, const plist_t& local, const sink_factory_t& sinks) override {
+            return owner(tag).sync(tag, local, sinks);
+        }
+        virtual plist_t upload(const plist_t& plist) override {
+            return split(plist, [](const std::shared_ptr<ph::patch>& p) -> const std::string& { return p->tag; },
+                [](client& c, const plist_t& owned) { return c.upload(owned); });
+        }
+        virtual plist_t upload_changed(const plist_t& plist) override {
+            return split(plist, [](const std::shared_ptr<ph::patch>& p) -> const std::string& { return p->tag; },
+                [](client& c, const plist_t& owned) { return c.upload_changed(owned); });
+        }
+        virtual plist_t pdelete(const std::string& tag) override {
+            return owner(tag).pdelete(tag);
+        }
+        virtual plist_t upload_files(const std::string& tag, const std::vector<std::string>& paths) override {
+            return owner(tag).upload_files(tag, paths);
+        }
+        virtual plist_t download_files(const std::string& tag, const std::string& dir) override {
+            return owner(tag).download_files(tag, dir);
+        }
+        virtual plist_t upload_parallel(const std::string& tag, const std::string& path, std::size_t connections,
+            uint64_t part_size) override {
+            return owner(tag).upload_parallel(tag, path, connections, part_size);
+        }
+        virtual changes subscribe(const std::string&, uint64_t, std::chrono::milliseconds) override {
+            throw std::logic_error("Subscription is per hub, sharded client cannot merge sequences");
+        }
+    private:
+        client& owner(const std::string& tag) const {
+            return *m_clients[m_ring.owner(tag)];
+        }
+        // items are sent to the node owning their tag, one request per node, in order of the nodes
+        template<typename T, typename TTag, typename TRequest>
+        plist_t split(const std::vector<T>& items, TTag&& tag_of, TRequest&& request) const {
+            std::vector<std::vector<T>> owned(m_clients.size());
+            for (const auto& item : items) {
+                owned[m_ring.owner(tag_of(item))].push_back(item);
+            }
+            plist_t result;
+            for (std::size_t i = 0; i < owned.size(); ++i) {
+                if (!owned[i].empty()) {
+                    auto part = request(*m_clients[i], owned[i]);
+                    result.insert(end(result), std::make_move_iterator(begin(part)), std::make_move_iterator(end(part)));
+                }
+            }
+            return result;
+        }
+
+        ph::hash_ring m_ring;
+        // by ring node index
+        std::vector<std::unique_ptr<client>> m_clients;
     };
 
 }
 
-ph::client* ph::client::create(const std::string& ip, int port) {
-    return new client_impl(ip, port);
+ph::client* ph::client::create(const std::string& ip, int port, uint8_t version) {
+    return new client_impl(ip, port, version);
+}
+
+ph::client* ph::client::create_replicated(const endpoint& primary, const std::vector<endpoint>& replicas, uint8_t version) {
+    return new replicated_client(primary, replicas, version);
+}
+
+ph::client* ph::client::create_sharded(const std::vector<endpoint>& nodes, uint8_t version, std::size_t virtual_nodes) {
+    return new sharded_client(nodes, version, virtual_nodes);
 }
\ No newline at end of file
@@ -8,6 +8,8 @@
 
 #pragma once
 
+#include <chrono>
+#include <functional>
 #include <vector>
 
 #include "message.h"
@@ -21,13 +23,64 @@ namespace ph {
         using plist_t = std::vector<std::shared_ptr<patch>>;
         // list all available patches, data will be empty
         virtual plist_t list() = 0;
+        // lists patches of the given tags only, empty lists every tag
+        virtual plist_t list(const std::vector<std::string>& tags) = 0;
         // downloads all available patches for tag
         virtual plist_t download(const std::string& tag) = 0;
+        using sink_factory_t = std::function<std::shared_ptr<patch_sink>(const patch&)>;
+        // downloads all available patches for tag, every chunk goes to the patch sink as soon as it is read,
+        // returned patches carry meta only
+        virtual plist_t download(const std::string& tag, const sink_factory_t& sinks) = 0;
+        // downloads patches of all given tags with one request, every patch carries its tag
+        virtual plist_t download_batch(const std::vector<std::string>& tags) = 0;
+        virtual plist_t download_batch(const std::vector<std::string>& tags, const sink_factory_t& sinks) = 0;
+        // local holds name, file_size and hash of every patch the caller already has,
+        // only missing or differing patches of the tag are downloaded to sinks
+        virtual plist_t sync(const std::string& tag, const plist_t& local, const sink_factory_t& sinks) = 0;
         // store or replace specified patches, returns list with uploaded patches
         virtual plist_t upload(const plist_t& plist) = 0;
+        // hashes patches, offers them to the hub and uploads only content the hub does not hold yet,
+        // the rest is linked by the hub. Returns uploaded patches followed by linked ones
+        virtual plist_t upload_changed(const plist_t& plist) = 0;
         // tries to remove specified patches, returns list of removed patches
         virtual plist_t pdelete(const std::string& tag) = 0;
+        // for a hub on the same host: files are named after their file names and copied by the hub itself,
+        // they have to be inside its local dir. Goes through the socket if the hub does not take them
+        virtual plist_t upload_files(const std::string& tag, const std::vector<std::string>& paths) = 0;
+        // for a hub on the same host: files of the tag are copied from the hub cache to the dir and verified,
+        // downloaded through the socket if the hub does not give them out
+        virtual plist_t download_files(const std::string& tag, const std::string& dir) = 0;
+        // uploads a single large file in parts sent over that many connections at once, the hub assembles them
+        // and publishes the patch on commit. Files of a single part and hubs before it get a plain upload
+        virtual plist_t upload_parallel(const std::string& tag, const std::string& path, std::size_t connections,
+            uint64_t part_size = 64 * 1024 * 1024) = 0;
 
-        static client* create(const std::string& ip, int port);
+        struct changes final {
+            // passed to the next subscribe
+            uint64_t sequence{ 0 };
+            // changes were lost (e.g. the hub restarted), everything should be listed again
+            bool missed{ false };
+            std::vector<std::string> tags;
+        };
+        // waits up to timeout for uploads or deletes of tags starting with the prefix
+        // since the sequence of the previous answer, zero at first. Hubs before it close the connection
+        virtual changes subscribe(const std::string& prefix, uint64_t after, std::chrono::milliseconds timeout) = 0;
+
+        // version could be lowered to talk with hubs which do not know about versioned protocol
+        static client* create(const std::string& ip, int port, uint8_t version = protocol::current);
+
+        struct endpoint final {
+            std::string host;
+            int port{ 1556 };
+        };
+        // reads are spread over the replicas in turn, one which does not answer is skipped for the next one
+        // and the primary is the last resort; uploads, deletes and subscriptions go to the primary
+        static client* create_replicated(const endpoint& primary, const std::vector<endpoint>& replicas,
+            uint8_t version = protocol::current);
+        // tags are spread over the nodes by consistent hashing of the tag, every request of a tag goes to
+        // the node which owns it, batches and uploads are split by owner and list asks every node.
+        // Sequences of changes are per hub, so subscribe throws, subscribe to the nodes one by one instead
+        static client* create_sharded(const std::vector<endpoint>& nodes, uint8_t version = protocol::current,
+            std::size_t virtual_nodes = 128);
     };
 }
@@ -0,0 +1,161 @@
+#include "crc32c.h"
+
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define PH_CRC32C_X86 1
+#include <nmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define PH_CRC32C_ARM 1
+#include <arm_acle.h>
+#endif
+
+namespace {
+
+    constexpr uint32_t polynomial = 0x82F63B78;  // reflected Castagnoli
+
+    constexpr std::array<uint32_t, 256> make_table() {
+        std::array<uint32_t, 256> table{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (auto bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ (polynomial & (0u - (crc & 1u)));
+            }
+            table[i] = crc;
+        }
+        return table;
+    }
+
+    constexpr auto table = make_table();
+
+    uint32_t crc32c_sw(uint32_t crc, const uint8_t* data, std::size_t size) noexcept {
+        for (std::size_t i = 0; i < size; ++i) {
+            crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        }
+        return crc;
+    }
+
+    // crc instruction has latency of 3 and throughput of 1, so large inputs are split into three lanes
+    // running in parallel, lanes are merged by shifting register over lane length of zero bytes
+    constexpr std::size_t lane_size = 4096;
+
+    struct lane_shift final {
+        lane_shift() noexcept {
+            uint32_t columns[32];
+            static const uint8_t zeros[lane_size]{};
+            for (auto bit = 0; bit < 32; ++bit) {
+                columns[bit] = crc32c_sw(1u << bit, zeros, lane_size);
+            }
+            for (auto part = 0; part < 4; ++part) {
+                for (uint32_t value = 0; value < 256; ++value) {
+                    uint32_t shifted = 0;
+                    for (auto bit = 0; bit < 8; ++bit) {
+                        if (value & (1u << bit)) {
+                            shifted ^= columns[part * 8 + bit];
+                        }
+                    }
+                    tables[part][value] = shifted;
+                }
+            }
+        }
+        uint32_t operator()(uint32_t crc) const noexcept {
+            return tables[0][crc & 0xff] ^ tables[1][(crc >> 8) & 0xff]
+                ^ tables[2][(crc >> 16) & 0xff] ^ tables[3][crc >> 24];
+        }
+        uint32_t tables[4][256];
+    };
+
+    const lane_shift shift;
+
+#if PH_CRC32C_X86
+#if defined(__GNUC__) || defined(__clang__)
+    __attribute__((target("sse4.2")))
+#endif
+    uint32_t crc32c_hw(uint32_t crc, const uint8_t* data, std::size_t size) noexcept {
+        uint64_t crc64 = crc;
+        for (; size >= 3 * lane_size; size -= 3 * lane_size, data += 3 * lane_size) {
+            uint64_t a = crc64, b = 0, c = 0;
+            for (std::size_t i = 0; i < lane_size; i += sizeof(uint64_t)) {
+                uint64_t va, vb, vc;
+                std::memcpy(&va, data + i, sizeof(va));
+                std::memcpy(&vb, data + lane_size + i, sizeof(vb));
+                std::memcpy(&vc, data + 2 * lane_size + i, sizeof(vc));
+                a = _mm_crc32_u64(a, va);
+                b = _mm_crc32_u64(b, vb);
+                c = _mm_crc32_u64(c, vc);
+            }
+            crc64 = shift(shift((uint32_t)a) ^ (uint32_t)b) ^ (uint32_t)c;
+        }
+        for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), data += sizeof(uint64_t)) {
+            uint64_t value;
+            std::memcpy(&value, data, sizeof(value));
+            crc64 = _mm_crc32_u64(crc64, value);
+        }
+        crc = (uint32_t)crc64;
+        for (; size > 0; --size, ++data) {
+            crc = _mm_crc32_u8(crc, *data);
+        }
+        return crc;
+    }
+
+    bool has_hw() noexcept {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 20)) != 0;
+#else
+        return __builtin_cpu_supports("sse4.2");
+#endif
+    }
+#elif PH_CRC32C_ARM
+    uint32_t crc32c_hw(uint32_t crc, const uint8_t* data, std::size_t size) noexcept {
+        for (; size >= 3 * lane_size; size -= 3 * lane_size, data += 3 * lane_size) {
+            uint32_t a = crc, b = 0, c = 0;
+            for (std::size_t i = 0; i < lane_size; i += sizeof(uint64_t)) {
+                uint64_t va, vb, vc;
+                std::memcpy(&va, data + i, sizeof(va));
+                std::memcpy(&vb, data + lane_size + i, sizeof(vb));
+                std::memcpy(&vc, data + 2 * lane_size + i, sizeof(vc));
+                a = __crc32cd(a, va);
+                b = __crc32cd(b, vb);
+                c = __crc32cd(c, vc);
+            }
+            crc = shift(shift(a) ^ b) ^ c;
+        }
+        for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), data += sizeof(uint64_t)) {
+            uint64_t value;
+            std::memcpy(&value, data, sizeof(value));
+            crc = __crc32cd(crc, value);
+        }
+        for (; size > 0; --size, ++data) {
+            crc = __crc32cb(crc, *data);
+        }
+        return crc;
+    }
+
+    bool has_hw() noexcept {
+        return true;
+    }
+#else
+    uint32_t crc32c_hw(uint32_t crc, const uint8_t* data, std::size_t size) noexcept {
+        return crc32c_sw(crc, data, size);
+    }
+
+    bool has_hw() noexcept {
+        return false;
+    }
+#endif
+
+    const bool use_hw = has_hw();
+
+}
+
+uint32_t ph::crc32c(const void* data, std::size_t size, uint32_t previous) noexcept {
+    const auto bytes = (const uint8_t*)data;
+    const auto crc = use_hw ? crc32c_hw(~previous, bytes, size) : crc32c_sw(~previous, bytes, size);
+    return ~crc;
+}
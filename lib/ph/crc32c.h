@@ -0,0 +1,20 @@
+/* Copyright (C) 2025 Gleb Bezborodov - All Rights Reserved
+* You may use, distribute and modify this code under the
+ * terms of the MIT license.
+ *
+ * You should have received a copy of the MIT license with
+ * this file. If not, please write to: bezborodoff.gleb@gmail.com, or visit : https://github.com/glensand/patch-hub
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+namespace ph {
+
+    // crc32c (Castagnoli), hardware instruction is used when cpu has it (sse4.2 on x86, crc on arm),
+    // chainable: crc32c(b, crc32c(a)) == crc32c(a + b)
+    uint32_t crc32c(const void* data, std::size_t size, uint32_t previous = 0) noexcept;
+
+}
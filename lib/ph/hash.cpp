@@ -0,0 +1,40 @@
+#include "hash.h"
+#include "patch_source.h"
+#include "patch_sink.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+    template<typename F>
+    uint64_t hash_blocks(ph::patch_source& source, F&& f) {
+        constexpr static std::size_t block_size = 1024 * 1024;
+        std::vector<uint8_t> block(std::min<uint64_t>(block_size, source.size()));
+        ph::hasher h;
+        uint64_t offset = 0;
+        while (offset < source.size()) {
+            const auto count = source.read(offset, block.data(),
+                (std::size_t)std::min<uint64_t>(block.size(), source.size() - offset));
+            if (count == 0) {
+                throw std::runtime_error("Patch source ended early");
+            }
+            h.update(block.data(), count);
+            f(offset, block.data(), count);
+            offset += count;
+        }
+        return h.digest();
+    }
+
+}
+
+uint64_t ph::hash_source(patch_source& source) {
+    return hash_blocks(source, [](uint64_t, const uint8_t*, std::size_t) { });
+}
+
+uint64_t ph::hash_copy(patch_source& source, patch_sink& sink) {
+    return hash_blocks(source, [&sink](uint64_t offset, const uint8_t* data, std::size_t size) {
+        sink.write(offset, data, size);
+    });
+}
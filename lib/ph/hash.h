@@ -0,0 +1,145 @@
+/* Copyright (C) 2025 Gleb Bezborodov - All Rights Reserved
+* You may use, distribute and modify this code under the
+ * terms of the MIT license.
+ *
+ * You should have received a copy of the MIT license with
+ * this file. If not, please write to: bezborodoff.gleb@gmail.com, or visit : https://github.com/glensand/patch-hub
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+namespace ph {
+
+    class patch_source;
+    class patch_sink;
+
+    // streaming xxh64, data could be fed by pieces of any size, result does not depend on the split
+    class hasher final {
+    public:
+        explicit hasher(uint64_t seed = 0) {
+            reset(seed);
+        }
+
+        void reset(uint64_t seed = 0) noexcept {
+            m_acc[0] = seed + prime1 + prime2;
+            m_acc[1] = seed + prime2;
+            m_acc[2] = seed;
+            m_acc[3] = seed - prime1;
+            m_seed = seed;
+            m_total = 0;
+            m_tail_size = 0;
+        }
+
+        void update(const void* data, std::size_t size) noexcept {
+            auto input = (const uint8_t*)data;
+            m_total += size;
+            if (m_tail_size + size < stripe) {
+                std::memcpy(m_tail + m_tail_size, input, size);
+                m_tail_size += size;
+                return;
+            }
+            if (m_tail_size > 0) {
+                const auto fill = stripe - m_tail_size;
+                std::memcpy(m_tail + m_tail_size, input, fill);
+                consume(m_tail);
+                input += fill;
+                size -= fill;
+                m_tail_size = 0;
+            }
+            while (size >= stripe) {
+                consume(input);
+                input += stripe;
+                size -= stripe;
+            }
+            std::memcpy(m_tail, input, size);
+            m_tail_size = size;
+        }
+
+        uint64_t digest() const noexcept {
+            uint64_t h;
+            if (m_total >= stripe) {
+                h = rotl(m_acc[0], 1) + rotl(m_acc[1], 7) + rotl(m_acc[2], 12) + rotl(m_acc[3], 18);
+                for (const auto acc : m_acc) {
+                    h ^= round(0, acc);
+                    h = h * prime1 + prime4;
+                }
+            } else {
+                h = m_seed + prime5;
+            }
+            h += m_total;
+            std::size_t offset = 0;
+            for (; offset + 8 <= m_tail_size; offset += 8) {
+                h ^= round(0, read64(m_tail + offset));
+                h = rotl(h, 27) * prime1 + prime4;
+            }
+            if (offset + 4 <= m_tail_size) {
+                h ^= uint64_t(read32(m_tail + offset)) * prime1;
+                h = rotl(h, 23) * prime2 + prime3;
+                offset += 4;
+            }
+            for (; offset < m_tail_size; ++offset) {
+                h ^= m_tail[offset] * prime5;
+                h = rotl(h, 11) * prime1;
+            }
+            h ^= h >> 33;
+            h *= prime2;
+            h ^= h >> 29;
+            h *= prime3;
+            h ^= h >> 32;
+            return h;
+        }
+
+        static uint64_t hash(const void* data, std::size_t size) noexcept {
+            hasher h;
+            h.update(data, size);
+            return h.digest();
+        }
+
+    private:
+        constexpr static std::size_t stripe = 32;
+        constexpr static uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+        constexpr static uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+        constexpr static uint64_t prime3 = 0x165667B19E3779F9ULL;
+        constexpr static uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+        constexpr static uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+        static uint64_t rotl(uint64_t value, int bits) noexcept {
+            return (value << bits) | (value >> (64 - bits));
+        }
+        static uint64_t round(uint64_t acc, uint64_t input) noexcept {
+            acc += input * prime2;
+            return rotl(acc, 31) * prime1;
+        }
+        static uint64_t read64(const uint8_t* data) noexcept {
+            uint64_t value;
+            std::memcpy(&value, data, sizeof(value));
+            return value;
+        }
+        static uint32_t read32(const uint8_t* data) noexcept {
+            uint32_t value;
+            std::memcpy(&value, data, sizeof(value));
+            return value;
+        }
+        void consume(const uint8_t* data) noexcept {
+            for (auto i = 0; i < 4; ++i) {
+                m_acc[i] = round(m_acc[i], read64(data + i * 8));
+            }
+        }
+
+        uint64_t m_acc[4]{};
+        uint64_t m_seed{ 0 };
+        uint64_t m_total{ 0 };
+        uint8_t m_tail[stripe]{};
+        std::size_t m_tail_size{ 0 };
+    };
+
+    // reads whole source block by block
+    uint64_t hash_source(patch_source& source);
+    // copies whole source to the sink block by block, returns hash of what is copied
+    uint64_t hash_copy(patch_source& source, patch_sink& sink);
+
+}
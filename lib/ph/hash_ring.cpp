@@ -0,0 +1,56 @@
+#include "hash_ring.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "hash.h"
+
+ph::hash_ring::hash_ring(std::size_t virtual_nodes)
+    : m_virtual_nodes(std::max<std::size_t>(virtual_nodes, 1)) { }
+
+void ph::hash_ring::add(const std::string& node) {
+    const auto it = std::find(begin(m_nodes), end(m_nodes), node);
+    const auto index = std::size_t(it - begin(m_nodes));
+    if (it == end(m_nodes)) {
+        m_nodes.push_back(node);
+    } else if (std::any_of(begin(m_ring), end(m_ring), [index](const auto& p) { return p.second == index; })) {
+        return;
+    }
+    for (std::size_t i = 0; i < m_virtual_nodes; ++i) {
+        m_ring.emplace_back(point(node + "#" + std::to_string(i)), index);
+    }
+    // ties are broken by index, every client builds the same ring whatever order it adds nodes in
+    std::sort(begin(m_ring), end(m_ring), [this](const auto& l, const auto& r) {
+        return l.first != r.first ? l.first < r.first : m_nodes[l.second] < m_nodes[r.second];
+    });
+    ++m_count;
+}
+
+void ph::hash_ring::remove(const std::string& node) {
+    const auto it = std::find(begin(m_nodes), end(m_nodes), node);
+    if (it == end(m_nodes)) {
+        return;
+    }
+    const auto index = std::size_t(it - begin(m_nodes));
+    const auto size = m_ring.size();
+    m_ring.erase(std::remove_if(begin(m_ring), end(m_ring), [index](const auto& p) { return p.second == index; }),
+        end(m_ring));
+    if (m_ring.size() != size) {
+        --m_count;
+    }
+}
+
+std::size_t ph::hash_ring::owner(std::string_view key) const {
+    if (m_ring.empty()) {
+        throw std::logic_error("Hash ring has no nodes");
+    }
+    const auto hash = point(key);
+    auto it = std::lower_bound(begin(m_ring), end(m_ring), hash,
+        [](const auto& p, uint64_t h) { return p.first < h; });
+    // past the last point the ring wraps around
+    return it == end(m_ring) ? m_ring.front().second : it->second;
+}
+
+uint64_t ph::hash_ring::point(std::string_view key) {
+    return hasher::hash(key.data(), key.size());
+}
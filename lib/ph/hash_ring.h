@@ -0,0 +1,49 @@
+/* Copyright (C) 2025 Gleb Bezborodov - All Rights Reserved
+* You may use, distribute and modify this code under the
+ * terms of the MIT license.
+ *
+ * You should have received a copy of the MIT license with
+ * this file. If not, please write to: bezborodoff.gleb@gmail.com, or visit : https://github.com/glensand/patch-hub
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace ph {
+
+    // consistent hashing of keys (tags) over nodes, every node owns many points of the ring,
+    // a key belongs to the node of the first point after its hash. Adding a node takes about 1/N of the keys,
+    // all of them from the other nodes, and removing one gives only its keys away. Not thread safe
+    class hash_ring final {
+    public:
+        explicit hash_ring(std::size_t virtual_nodes = 128);
+
+        // nodes are told apart by name, adding a known one does nothing
+        void add(const std::string& node);
+        void remove(const std::string& node);
+
+        // index of the node in order of adding, removed ones are skipped; the ring must not be empty
+        std::size_t owner(std::string_view key) const;
+        const std::string& node(std::size_t index) const { return m_nodes[index]; }
+
+        std::size_t size() const { return m_count; }
+        bool empty() const { return m_count == 0; }
+
+    private:
+        static uint64_t point(std::string_view key);
+
+        const std::size_t m_virtual_nodes;
+        // removed nodes keep their index, so it is stable for the caller
+        std::vector<std::string> m_nodes;
+        std::size_t m_count{ 0 };
+        // point -> node index, sorted by point
+        std::vector<std::pair<uint64_t, std::size_t>> m_ring;
+    };
+
+}
@@ -10,18 +10,34 @@
 
 #include <string>
 #include "stream_wrapper.h"
+#include "patch_source.h"
+#include "patch_sink.h"
+#include "hash.h"
+#include "crc32c.h"
 #include "service.h"
 #include <cassert>
 #include <iostream>
+#include <stdexcept>
 #include <memory>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <tuple>
+#include <type_traits>
 
 namespace ph {
 
     struct patch final {
         std::string name;
         std::string tag;
-        uint32_t file_size{};
+        uint64_t file_size{};
+        // content hash, computed by the receiver, see hasher
+        uint64_t hash{};
         uint8_t* data{};
+        // used for sending when data is not set, bytes are pulled lazily while streaming
+        std::shared_ptr<patch_source> source;
+        // used for receiving instead of data, bytes are pushed as soon as they arrive
+        std::shared_ptr<patch_sink> sink;
         ~patch() {
 	        delete[] data;
         }
@@ -29,20 +45,88 @@ namespace ph {
             std::cout << "Patch:\n"
                 << "  Name: " << name << '\n'
                 << "  Tag: " << tag << '\n'
-                << "  File size: " << file_size << " bytes\n";
+                << "  File size: " << file_size << " bytes\n"
+                << "  Hash: " << std::hex << hash << std::dec << '\n';
         }
         void write(event_loop_stream_wrapper& stream) const {
 	        stream.write(name);
 	        stream.write(tag);
-	        stream.write(file_size);
+	        stream.write_file_size(file_size);
+            if (stream.get_version() >= protocol::hashed) {
+                stream.write(hash);
+            }
         }
         void read(event_loop_stream_wrapper& stream) {
             stream.read(name);
             stream.read(tag);
-            stream.read(file_size);
+            file_size = stream.read_file_size();
+            if (stream.get_version() >= protocol::hashed) {
+                stream.read(hash);
+            }
+        }
+        // count of bytes write() puts to the stream
+        std::size_t header_size(const uint8_t version) const {
+            return protocol::string_size(version, name) + protocol::string_size(version, tag)
+                + protocol::file_size_size(version) + (version >= protocol::hashed ? sizeof(hash) : 0);
+        }
+        // could be described by the given protocol version
+        bool fits(const uint8_t version) const {
+            return file_size <= protocol::max_file_size(version);
         }
     };
 
+    using patch_list = std::vector<std::shared_ptr<patch>>;
+
+    // streams list of patch headers, the list is split between chunks if it does not fit into one,
+    // a single header is never split
+    struct patch_list_codec final {
+        // returns true when whole list is written, throws if a header does not fit even a chunk of its own
+        bool write(event_loop_stream_wrapper& stream, const std::vector<std::shared_ptr<patch>>& patches) {
+            const auto continued = started;
+            const auto first = index;
+            if (!started) {
+                stream.write_count(patches.size());
+                started = true;
+            }
+            for (; index < patches.size(); ++index) {
+                const auto& p = patches[index];
+                const auto size = p->header_size(stream.get_version());
+                if (size > stream.writable()) {
+                    // the chunk holds nothing of the list yet, the next one would not have more room
+                    if (continued && index == first && size > stream.capacity() - stream.count()) {
+                        throw std::runtime_error("Patch header does not fit into a chunk: " + p->tag + "/" + p->name);
+                    }
+                    return false;
+                }
+                p->write(stream);
+            }
+            return true;
+        }
+        // returns true when whole list is read
+        bool read(event_loop_stream_wrapper& stream, std::vector<std::shared_ptr<patch>>& patches) {
+            if (!started) {
+                index = stream.read_count();
+                // the list may span chunks, only what this one could hold is reserved (a header takes a few bytes)
+                patches.reserve((std::size_t)std::min<uint64_t>(index, stream.readable()));
+                started = true;
+            }
+            for (; index > 0 && stream.readable() > 0; --index) {
+                auto p = std::make_shared<patch>();
+                p->read(stream);
+                patches.push_back(std::move(p));
+            }
+            return index == 0;
+        }
+        void reset() noexcept {
+            started = false;
+            index = 0;
+        }
+    private:
+        bool started = false;
+        // written count or remaining count to read
+        std::size_t index = 0;
+    };
+
     // flow:
     // client : message -> server
     // server : set state (streaming/receiving/answer/doaction+answer)
@@ -52,6 +136,15 @@ namespace ph {
             upload_patch,
             delete_patch,
             get_patches,
+            get_batch,
+            sync,
+            offer,
+            subscribe,
+            local_upload,
+            local_download,
+            upload_begin,
+            upload_part,
+            upload_commit,
             count,
         };
         static std::string str_type(const etype type) {
@@ -60,243 +153,838 @@ namespace ph {
                 case etype::delete_patch: return "delete_patch";
                 case etype::get_patches: return "get_patches";
                 case etype::upload_patch: return "upload_patch";
+                case etype::get_batch: return "get_batch";
+                case etype::sync: return "sync";
+                case etype::offer: return "offer";
+                case etype::subscribe: return "subscribe";
+                case etype::local_upload: return "local_upload";
+                case etype::local_download: return "local_download";
+                case etype::upload_begin: return "upload_begin";
+                case etype::upload_part: return "upload_part";
+                case etype::upload_commit: return "upload_commit";
 				case etype::count: break;
             }
             return "unknown";
         }
 
-        message(etype in_type) : type(in_type) {}
+        message(etype in_type, bool in_response) : type(in_type), response(in_response) {}
         virtual ~message() = default;
 
         // writes part of data to buffer, returns true on complete
-        // false if more writes is needed
-        bool write(event_loop_stream_wrapper& stream) {
-            if (initial) {
-                stream.write(type);
-                initial = false;
-            }
-            return write_impl(stream);
-        }
+        // false if more writes is needed. Concrete messages hide it with the same call without dispatch
+        bool write(event_loop_stream_wrapper& stream);
         // reads part of data from buffer, returns true on complete
         // false if more reads is needed
-        bool read(event_loop_stream_wrapper& stream) {
-            return read_impl(stream);
-        }
+        bool read(event_loop_stream_wrapper& stream);
 
         etype get_type() const noexcept { return type; }
+        // requests and responses of the same type are different messages
+        bool is_response() const noexcept { return response; }
+        uint8_t get_version() const noexcept { return version; }
+        void set_version(const uint8_t in_version) noexcept { version = in_version; }
+        // largest chunk the peer receives, zero if its protocol does not tell
+        uint32_t get_peer_chunk() const noexcept { return peer_chunk; }
+        // chunks this message writes are not larger, zero means the whole buffer
+        void set_chunk_limit(const uint32_t limit) noexcept { chunk_limit = limit; }
 
-        // construct message from stream buffer, do not read anything from it (except 1 byte:msg type)
+        // back to the just constructed state, containers keep their capacity so the message could be reused
+        virtual void reset() {
+            version = protocol::current;
+            initial = true;
+            peer_chunk = 0;
+            chunk_limit = 0;
+        }
+
+        // construct message from stream buffer, do not read anything from it (except 1 byte:msg type);
+        // returns nullptr for a type this side does not know
         static message* peek_response(event_loop_stream_wrapper& stream);
+        // returns nullptr if the peer speaks newer protocol version or sends an unknown type
         static message* peek_request(event_loop_stream_wrapper& stream);
+
+        // type and side in one number, see visit
+        constexpr static uint8_t slot(const etype type, const bool response) noexcept {
+            return uint8_t((uint8_t)type << 1 | (response ? 1 : 0));
+        }
+
     protected:
-        virtual bool write_impl(event_loop_stream_wrapper& stream){ return true; }
-        virtual bool read_impl(event_loop_stream_wrapper& stream){ return true; }
+        // type byte and protocol version go at the very beginning of the first chunk
+        void write_header(event_loop_stream_wrapper& stream) {
+            stream.set_version(version);
+            stream.set_chunk_limit(chunk_limit);
+            if (initial) {
+                if (version == protocol::legacy) {
+                    stream.write(type);
+                } else {
+                    stream.write(uint8_t((uint8_t)type | protocol::versioned_flag));
+                    stream.write(version);
+                }
+                if (version >= protocol::sized) {
+                    // both sides use buffers of the same kind to send and to receive
+                    stream.write_count(stream.capacity());
+                }
+                initial = false;
+            }
+        }
 
     private:
+        friend class message_pool;
+        // reads type byte, protocol version and chunk size of the peer,
+        // legacy peers do not send version, older ones do not send chunk size
+        static etype peek_header(event_loop_stream_wrapper& stream, uint8_t& version, uint32_t& peer_chunk);
+
         etype type{};
+        bool response{};
+        uint8_t version = protocol::current;
         bool initial = true;
+        uint32_t peer_chunk{ 0 };
+        uint32_t chunk_limit{ 0 };
+    };
+
+    // how a single field of a message goes to the stream, picked by the field type at compile time
+    template<typename TValue>
+    struct field_codec final {
+        static void write(event_loop_stream_wrapper& stream, const TValue& value) { stream.write(value); }
+        static void read(event_loop_stream_wrapper& stream, TValue& value) { stream.read(value); }
+        static void clear(TValue& value) { value = {}; }
+    };
+
+    template<>
+    struct field_codec<std::string> final {
+        static void write(event_loop_stream_wrapper& stream, const std::string& value) { stream.write(value); }
+        static void read(event_loop_stream_wrapper& stream, std::string& value) {
+            value.clear();
+            stream.read(value);
+        }
+        static void clear(std::string& value) { value.clear(); }
+    };
+
+    template<>
+    struct field_codec<std::vector<std::string>> final {
+        static void write(event_loop_stream_wrapper& stream, const std::vector<std::string>& value) {
+            stream.write_count(value.size());
+            for (const auto& item : value) {
+                field_codec<std::string>::write(stream, item);
+            }
+        }
+        static void read(event_loop_stream_wrapper& stream, std::vector<std::string>& value) {
+            const auto count = stream.read_count();
+            // every string takes at least a byte of the chunk
+            if (count > stream.readable()) {
+                throw std::runtime_error("Count is larger than the chunk");
+            }
+            value.resize((std::size_t)count);
+            for (auto& item : value) {
+                field_codec<std::string>::read(stream, item);
+            }
+        }
+        static void clear(std::vector<std::string>& value) { value.clear(); }
+    };
+
+    // field peers know since the protocol version, older ones neither send nor expect it
+    template<uint8_t Since, typename TValue>
+    struct since final {
+        TValue value{};
+    };
+
+    template<uint8_t Since, typename TValue>
+    struct field_codec<since<Since, TValue>> final {
+        static void write(event_loop_stream_wrapper& stream, const since<Since, TValue>& field) {
+            if (stream.get_version() >= Since) {
+                field_codec<TValue>::write(stream, field.value);
+            }
+        }
+        static void read(event_loop_stream_wrapper& stream, since<Since, TValue>& field) {
+            if (stream.get_version() >= Since) {
+                field_codec<TValue>::read(stream, field.value);
+            }
+        }
+        static void clear(since<Since, TValue>& field) { field_codec<TValue>::clear(field.value); }
+    };
+
+    // message described by its layout: TDerived::fields() returns member pointers in wire order.
+    // Plain fields are written once at the beginning, a patch list may go last and is split between chunks
+    template<typename TDerived>
+    struct fields_message : message {
+        bool write(event_loop_stream_wrapper& stream) {
+            write_header(stream);
+            const auto complete = write_body(stream);
+            stream.end_chunk();
+            return complete;
+        }
+        bool read(event_loop_stream_wrapper& stream) {
+            stream.set_version(get_version());
+            return read_body(stream);
+        }
+
+        virtual void reset() override {
+            message::reset();
+            for_each_field([](auto& value) {
+                using value_t = std::decay_t<decltype(value)>;
+                if constexpr (std::is_same_v<value_t, patch_list>) {
+                    value.clear();
+                } else {
+                    field_codec<value_t>::clear(value);
+                }
+            });
+            codec.reset();
+            prefix_done = false;
+        }
+
+    protected:
+        fields_message(etype in_type, bool in_response) : message(in_type, in_response) { }
+
+    private:
+        bool write_body(event_loop_stream_wrapper& stream) {
+            auto complete = true;
+            for_each_field([&](auto& value) {
+                using value_t = std::decay_t<decltype(value)>;
+                if constexpr (std::is_same_v<value_t, patch_list>) {
+                    complete = codec.write(stream, value);
+                } else if (!prefix_done) {
+                    field_codec<value_t>::write(stream, value);
+                }
+            });
+            prefix_done = true;
+            return complete;
+        }
+        bool read_body(event_loop_stream_wrapper& stream) {
+            auto complete = true;
+            for_each_field([&](auto& value) {
+                using value_t = std::decay_t<decltype(value)>;
+                if constexpr (std::is_same_v<value_t, patch_list>) {
+                    complete = codec.read(stream, value);
+                } else if (!prefix_done) {
+                    field_codec<value_t>::read(stream, value);
+                }
+            });
+            prefix_done = true;
+            return complete;
+        }
+        template<typename F>
+        void for_each_field(F&& f) {
+            auto& self = static_cast<TDerived&>(*this);
+            std::apply([&](auto... members) {
+                static_assert(list_goes_last<std::decay_t<decltype(self.*members)>...>(),
+                    "only the last field could be a patch list");
+                (f(self.*members), ...);
+            }, TDerived::fields());
+        }
+        template<typename... TValues>
+        constexpr static bool list_goes_last() {
+            constexpr bool lists[] = { std::is_same_v<TValues, patch_list>..., false };
+            for (std::size_t i = 0; i + 2 < sizeof(lists); ++i) {
+                if (lists[i]) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        patch_list_codec codec;
+        bool prefix_done = false;
     };
 
     struct patch_message : message {
         std::vector<std::shared_ptr<patch>> patches;
+        // if set, received patches are streamed to sinks it creates instead of memory
+        std::function<std::shared_ptr<patch_sink>(const patch&)> sink_factory;
+        // payload the message may take into memory, a peer announcing more is refused before anything is allocated;
+        // larger downloads should go to sinks
+        constexpr static uint64_t default_memory_limit = 4ull * 1024 * 1024 * 1024;
+        uint64_t memory_limit{ default_memory_limit };
+
+        virtual void reset() override {
+            message::reset();
+            patches.clear();
+            sink_factory = nullptr;
+            memory_limit = default_memory_limit;
+            memory_taken = 0;
+            headers.reset();
+            received_hash.reset();
+            chunk_crc = 0;
+            headers_complete = false;
+            current_patch_offset = 0;
+            patch_id = 0;
+            prefix_done = false;
+        }
+
+        bool write(event_loop_stream_wrapper& stream) {
+            write_header(stream);
+            const auto complete = write_body(stream);
+            stream.end_chunk();
+            return complete;
+        }
+        bool read(event_loop_stream_wrapper& stream) {
+            stream.set_version(get_version());
+            return read_body(stream);
+        }
+
+        // all patch headers are read, payload is not received yet or is being received
+        bool headers_read() const noexcept { return headers_complete; }
+        // calls f(source, offset, size) for every source piece the next size bytes of payload are read from
+        template<typename F>
+        void next_reads(uint64_t size, F&& f) const {
+            auto offset = current_patch_offset;
+            for (auto id = patch_id; id < patches.size() && size != 0; ++id) {
+                const auto& p = *patches[id];
+                const auto count = std::min(p.file_size - offset, size);
+                if (p.data == nullptr && p.source != nullptr && count != 0) {
+                    f(*p.source, offset, (std::size_t)count);
+                }
+                size -= count;
+                offset = 0;
+            }
+        }
+        // bytes of payload which go to memory, not to sinks
+        uint64_t memory_payload() const noexcept {
+            uint64_t total = 0;
+            for (const auto& p : patches) {
+                total += p->sink == nullptr ? p->file_size : 0;
+            }
+            return total;
+        }
     protected:
-        explicit patch_message(etype in_type) : message(in_type) { }
+        patch_message(etype in_type, bool in_response) : message(in_type, in_response) { }
+        // fields of the message itself, they go once at the beginning of the first chunk before the headers
+        virtual void write_prefix(event_loop_stream_wrapper&) const { }
+        virtual void read_prefix(event_loop_stream_wrapper&) { }
     private:
-        virtual bool write_impl(event_loop_stream_wrapper& stream) override {
-            if (remaining_count == 0) {
-                stream.write((uint16_t)patches.size());
-                for (const auto& patch : patches) {
-                    patch->write(stream);
-                    remaining_count += patch->file_size;
+        // all headers go first, then data of all patches in the same order
+        bool write_body(event_loop_stream_wrapper& stream) {
+            if (!prefix_done) {
+                write_prefix(stream);
+                prefix_done = true;
+            }
+            if (!headers_complete) {
+                headers_complete = headers.write(stream, patches);
+                // upload headers go in a chunk of their own, the hub admits payload before it is sent
+                if (!headers_complete || (!is_response() && !patches.empty())) {
+                    return false;
                 }
             }
-            return do_stream_action(
-            [&stream](const uint8_t* begin, std::size_t size) {
-                stream.write(begin, size);
+            // chunk checksum trailer needs some room, otherwise data goes to the next chunk
+            const auto checked = stream.get_version() >= protocol::checked;
+            if (checked && stream.writable() <= sizeof(uint32_t)) {
+                return false;
+            }
+            chunk_crc = 0;
+            const auto complete = do_stream_action(
+            [this, &stream, checked](const patch& p, uint64_t offset, std::size_t size) -> std::size_t {
+                if (p.data != nullptr) {
+                    stream.write_payload(p.data + offset, size);
+                    if (checked) {
+                        chunk_crc = crc32c(p.data + offset, size, chunk_crc);
+                    }
+                    return size;
+                }
+                assert(p.source);
+                return stream.write_in_place([&](uint8_t* out, std::size_t) {
+                    const auto count = p.source->read(offset, out, size);
+                    if (checked) {
+                        chunk_crc = crc32c(out, count, chunk_crc);
+                    }
+                    return count;
+                });
             },
-    [&stream] {
-                return stream.free_space();
-            });
+            [&stream, checked] {
+                return stream.writable() - (checked ? sizeof(uint32_t) : 0);
+            },
+            [](patch&) { });
+            if (checked) {
+                stream.write(chunk_crc);
+            }
+            return complete;
         }
-        virtual bool read_impl(event_loop_stream_wrapper& stream) override {
-            if (remaining_count == 0) {
-                const auto patch_count = stream.read<uint16_t>();
-                for (auto i = 0; i < patch_count; i++) {
-                    auto patch_ptr = std::make_shared<patch>();
-                    patch_ptr->read(stream);
-                    patch_ptr->data = new uint8_t[patch_ptr->file_size];
-                    remaining_count += patch_ptr->file_size;
-                    patches.push_back(std::move(patch_ptr));
+        bool read_body(event_loop_stream_wrapper& stream) {
+            if (!prefix_done) {
+                read_prefix(stream);
+                prefix_done = true;
+            }
+            if (!headers_complete) {
+                const auto patch_count = patches.size();
+                headers_complete = headers.read(stream, patches);
+                for (auto i = patch_count; i < patches.size(); i++) {
+                    if (sink_factory) {
+                        patches[i]->sink = sink_factory(*patches[i]);
+                        if (patches[i]->sink == nullptr) {
+                            throw std::runtime_error("Cannot create sink for patch: " + patches[i]->name);
+                        }
+                    }
                 }
+                if (!headers_complete) {
+                    return false;
+                }
+            }
+            // every chunk with payload ends with checksum of the payload part
+            const auto checked = stream.get_version() >= protocol::checked;
+            const auto available = stream.readable();
+            if (checked && available == 0) {
+                return patch_id == patches.size();
             }
-            return do_stream_action(
-            [&stream](uint8_t* begin, std::size_t size) {
-                stream.read(begin, size);
+            if (checked && available < sizeof(uint32_t)) {
+                throw std::runtime_error("Chunk is too short for checksum");
+            }
+            chunk_crc = 0;
+            const auto complete = do_stream_action(
+            [this, &stream, checked](patch& p, uint64_t offset, std::size_t size) -> std::size_t {
+                if (p.sink == nullptr && p.data == nullptr) {
+                    // memory is taken once payload of the patch starts to arrive, not when it is announced
+                    if (p.file_size > memory_limit - memory_taken) {
+                        throw std::runtime_error("Patch does not fit into memory limit: " + p.tag + "/" + p.name);
+                    }
+                    p.data = new uint8_t[p.file_size];
+                    memory_taken += p.file_size;
+                }
+                const uint8_t* received = p.data + offset;
+                if (p.sink != nullptr) {
+                    stream.read_in_place([&](const uint8_t* data, std::size_t) {
+                        p.sink->write(offset, data, size);
+                        received = data;
+                        return size;
+                    });
+                } else {
+                    stream.read(p.data + offset, size);
+                }
+                // piece is still hot in cache, both sums are computed right here without another pass
+                received_hash.update(received, size);
+                if (checked) {
+                    chunk_crc = crc32c(received, size, chunk_crc);
+                }
+                return size;
             },
-            [&stream] {
-                return stream.count();
+            [available, checked] {
+                return available - (checked ? sizeof(uint32_t) : 0);
+            },
+            [this](patch& p) {
+                // receiver always knows the real hash of what it got,
+                // zero hash in header means sender did not know it
+                const auto hash = received_hash.digest();
+                received_hash.reset();
+                if (p.hash != 0 && p.hash != hash) {
+                    throw std::runtime_error("Patch checksum mismatch: " + p.tag + "/" + p.name);
+                }
+                p.hash = hash;
             });
+            if (checked && stream.read<uint32_t>() != chunk_crc) {
+                throw std::runtime_error("Chunk checksum mismatch");
+            }
+            return complete;
         }
-        bool do_stream_action(auto stream_action, auto get_count) {
+        bool do_stream_action(auto stream_action, auto get_count, auto on_complete) {
             auto count = get_count();
-            for (auto patch = patch_id; patch < patches.size() && count > 0; patch++) {
+            while (patch_id < patches.size()) {
                 const auto patch_size = patches[patch_id]->file_size;
-                const auto begin = patches[patch_id]->data + current_patch_offset;
-                const auto size = patch_size - current_patch_offset;
-                stream_action(begin, size);
+                if (count == 0 && current_patch_offset != patch_size) {
+                    break;
+                }
+                // sources may hand out less than asked
+                const auto size = stream_action(*patches[patch_id], current_patch_offset,
+                    (std::size_t)std::min<uint64_t>(patch_size - current_patch_offset, count));
                 current_patch_offset += size;
-                remaining_count -= size;
+                count -= size;
                 if (current_patch_offset == patch_size) {
+                    on_complete(*patches[patch_id]);
                     current_patch_offset = 0;
                     ++patch_id;
                 }
             }
-            return remaining_count == 0;
+            return patch_id == patches.size();
         }
         // dynamic data
-        std::size_t remaining_count = 0;
-        std::size_t current_patch_offset = 0;
+        patch_list_codec headers;
+        hasher received_hash;
+        uint32_t chunk_crc = 0;
+        // payload allocated in memory so far
+        uint64_t memory_taken = 0;
+        bool headers_complete = false;
+        uint64_t current_patch_offset = 0;
         std::size_t patch_id = 0;
+        bool prefix_done = false;
     };
 
     // client -> server request patches for specified tag
-    struct get_patches_request final : message {
-        get_patches_request() : message(etype::get_patches){}
+    struct get_patches_request final : fields_message<get_patches_request> {
+        get_patches_request() : fields_message(etype::get_patches, false){}
         std::string tag{};
-    private:
-        virtual bool write_impl(event_loop_stream_wrapper& stream) override {
-            assert(!tag.empty());
-            stream.write(tag);
-            return true;
+
+        static auto fields() { return std::make_tuple(&get_patches_request::tag); }
+    };
+
+    struct get_patches_response final : patch_message {
+        get_patches_response() : patch_message(etype::get_patches, true){}
+    };
+
+    // client -> server request patches of several tags at once, answered with single patch stream
+    struct get_batch_request final : fields_message<get_batch_request> {
+        get_batch_request() : fields_message(etype::get_batch, false){}
+        std::vector<std::string> tags;
+
+        static auto fields() { return std::make_tuple(&get_batch_request::tags); }
+    };
+
+    // patches of all requested tags, every patch carries its tag
+    struct get_batch_response final : patch_message {
+        get_batch_response() : patch_message(etype::get_batch, true){}
+    };
+
+    // client -> server what client already has for the tag (name, size and hash of every local file),
+    // answered with patches which are missing or differ
+    struct sync_request final : fields_message<sync_request> {
+        sync_request() : fields_message(etype::sync, false){}
+        std::string tag{};
+        patch_list local;
+
+        static auto fields() { return std::make_tuple(&sync_request::tag, &sync_request::local); }
+    };
+
+    struct sync_response final : patch_message {
+        sync_response() : patch_message(etype::sync, true){}
+    };
+
+    // client -> server meta and hashes of patches client is going to upload, the hub links the content
+    // it already holds into the tags and answers with the patches which still have to be uploaded
+    struct offer_request final : fields_message<offer_request> {
+        offer_request() : fields_message(etype::offer, false){}
+        patch_list patches;
+
+        static auto fields() { return std::make_tuple(&offer_request::patches); }
+    };
+
+    struct offer_response final : fields_message<offer_response> {
+        offer_response() : fields_message(etype::offer, true){}
+        patch_list missing;
+
+        static auto fields() { return std::make_tuple(&offer_response::missing); }
+    };
+
+    // client -> server waits for changes of tags starting with the prefix, empty prefix matches every tag.
+    // Answered right away if such tags changed after the sequence (zero before the first answer),
+    // otherwise once one changes or the timeout passes
+    struct subscribe_request final : fields_message<subscribe_request> {
+        subscribe_request() : fields_message(etype::subscribe, false){}
+        std::string prefix{};
+        uint64_t after{ 0 };
+        // milliseconds, the hub may cut it shorter; zero answers right away
+        uint32_t timeout{ 0 };
+
+        static auto fields() {
+            return std::make_tuple(&subscribe_request::prefix, &subscribe_request::after, &subscribe_request::timeout);
         }
-        virtual bool read_impl(event_loop_stream_wrapper& stream) override {
-            stream.read(tag);
-            return true;
+    };
+
+    // tags uploaded to or deleted since the sequence of the request, sequence to pass next time;
+    // missed means the hub does not remember that far (or restarted), the client lists everything again
+    struct subscribe_response final : fields_message<subscribe_response> {
+        subscribe_response() : fields_message(etype::subscribe, true){}
+        uint64_t sequence{ 0 };
+        uint8_t missed{ 0 };
+        std::vector<std::string> tags;
+
+        static auto fields() {
+            return std::make_tuple(&subscribe_response::sequence, &subscribe_response::missed, &subscribe_response::tags);
         }
     };
 
-    struct get_patches_response final : patch_message {
-        get_patches_response() : patch_message(etype::get_patches){}
+    // client -> server, client on the same host hands patches over as files, the hub copies them into its
+    // cache by itself; paths go in order of the patches, zero hash means the hub computes it
+    struct local_upload_request final : fields_message<local_upload_request> {
+        local_upload_request() : fields_message(etype::local_upload, false){}
+        std::vector<std::string> paths;
+        patch_list patches;
+
+        static auto fields() { return std::make_tuple(&local_upload_request::paths, &local_upload_request::patches); }
+    };
+
+    // patches stored, with the hashes of what the hub read
+    struct local_upload_response final : fields_message<local_upload_response> {
+        local_upload_response() : fields_message(etype::local_upload, true){}
+        patch_list patches;
+
+        static auto fields() { return std::make_tuple(&local_upload_response::patches); }
+    };
+
+    // client -> server, client on the same host reads the files of the tag from the hub cache by itself
+    struct local_download_request final : fields_message<local_download_request> {
+        local_download_request() : fields_message(etype::local_download, false){}
+        std::string tag{};
+
+        static auto fields() { return std::make_tuple(&local_download_request::tag); }
+    };
+
+    // absolute paths in order of the patches, empty for a patch which is not on disk yet
+    struct local_download_response final : fields_message<local_download_response> {
+        local_download_response() : fields_message(etype::local_download, true){}
+        std::vector<std::string> paths;
+        patch_list patches;
+
+        static auto fields() { return std::make_tuple(&local_download_response::paths, &local_download_response::patches); }
     };
 
     // client -> server message to store patches for specified tag
     struct upload_patch_request final : patch_message {
-        upload_patch_request() : patch_message(etype::upload_patch) {}
+        upload_patch_request() : patch_message(etype::upload_patch, false) {}
     };
 
-    struct upload_patch_response final : message {
-        std::vector<std::shared_ptr<patch>> patches;
-        upload_patch_response() : message(etype::upload_patch){}
-    private:
-        virtual bool write_impl(event_loop_stream_wrapper& stream) override {
-            stream.write((uint16_t)patches.size());
-            for (const auto& p : patches) {
-                p->write(stream);
-            }
-            return true;
-        }
-        virtual bool read_impl(event_loop_stream_wrapper& stream) override {
-            const auto num = stream.read<uint16_t>();
-            for (auto i = 0; i < num; i++) {
-                auto p = std::make_shared<patch>();
-                p->read(stream);
-                patches.push_back(std::move(p));
-            }
-            return true;
+    struct upload_patch_response final : fields_message<upload_patch_response> {
+        patch_list patches;
+        upload_patch_response() : fields_message(etype::upload_patch, true){}
+
+        static auto fields() { return std::make_tuple(&upload_patch_response::patches); }
+    };
+
+    // client -> server starts an upload of a single patch which is sent in parts over several connections,
+    // zero hash means the hub computes it
+    struct upload_begin_request final : fields_message<upload_begin_request> {
+        upload_begin_request() : fields_message(etype::upload_begin, false){}
+        std::string tag{};
+        std::string name{};
+        uint64_t file_size{ 0 };
+        uint64_t hash{ 0 };
+
+        static auto fields() {
+            return std::make_tuple(&upload_begin_request::tag, &upload_begin_request::name,
+                &upload_begin_request::file_size, &upload_begin_request::hash);
         }
     };
 
-    // client -> server request list of available patches
-    struct list_patches_request final : message {
-        list_patches_request() : message(etype::list_patches){}
+    // id the parts and the commit refer to, zero if the hub does not take the upload
+    struct upload_begin_response final : fields_message<upload_begin_response> {
+        upload_begin_response() : fields_message(etype::upload_begin, true){}
+        uint64_t upload{ 0 };
+
+        static auto fields() { return std::make_tuple(&upload_begin_response::upload); }
     };
 
-    struct list_patches_response final : message {
-        list_patches_response() : message(etype::list_patches){}
-        std::vector<std::shared_ptr<patch>> patches;
-    private:
-        virtual bool write_impl(event_loop_stream_wrapper& stream) override {
-            stream.write((uint16_t)patches.size());
-            for (const auto& p : patches) {
-                p->write(stream);
-            }
-            return true;
+    // client -> server bytes of the upload starting at the offset, carried by a single patch with the tag
+    // and name of the upload and the size of the part. Parts of one upload do not overlap
+    struct upload_part_request final : patch_message {
+        upload_part_request() : patch_message(etype::upload_part, false) {}
+        uint64_t upload{ 0 };
+        uint64_t offset{ 0 };
+
+        virtual void reset() override {
+            patch_message::reset();
+            upload = 0;
+            offset = 0;
         }
-        virtual bool read_impl(event_loop_stream_wrapper& stream) override {
-            const auto num = stream.read<uint16_t>();
-            for (auto i = 0; i < num; i++) {
-                auto p = std::make_shared<patch>();
-                p->read(stream);
-                patches.push_back(std::move(p));
-            }
-            return true;
+    protected:
+        virtual void write_prefix(event_loop_stream_wrapper& stream) const override {
+            stream.write(upload);
+            stream.write(offset);
         }
+        virtual void read_prefix(event_loop_stream_wrapper& stream) override {
+            stream.read(upload);
+            stream.read(offset);
+        }
+    };
+
+    // bytes of the upload received so far, zero if the part is not taken (unknown upload, overlap)
+    struct upload_part_response final : fields_message<upload_part_response> {
+        upload_part_response() : fields_message(etype::upload_part, true){}
+        uint64_t received{ 0 };
+
+        static auto fields() { return std::make_tuple(&upload_part_response::received); }
+    };
+
+    // client -> server every part is sent, the hub verifies the assembled patch and publishes it
+    struct upload_commit_request final : fields_message<upload_commit_request> {
+        upload_commit_request() : fields_message(etype::upload_commit, false){}
+        uint64_t upload{ 0 };
+
+        static auto fields() { return std::make_tuple(&upload_commit_request::upload); }
+    };
+
+    // the published patch, empty if parts are missing or the content is not what begin told;
+    // the upload is kept for missing parts and dropped otherwise
+    struct upload_commit_response final : fields_message<upload_commit_response> {
+        upload_commit_response() : fields_message(etype::upload_commit, true){}
+        patch_list patches;
+
+        static auto fields() { return std::make_tuple(&upload_commit_response::patches); }
     };
 
-    struct delete_patch_request final : message {
-        delete_patch_request() : message(etype::delete_patch){}
+    // client -> server request list of available patches
+    struct list_patches_request final : fields_message<list_patches_request> {
+        list_patches_request() : fields_message(etype::list_patches, false){}
+        // tags to list, empty lists every tag
+        since<protocol::filtered, std::vector<std::string>> tags;
+
+        static auto fields() { return std::make_tuple(&list_patches_request::tags); }
+    };
+
+    struct list_patches_response final : fields_message<list_patches_response> {
+        list_patches_response() : fields_message(etype::list_patches, true){}
+        patch_list patches;
+
+        static auto fields() { return std::make_tuple(&list_patches_response::patches); }
+    };
+
+    struct delete_patch_request final : fields_message<delete_patch_request> {
+        delete_patch_request() : fields_message(etype::delete_patch, false){}
         std::string tag{};
-    private:
-        virtual bool write_impl(event_loop_stream_wrapper& stream) override {
-            stream.write(tag);
-            return true;
-        }
-        virtual bool read_impl(event_loop_stream_wrapper& stream) override {
-            stream.read(tag);
-            return true;
-        }
+
+        static auto fields() { return std::make_tuple(&delete_patch_request::tag); }
     };
 
-    struct delete_patch_response final : message {
-        std::vector<std::shared_ptr<patch>> removed_patches;
-        delete_patch_response() : message(etype::delete_patch){}
-    private:
-        virtual bool write_impl(event_loop_stream_wrapper& stream) override {
-            stream.write((uint16_t)removed_patches.size());
-            for (const auto& p : removed_patches) {
-                p->write(stream);
-            }
-            return true;
+    struct delete_patch_response final : fields_message<delete_patch_response> {
+        patch_list removed_patches;
+        delete_patch_response() : fields_message(etype::delete_patch, true){}
+
+        static auto fields() { return std::make_tuple(&delete_patch_response::removed_patches); }
+    };
+
+    // calls f with the message casted to its concrete type. The set of messages is closed,
+    // so a single jump picks the type and everything behind it is resolved at compile time
+    template<typename F>
+    decltype(auto) visit(message& msg, F&& f) {
+        using etype = message::etype;
+        switch (message::slot(msg.get_type(), msg.is_response())) {
+            case message::slot(etype::list_patches, false): return f(static_cast<list_patches_request&>(msg));
+            case message::slot(etype::list_patches, true): return f(static_cast<list_patches_response&>(msg));
+            case message::slot(etype::upload_patch, false): return f(static_cast<upload_patch_request&>(msg));
+            case message::slot(etype::upload_patch, true): return f(static_cast<upload_patch_response&>(msg));
+            case message::slot(etype::delete_patch, false): return f(static_cast<delete_patch_request&>(msg));
+            case message::slot(etype::delete_patch, true): return f(static_cast<delete_patch_response&>(msg));
+            case message::slot(etype::get_patches, false): return f(static_cast<get_patches_request&>(msg));
+            case message::slot(etype::get_patches, true): return f(static_cast<get_patches_response&>(msg));
+            case message::slot(etype::get_batch, false): return f(static_cast<get_batch_request&>(msg));
+            case message::slot(etype::get_batch, true): return f(static_cast<get_batch_response&>(msg));
+            case message::slot(etype::sync, false): return f(static_cast<sync_request&>(msg));
+            case message::slot(etype::sync, true): return f(static_cast<sync_response&>(msg));
+            case message::slot(etype::offer, false): return f(static_cast<offer_request&>(msg));
+            case message::slot(etype::offer, true): return f(static_cast<offer_response&>(msg));
+            case message::slot(etype::subscribe, false): return f(static_cast<subscribe_request&>(msg));
+            case message::slot(etype::subscribe, true): return f(static_cast<subscribe_response&>(msg));
+            case message::slot(etype::local_upload, false): return f(static_cast<local_upload_request&>(msg));
+            case message::slot(etype::local_upload, true): return f(static_cast<local_upload_response&>(msg));
+            case message::slot(etype::local_download, false): return f(static_cast<local_download_request&>(msg));
+            case message::slot(etype::local_download, true): return f(static_cast<local_download_response&>(msg));
+            case message::slot(etype::upload_begin, false): return f(static_cast<upload_begin_request&>(msg));
+            case message::slot(etype::upload_begin, true): return f(static_cast<upload_begin_response&>(msg));
+            case message::slot(etype::upload_part, false): return f(static_cast<upload_part_request&>(msg));
+            case message::slot(etype::upload_part, true): return f(static_cast<upload_part_response&>(msg));
+            case message::slot(etype::upload_commit, false): return f(static_cast<upload_commit_request&>(msg));
+            case message::slot(etype::upload_commit, true): return f(static_cast<upload_commit_response&>(msg));
+            default: break;
         }
-        virtual bool read_impl(event_loop_stream_wrapper& stream) override {
-            const auto num = stream.read<uint16_t>();
-            for (auto i = 0; i < num; i++) {
-                auto p = std::make_shared<patch>();
-                p->read(stream);
-                removed_patches.push_back(std::move(p));
+        assert(false);
+        return std::invoke_result_t<F, list_patches_request&>();
+    }
+
+    // same for the side which only handles requests, f is not instantiated for responses
+    template<typename F>
+    decltype(auto) visit_request(message& msg, F&& f) {
+        assert(!msg.is_response());
+        switch (msg.get_type()) {
+            case message::etype::list_patches: return f(static_cast<list_patches_request&>(msg));
+            case message::etype::upload_patch: return f(static_cast<upload_patch_request&>(msg));
+            case message::etype::delete_patch: return f(static_cast<delete_patch_request&>(msg));
+            case message::etype::get_patches: return f(static_cast<get_patches_request&>(msg));
+            case message::etype::get_batch: return f(static_cast<get_batch_request&>(msg));
+            case message::etype::sync: return f(static_cast<sync_request&>(msg));
+            case message::etype::offer: return f(static_cast<offer_request&>(msg));
+            case message::etype::subscribe: return f(static_cast<subscribe_request&>(msg));
+            case message::etype::local_upload: return f(static_cast<local_upload_request&>(msg));
+            case message::etype::local_download: return f(static_cast<local_download_request&>(msg));
+            case message::etype::upload_begin: return f(static_cast<upload_begin_request&>(msg));
+            case message::etype::upload_part: return f(static_cast<upload_part_request&>(msg));
+            case message::etype::upload_commit: return f(static_cast<upload_commit_request&>(msg));
+            case message::etype::count: break;
+        }
+        assert(false);
+        return std::invoke_result_t<F, list_patches_request&>();
+    }
+
+    inline
+    bool message::write(event_loop_stream_wrapper& stream) {
+        return visit(*this, [&stream](auto& msg) {
+            return msg.write(stream);
+        });
+    }
+
+    inline
+    bool message::read(event_loop_stream_wrapper& stream) {
+        return visit(*this, [&stream](auto& msg) {
+            return msg.read(stream);
+        });
+    }
+
+    inline
+    message::etype message::peek_header(event_loop_stream_wrapper& stream, uint8_t& version, uint32_t& peer_chunk) {
+        const auto type_byte = stream.read<uint8_t>();
+        version = protocol::legacy;
+        peer_chunk = 0;
+        if (type_byte & protocol::versioned_flag) {
+            version = stream.read<uint8_t>();
+            if (version >= protocol::sized) {
+                stream.set_version(version);
+                peer_chunk = (uint32_t)std::min<uint64_t>(stream.read_count(), UINT32_MAX);
             }
-            return true;
         }
-    };
+        return etype(type_byte & ~protocol::versioned_flag);
+    }
 
     inline
     message* message::peek_request(event_loop_stream_wrapper &stream) {
+        uint8_t version;
+        uint32_t peer_chunk;
         // ReSharper disable once CppTooWideScope
-        const auto type = stream.read<etype>();
+        const auto type = peek_header(stream, version, peer_chunk);
+        if (version > protocol::current) {
+            return nullptr;
+        }
+        message* msg = nullptr;
         switch (type) {
-            case etype::delete_patch: return new delete_patch_request();
-            case etype::upload_patch: return new upload_patch_request();
-            case etype::list_patches: return new list_patches_request();
-            case etype::get_patches: return new get_patches_request();
+            case etype::delete_patch: msg = new delete_patch_request(); break;
+            case etype::upload_patch: msg = new upload_patch_request(); break;
+            case etype::list_patches: msg = new list_patches_request(); break;
+            case etype::get_patches: msg = new get_patches_request(); break;
+            case etype::get_batch: msg = new get_batch_request(); break;
+            case etype::sync: msg = new sync_request(); break;
+            case etype::offer: msg = new offer_request(); break;
+            case etype::subscribe: msg = new subscribe_request(); break;
+            case etype::local_upload: msg = new local_upload_request(); break;
+            case etype::local_download: msg = new local_download_request(); break;
+            case etype::upload_begin: msg = new upload_begin_request(); break;
+            case etype::upload_part: msg = new upload_part_request(); break;
+            case etype::upload_commit: msg = new upload_commit_request(); break;
 			case etype::count: break;
         }
-        assert(false);
-        return nullptr;
+        if (msg) {
+            msg->version = version;
+            msg->peer_chunk = peer_chunk;
+        }
+        return msg;
     }
 
     inline
     message* message::peek_response(event_loop_stream_wrapper &stream) {
+        uint8_t version;
+        uint32_t peer_chunk;
         // ReSharper disable once CppTooWideScope
-        const auto type = stream.read<etype>();
+        const auto type = peek_header(stream, version, peer_chunk);
+        message* msg = nullptr;
         switch (type) {
-            case etype::list_patches: return new list_patches_response();
-            case etype::upload_patch: return new upload_patch_response();
-            case etype::delete_patch: return new delete_patch_response();
-            case etype::get_patches: return new get_patches_response();
+            case etype::list_patches: msg = new list_patches_response(); break;
+            case etype::upload_patch: msg = new upload_patch_response(); break;
+            case etype::delete_patch: msg = new delete_patch_response(); break;
+            case etype::get_patches: msg = new get_patches_response(); break;
+            case etype::get_batch: msg = new get_batch_response(); break;
+            case etype::sync: msg = new sync_response(); break;
+            case etype::offer: msg = new offer_response(); break;
+            case etype::subscribe: msg = new subscribe_response(); break;
+            case etype::local_upload: msg = new local_upload_response(); break;
+            case etype::local_download: msg = new local_download_response(); break;
+            case etype::upload_begin: msg = new upload_begin_response(); break;
+            case etype::upload_part: msg = new upload_part_response(); break;
+            case etype::upload_commit: msg = new upload_commit_response(); break;
             case etype::count: break;
         }
-        assert(false);
-        return nullptr;
+        if (msg) {
+            msg->version = version;
+            msg->peer_chunk = peer_chunk;
+        }
+        return msg;
     }
 
 }
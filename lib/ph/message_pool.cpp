@@ -0,0 +1,48 @@
+#include "message_pool.h"
+
+ph::message_pool::~message_pool() {
+    for (auto& free : m_free) {
+        for (auto* msg : free) {
+            delete msg;
+        }
+    }
+}
+
+ph::message* ph::message_pool::peek_request(event_loop_stream_wrapper& stream) {
+    uint8_t version;
+    uint32_t peer_chunk;
+    const auto type = message::peek_header(stream, version, peer_chunk);
+    if (version > protocol::current) {
+        return nullptr;
+    }
+    message* msg = nullptr;
+    switch (type) {
+        case message::etype::delete_patch: msg = acquire<delete_patch_request>(); break;
+        case message::etype::upload_patch: msg = acquire<upload_patch_request>(); break;
+        case message::etype::list_patches: msg = acquire<list_patches_request>(); break;
+        case message::etype::get_patches: msg = acquire<get_patches_request>(); break;
+        case message::etype::get_batch: msg = acquire<get_batch_request>(); break;
+        case message::etype::sync: msg = acquire<sync_request>(); break;
+        case message::etype::offer: msg = acquire<offer_request>(); break;
+        case message::etype::subscribe: msg = acquire<subscribe_request>(); break;
+        case message::etype::local_upload: msg = acquire<local_upload_request>(); break;
+        case message::etype::local_download: msg = acquire<local_download_request>(); break;
+        case message::etype::upload_begin: msg = acquire<upload_begin_request>(); break;
+        case message::etype::upload_part: msg = acquire<upload_part_request>(); break;
+        case message::etype::upload_commit: msg = acquire<upload_commit_request>(); break;
+        case message::etype::count: break;
+    }
+    if (msg != nullptr) {
+        msg->set_version(version);
+        msg->peer_chunk = peer_chunk;
+    }
+    return msg;
+}
+
+void ph::message_pool::release(message* msg, bool request) {
+    if (msg == nullptr) {
+        return;
+    }
+    msg->reset();
+    m_free[index(msg->get_type(), request)].push_back(msg);
+}
@@ -0,0 +1,68 @@
+/* Copyright (C) 2025 Gleb Bezborodov - All Rights Reserved
+* You may use, distribute and modify this code under the
+ * terms of the MIT license.
+ *
+ * You should have received a copy of the MIT license with
+ * this file. If not, please write to: bezborodoff.gleb@gmail.com, or visit : https://github.com/glensand/patch-hub
+ */
+
+#pragma once
+
+#include <array>
+#include <vector>
+
+#include "message.h"
+
+namespace ph {
+
+    // released messages are reset and kept for the next request of the same type,
+    // so the steady request path does not allocate messages (and their containers) again.
+    // Not thread safe, owns everything it has handed out and has not got back
+    class message_pool final {
+    public:
+        message_pool() = default;
+        message_pool(const message_pool&) = delete;
+        message_pool& operator=(const message_pool&) = delete;
+        ~message_pool();
+
+        // like message::peek_request, returns nullptr if the peer speaks newer protocol version or sends an unknown type
+        message* peek_request(event_loop_stream_wrapper& stream);
+
+        template<typename T>
+        T* acquire() {
+            auto& free = m_free[index(T{}.get_type(), is_request<T>())];
+            if (free.empty()) {
+                ++m_created;
+                return new T();
+            }
+            auto* msg = static_cast<T*>(free.back());
+            free.pop_back();
+            return msg;
+        }
+
+        // request tells which side of the exchange the message is, types are shared by both
+        void release(message* msg, bool request);
+
+        // messages ever allocated by the pool
+        std::size_t created() const noexcept { return m_created; }
+
+    private:
+        template<typename T>
+        constexpr static bool is_request() {
+            return std::is_same_v<T, list_patches_request> || std::is_same_v<T, upload_patch_request>
+                || std::is_same_v<T, delete_patch_request> || std::is_same_v<T, get_patches_request>
+                || std::is_same_v<T, get_batch_request> || std::is_same_v<T, sync_request>
+                || std::is_same_v<T, offer_request> || std::is_same_v<T, subscribe_request>
+                || std::is_same_v<T, local_upload_request> || std::is_same_v<T, local_download_request>
+                || std::is_same_v<T, upload_begin_request> || std::is_same_v<T, upload_part_request>
+                || std::is_same_v<T, upload_commit_request>;
+        }
+        static std::size_t index(message::etype type, bool request) noexcept {
+            return std::size_t(type) * 2 + (request ? 1 : 0);
+        }
+
+        std::array<std::vector<message*>, std::size_t(message::etype::count) * 2> m_free;
+        std::size_t m_created{ 0 };
+    };
+
+}
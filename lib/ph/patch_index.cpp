@@ -0,0 +1,226 @@
+#include "patch_index.h"
+#include "message.h"
+
+#include <algorithm>
+#include <cassert>
+#include <functional>
+
+void ph::id_table::insert(uint32_t id, uint32_t hash) {
+    // load factor stays below 1/2, probes are short
+    if ((m_size + 1) * 2 > m_cells.size()) {
+        grow();
+    }
+    const auto mask = m_cells.size() - 1;
+    auto i = hash & mask;
+    while (m_cells[i].id != npos) {
+        i = (i + 1) & mask;
+    }
+    m_cells[i] = { id, hash };
+    ++m_size;
+}
+
+void ph::id_table::erase(uint32_t id, uint32_t hash) {
+    if (m_size == 0) {
+        return;
+    }
+    const auto mask = m_cells.size() - 1;
+    auto i = hash & mask;
+    while (m_cells[i].id != id) {
+        if (m_cells[i].id == npos) {
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    // backward shift, so no tombstones are needed
+    for (auto j = (i + 1) & mask; m_cells[j].id != npos; j = (j + 1) & mask) {
+        const auto home = m_cells[j].hash & mask;
+        const auto movable = i <= j ? (home <= i || home > j) : (home <= i && home > j);
+        if (movable) {
+            m_cells[i] = m_cells[j];
+            i = j;
+        }
+    }
+    m_cells[i] = {};
+    --m_size;
+}
+
+void ph::id_table::grow() {
+    std::vector<cell> cells(std::max<std::size_t>(m_cells.size() * 2, 16));
+    std::swap(cells, m_cells);
+    const auto mask = m_cells.size() - 1;
+    for (const auto& c : cells) {
+        if (c.id != npos) {
+            auto i = c.hash & mask;
+            while (m_cells[i].id != npos) {
+                i = (i + 1) & mask;
+            }
+            m_cells[i] = c;
+        }
+    }
+}
+
+uint32_t ph::string_pool::hash(std::string_view value) noexcept {
+    const auto h = (uint64_t)std::hash<std::string_view>{}(value);
+    return uint32_t(h ^ (h >> 32));
+}
+
+uint32_t ph::string_pool::find(std::string_view value) const {
+    return m_index.find(hash(value), [&](uint32_t id) {
+        return m_entries[id].value == value;
+    });
+}
+
+uint32_t ph::string_pool::acquire(std::string_view value) {
+    const auto h = hash(value);
+    auto id = m_index.find(h, [&](uint32_t id) {
+        return m_entries[id].value == value;
+    });
+    if (id == id_table::npos) {
+        if (!m_free.empty()) {
+            id = m_free.back();
+            m_free.pop_back();
+            m_entries[id].value = value;
+        } else {
+            id = (uint32_t)m_entries.size();
+            m_entries.push_back({ std::string(value), 0 });
+        }
+        m_index.insert(id, h);
+    }
+    ++m_entries[id].refs;
+    return id;
+}
+
+void ph::string_pool::release(uint32_t id) {
+    auto& e = m_entries[id];
+    assert(e.refs > 0);
+    if (--e.refs == 0) {
+        m_index.erase(id, hash(e.value));
+        e.value = std::string();
+        m_free.push_back(id);
+    }
+}
+
+std::size_t ph::string_pool::memory() const noexcept {
+    auto total = m_entries.capacity() * sizeof(entry) + m_free.capacity() * sizeof(uint32_t) + m_index.memory();
+    for (const auto& e : m_entries) {
+        // short strings live inside std::string itself
+        if (e.value.capacity() > std::string().capacity()) {
+            total += e.value.capacity() + 1;
+        }
+    }
+    return total;
+}
+
+uint32_t ph::patch_index::key_hash(uint32_t tag, uint32_t name) noexcept {
+    auto h = (uint64_t(tag) << 32 | name) * 0x9E3779B97F4A7C15ULL;
+    return uint32_t(h >> 32);
+}
+
+uint32_t ph::patch_index::content_hash(uint64_t hash) noexcept {
+    return uint32_t(hash ^ (hash >> 32));
+}
+
+uint32_t ph::patch_index::find_slot(uint32_t tag, uint32_t name) const {
+    return m_by_name.find(key_hash(tag, name), [&](uint32_t slot) {
+        return m_records[slot].tag == tag && m_records[slot].name == name;
+    });
+}
+
+std::shared_ptr<ph::patch> ph::patch_index::put(std::shared_ptr<patch> p) {
+    const auto tag = m_tags.acquire(p->tag);
+    const auto name = m_names.acquire(p->name);
+    if (const auto slot = find_slot(tag, name); slot != id_table::npos) {
+        // refs are held by the record already
+        m_tags.release(tag);
+        m_names.release(name);
+        m_by_content.erase(slot, content_hash(m_patches[slot]->hash));
+        m_by_content.insert(slot, content_hash(p->hash));
+        std::swap(m_patches[slot], p);
+        return p;
+    }
+    uint32_t slot;
+    if (!m_free.empty()) {
+        slot = m_free.back();
+        m_free.pop_back();
+    } else {
+        slot = (uint32_t)m_records.size();
+        m_records.emplace_back();
+        m_patches.emplace_back();
+    }
+    m_records[slot] = { tag, name };
+    m_by_content.insert(slot, content_hash(p->hash));
+    m_patches[slot] = std::move(p);
+    if (m_tag_slots.size() <= tag) {
+        m_tag_slots.resize(m_tags.capacity());
+    }
+    m_tag_slots[tag].push_back(slot);
+    m_by_name.insert(slot, key_hash(tag, name));
+    return nullptr;
+}
+
+std::shared_ptr<ph::patch> ph::patch_index::find(std::string_view tag, std::string_view name) const {
+    const auto tag_id = m_tags.find(tag);
+    const auto name_id = m_names.find(name);
+    if (tag_id == id_table::npos || name_id == id_table::npos) {
+        return nullptr;
+    }
+    const auto slot = find_slot(tag_id, name_id);
+    return slot == id_table::npos ? nullptr : m_patches[slot];
+}
+
+std::shared_ptr<ph::patch> ph::patch_index::find_content(uint64_t hash, uint64_t size) const {
+    const auto slot = m_by_content.find(content_hash(hash), [&](uint32_t slot) {
+        return m_patches[slot]->hash == hash && m_patches[slot]->file_size == size;
+    });
+    return slot == id_table::npos ? nullptr : m_patches[slot];
+}
+
+bool ph::patch_index::contains(const std::shared_ptr<patch>& p) const {
+    const auto stored = find(p->tag, p->name);
+    return stored == p;
+}
+
+bool ph::patch_index::get(std::string_view tag, std::vector<std::shared_ptr<patch>>& out) const {
+    const auto tag_id = m_tags.find(tag);
+    if (tag_id == id_table::npos) {
+        return false;
+    }
+    const auto& slots = m_tag_slots[tag_id];
+    out.reserve(out.size() + slots.size());
+    for (const auto slot : slots) {
+        out.push_back(m_patches[slot]);
+    }
+    return true;
+}
+
+std::vector<std::shared_ptr<ph::patch>> ph::patch_index::erase(std::string_view tag) {
+    std::vector<std::shared_ptr<patch>> removed;
+    const auto tag_id = m_tags.find(tag);
+    if (tag_id == id_table::npos) {
+        return removed;
+    }
+    // tag id could be reused as soon as the last reference is released
+    auto slots = std::move(m_tag_slots[tag_id]);
+    m_tag_slots[tag_id] = {};
+    removed.reserve(slots.size());
+    for (const auto slot : slots) {
+        const auto& r = m_records[slot];
+        m_by_name.erase(slot, key_hash(r.tag, r.name));
+        m_by_content.erase(slot, content_hash(m_patches[slot]->hash));
+        m_names.release(r.name);
+        m_tags.release(r.tag);
+        removed.push_back(std::move(m_patches[slot]));
+        m_free.push_back(slot);
+    }
+    return removed;
+}
+
+std::size_t ph::patch_index::memory() const noexcept {
+    auto total = m_tags.memory() + m_names.memory() + m_by_name.memory() + m_by_content.memory()
+        + m_records.capacity() * sizeof(record) + m_patches.capacity() * sizeof(std::shared_ptr<patch>)
+        + m_free.capacity() * sizeof(uint32_t) + m_tag_slots.capacity() * sizeof(std::vector<uint32_t>);
+    for (const auto& slots : m_tag_slots) {
+        total += slots.capacity() * sizeof(uint32_t);
+    }
+    return total;
+}
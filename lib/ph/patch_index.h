@@ -0,0 +1,135 @@
+/* Copyright (C) 2025 Gleb Bezborodov - All Rights Reserved
+* You may use, distribute and modify this code under the
+ * terms of the MIT license.
+ *
+ * You should have received a copy of the MIT license with
+ * this file. If not, please write to: bezborodoff.gleb@gmail.com, or visit : https://github.com/glensand/patch-hub
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ph {
+
+    struct patch;
+
+    // open addressing table of ids with linear probing, keys live outside,
+    // only their hashes are kept here, so a cell is 8 bytes
+    class id_table final {
+    public:
+        constexpr static uint32_t npos = ~0u;
+
+        void insert(uint32_t id, uint32_t hash);
+        void erase(uint32_t id, uint32_t hash);
+
+        // first id with such hash accepted by pred
+        template<typename Pred>
+        uint32_t find(uint32_t hash, Pred&& pred) const {
+            if (m_size == 0) {
+                return npos;
+            }
+            const auto mask = m_cells.size() - 1;
+            for (auto i = hash & mask; m_cells[i].id != npos; i = (i + 1) & mask) {
+                if (m_cells[i].hash == hash && pred(m_cells[i].id)) {
+                    return m_cells[i].id;
+                }
+            }
+            return npos;
+        }
+
+        std::size_t size() const noexcept { return m_size; }
+        std::size_t memory() const noexcept { return m_cells.capacity() * sizeof(cell); }
+
+    private:
+        struct cell final {
+            uint32_t id{ npos };
+            uint32_t hash{ 0 };
+        };
+        void grow();
+
+        std::vector<cell> m_cells;
+        std::size_t m_size{ 0 };
+    };
+
+    // every string is stored once and referenced by id while it is in use
+    class string_pool final {
+    public:
+        uint32_t acquire(std::string_view value);
+        void release(uint32_t id);
+        uint32_t find(std::string_view value) const;
+        const std::string& get(uint32_t id) const { return m_entries[id].value; }
+        // ids are dense, could be used as index
+        std::size_t capacity() const noexcept { return m_entries.size(); }
+        std::size_t memory() const noexcept;
+
+    private:
+        struct entry final {
+            std::string value;
+            uint32_t refs{ 0 };
+        };
+        static uint32_t hash(std::string_view value) noexcept;
+
+        std::vector<entry> m_entries;
+        std::vector<uint32_t> m_free;
+        id_table m_index;
+    };
+
+    // registry of the hub: patches by (tag, name) and by content, tags and names are interned.
+    // Metadata sits in flat arrays indexed by slot, patch objects are kept aside
+    // as they carry payload and are streamed by messages as is
+    class patch_index final {
+    public:
+        // stores or replaces patch with the same tag and name, returns the replaced one
+        std::shared_ptr<patch> put(std::shared_ptr<patch> p);
+        std::shared_ptr<patch> find(std::string_view tag, std::string_view name) const;
+        // any patch with such content
+        std::shared_ptr<patch> find_content(uint64_t hash, uint64_t size) const;
+        // exactly this patch is registered
+        bool contains(const std::shared_ptr<patch>& p) const;
+        // patches of the tag in upload order are appended to out, returns false if there is no such tag
+        bool get(std::string_view tag, std::vector<std::shared_ptr<patch>>& out) const;
+        // removes the tag, returns its patches
+        std::vector<std::shared_ptr<patch>> erase(std::string_view tag);
+
+        template<typename F>
+        void for_each(F&& f) const {
+            for (const auto& p : m_patches) {
+                if (p != nullptr) {
+                    f(p);
+                }
+            }
+        }
+
+        std::size_t size() const noexcept { return m_patches.size() - m_free.size(); }
+        // bytes held by the index itself, patches are not counted
+        std::size_t memory() const noexcept;
+
+    private:
+        // size and hash are read from the patch itself, only on a match of the hash kept by the table
+        struct record final {
+            uint32_t tag;
+            uint32_t name;
+        };
+        static uint32_t key_hash(uint32_t tag, uint32_t name) noexcept;
+        static uint32_t content_hash(uint64_t hash) noexcept;
+        uint32_t find_slot(uint32_t tag, uint32_t name) const;
+
+        string_pool m_tags;
+        string_pool m_names;
+        // parallel arrays by slot, free slots have null patch
+        std::vector<record> m_records;
+        std::vector<std::shared_ptr<patch>> m_patches;
+        std::vector<uint32_t> m_free;
+        // by tag id
+        std::vector<std::vector<uint32_t>> m_tag_slots;
+        id_table m_by_name;
+        id_table m_by_content;
+    };
+
+}
@@ -0,0 +1,107 @@
+#include "patch_sink.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+    class file_sink final : public ph::patch_sink {
+    public:
+        file_sink(std::string in_path, uint64_t in_size, int in_descriptor)
+            : m_path(std::move(in_path)), m_size(in_size), m_descriptor(in_descriptor) {
+            if (m_size == 0) {
+                close();
+            }
+        }
+
+        virtual ~file_sink() override {
+            close();
+        }
+
+        virtual void write(uint64_t offset, const uint8_t* data, std::size_t size) override {
+            if (size == 0) {
+                return;
+            }
+            if (m_descriptor < 0) {
+                throw std::runtime_error("Patch sink is already closed: " + m_path);
+            }
+            std::size_t total = 0;
+            while (total < size) {
+                const auto count = pwrite_impl(offset + total, data + total, size - total);
+                if (count <= 0) {
+                    throw std::runtime_error("Cannot write patch sink: " + m_path);
+                }
+                total += count;
+            }
+            m_written += size;
+            if (m_written == m_size) {
+                close();
+            }
+        }
+
+    private:
+        void close() {
+            if (m_descriptor >= 0) {
+#ifdef _WIN32
+                ::_close(m_descriptor);
+#else
+                ::close(m_descriptor);
+#endif
+                m_descriptor = -1;
+            }
+        }
+
+        int64_t pwrite_impl(uint64_t offset, const uint8_t* data, std::size_t size) const {
+#ifdef _WIN32
+            if (::_lseeki64(m_descriptor, (int64_t)offset, SEEK_SET) < 0) {
+                return -1;
+            }
+            return ::_write(m_descriptor, data, (unsigned)std::min<std::size_t>(size, INT32_MAX));
+#else
+            return ::pwrite(m_descriptor, data, size, (off_t)offset);
+#endif
+        }
+
+        std::string m_path;
+        uint64_t m_size{ 0 };
+        uint64_t m_written{ 0 };
+        int m_descriptor{ -1 };
+    };
+
+}
+
+std::shared_ptr<ph::patch_sink> ph::create_file_sink(const std::string& path, uint64_t size) {
+#ifdef _WIN32
+    const auto descriptor = ::_open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+    if (descriptor < 0) {
+        return nullptr;
+    }
+    // extending the file reserves space, zeroes are overwritten by the payload
+    if (size > 0 && ::_chsize_s(descriptor, (int64_t)size) != 0) {
+        ::_close(descriptor);
+        return nullptr;
+    }
+#else
+    const auto descriptor = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (descriptor < 0) {
+        return nullptr;
+    }
+    if (size > 0 && ::posix_fallocate(descriptor, 0, (off_t)size) != 0) {
+        // filesystem may not support preallocation, size the file at least
+        if (::ftruncate(descriptor, (off_t)size) != 0) {
+            ::close(descriptor);
+            return nullptr;
+        }
+    }
+#endif
+    return std::make_shared<file_sink>(path, size, descriptor);
+}
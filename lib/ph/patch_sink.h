@@ -0,0 +1,31 @@
+/* Copyright (C) 2025 Gleb Bezborodov - All Rights Reserved
+* You may use, distribute and modify this code under the
+ * terms of the MIT license.
+ *
+ * You should have received a copy of the MIT license with
+ * this file. If not, please write to: bezborodoff.gleb@gmail.com, or visit : https://github.com/glensand/patch-hub
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace ph {
+
+    // receiver of patch bytes, patch_message hands every received piece to it right from the chunk,
+    // so the whole patch is never held in memory
+    class patch_sink {
+    public:
+        virtual ~patch_sink() = default;
+        // stores size bytes at offset, throws on failure
+        virtual void write(uint64_t offset, const uint8_t* data, std::size_t size) = 0;
+    };
+
+    // creates (or truncates) the file and preallocates size bytes for it,
+    // file is closed once the last byte is written, returns nullptr if the file cannot be created
+    std::shared_ptr<patch_sink> create_file_sink(const std::string& path, uint64_t size);
+
+}
@@ -0,0 +1,313 @@
+#include "patch_source.h"
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <filesystem>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+    class file_source final : public ph::patch_source {
+    public:
+        file_source(std::string in_path, uint64_t in_size, bool in_held = false)
+            : m_path(std::move(in_path)), m_size(in_size), m_held(in_held) {
+            if (m_held) {
+                open();
+            }
+        }
+        // takes over the opened file
+        file_source(std::string in_path, uint64_t in_size, int in_descriptor)
+            : m_path(std::move(in_path)), m_size(in_size), m_held(true), m_descriptor(in_descriptor) { }
+
+        virtual ~file_source() override {
+            close();
+        }
+
+        virtual std::size_t read(uint64_t offset, uint8_t* out, std::size_t size) override {
+            if (m_descriptor < 0) {
+                open();
+            }
+            std::size_t total = 0;
+            while (total < size) {
+                const auto count = pread_impl(offset + total, out + total, size - total);
+                if (count <= 0) {
+                    throw std::runtime_error("Cannot read patch source: " + m_path);
+                }
+                total += count;
+            }
+            if (offset + total == m_size && !m_held) {
+                close();
+            }
+            return total;
+        }
+
+        virtual uint64_t size() const override {
+            return m_size;
+        }
+
+    private:
+        void open() {
+#ifdef _WIN32
+            m_descriptor = ::_open(m_path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+            m_descriptor = ::open(m_path.c_str(), O_RDONLY);
+#endif
+            if (m_descriptor < 0) {
+                throw std::runtime_error("Cannot open patch source: " + m_path);
+            }
+        }
+
+        void close() {
+            if (m_descriptor >= 0) {
+#ifdef _WIN32
+                ::_close(m_descriptor);
+#else
+                ::close(m_descriptor);
+#endif
+                m_descriptor = -1;
+            }
+        }
+
+        int64_t pread_impl(uint64_t offset, uint8_t* out, std::size_t size) const {
+#ifdef _WIN32
+            if (::_lseeki64(m_descriptor, (int64_t)offset, SEEK_SET) < 0) {
+                return -1;
+            }
+            return ::_read(m_descriptor, out, (unsigned)std::min<std::size_t>(size, INT32_MAX));
+#else
+            return ::pread(m_descriptor, out, size, (off_t)offset);
+#endif
+        }
+
+        std::string m_path;
+        uint64_t m_size{ 0 };
+        bool m_held{ false };
+        int m_descriptor{ -1 };
+    };
+
+    class prefetch_source final : public ph::patch_source {
+    public:
+        prefetch_source(std::shared_ptr<ph::patch_source> in_source, ph::reader_pool& in_pool, std::size_t in_block_size)
+            : m_source(std::move(in_source)), m_pool(in_pool), m_block_size(in_block_size) {
+            m_state = std::make_shared<state>();
+        }
+
+        virtual ~prefetch_source() override {
+            // pending block holds its own references to the state and the source
+            if (m_next_scheduled) {
+                std::unique_lock lock(m_state->mutex);
+                m_state->cv.wait(lock, [this] { return m_state->ready; });
+            }
+        }
+
+        virtual std::size_t read(uint64_t offset, uint8_t* out, std::size_t size) override {
+            if (!in_current(offset)) {
+                if (!m_next_scheduled) {
+                    schedule(offset);
+                }
+                wait_next();
+                if (!in_current(offset)) {
+                    // random access, prefetch cannot help here
+                    return m_source->read(offset, out, size);
+                }
+                schedule(m_current_offset + m_current.size());
+            }
+            const auto position = std::size_t(offset - m_current_offset);
+            const auto count = std::min(size, m_current.size() - position);
+            std::memcpy(out, m_current.data() + position, count);
+            return count;
+        }
+
+        virtual uint64_t size() const override {
+            return m_source->size();
+        }
+
+    private:
+        struct state final {
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::vector<uint8_t> block;
+            uint64_t offset{ 0 };
+            bool ready{ false };
+            std::exception_ptr error;
+        };
+
+        bool in_current(uint64_t offset) const noexcept {
+            return offset >= m_current_offset && offset < m_current_offset + m_current.size();
+        }
+
+        void schedule(uint64_t offset) {
+            if (offset >= m_source->size()) {
+                return;
+            }
+            const auto count = std::size_t(std::min<uint64_t>(m_block_size, m_source->size() - offset));
+            m_next_scheduled = true;
+            m_state->ready = false;
+            m_pool.enqueue([state = m_state, source = m_source, offset, count] {
+                std::vector<uint8_t> block(count);
+                std::exception_ptr error;
+                try {
+                    source->read(offset, block.data(), count);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                std::lock_guard lock(state->mutex);
+                state->block = std::move(block);
+                state->offset = offset;
+                state->error = error;
+                state->ready = true;
+                state->cv.notify_one();
+            });
+        }
+
+        void wait_next() {
+            if (!m_next_scheduled) {
+                return;
+            }
+            std::unique_lock lock(m_state->mutex);
+            m_state->cv.wait(lock, [this] { return m_state->ready; });
+            m_next_scheduled = false;
+            if (m_state->error) {
+                std::rethrow_exception(m_state->error);
+            }
+            m_current.swap(m_state->block);
+            m_current_offset = m_state->offset;
+        }
+
+        std::shared_ptr<ph::patch_source> m_source;
+        ph::reader_pool& m_pool;
+        const std::size_t m_block_size;
+
+        std::shared_ptr<state> m_state;
+        bool m_next_scheduled{ false };
+        std::vector<uint8_t> m_current;
+        uint64_t m_current_offset{ 0 };
+    };
+
+}
+
+ph::reader_pool::reader_pool(std::size_t threads) {
+    for (std::size_t i = 0; i < std::max<std::size_t>(threads, 1); ++i) {
+        m_threads.emplace_back([this] { run(); });
+    }
+}
+
+ph::reader_pool::~reader_pool() {
+    {
+        std::lock_guard lock(m_mutex);
+        m_running = false;
+    }
+    m_cv.notify_all();
+    for (auto& t : m_threads) {
+        t.join();
+    }
+}
+
+void ph::reader_pool::enqueue(std::function<void()> task) {
+    {
+        std::lock_guard lock(m_mutex);
+        m_tasks.emplace_back(std::move(task));
+    }
+    m_cv.notify_one();
+}
+
+void ph::reader_pool::run() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock lock(m_mutex);
+            m_cv.wait(lock, [this] { return !m_tasks.empty() || !m_running; });
+            if (m_tasks.empty()) {
+                return;
+            }
+            task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+        }
+        task();
+    }
+}
+
+std::shared_ptr<ph::patch_source> ph::create_prefetch_source(std::shared_ptr<patch_source> source,
+    reader_pool& pool, std::size_t block_size) {
+    return std::make_shared<prefetch_source>(std::move(source), pool, block_size);
+}
+
+std::shared_ptr<ph::patch_source> ph::create_file_source(const std::string& path) {
+    std::error_code ec;
+    const auto size = std::filesystem::file_size(path, ec);
+    if (ec) {
+        return nullptr;
+    }
+    return std::make_shared<file_source>(path, (uint64_t)size);
+}
+
+std::shared_ptr<ph::patch_source> ph::create_held_file_source(const std::string& path) {
+    std::error_code ec;
+    const auto size = std::filesystem::file_size(path, ec);
+    if (ec) {
+        return nullptr;
+    }
+    try {
+        return std::make_shared<file_source>(path, (uint64_t)size, true);
+    } catch (const std::exception&) {
+        return nullptr;
+    }
+}
+
+std::shared_ptr<ph::patch_source> ph::create_file_source_within(const std::string& path, const std::string& dir) {
+    std::error_code ec;
+    const auto root = std::filesystem::weakly_canonical(dir, ec);
+    if (ec) {
+        return nullptr;
+    }
+#ifdef _WIN32
+    const auto descriptor = ::_open(path.c_str(), _O_RDONLY | _O_BINARY);
+    if (descriptor < 0) {
+        return nullptr;
+    }
+    // name of the file which is actually open, whatever links led to it
+    std::wstring name(32768, L'\0');
+    const auto length = ::GetFinalPathNameByHandleW((HANDLE)::_get_osfhandle(descriptor), name.data(),
+        (DWORD)name.size(), FILE_NAME_NORMALIZED);
+    name.resize(length < name.size() ? length : 0);
+    if (name.rfind(L"\\\\?\\", 0) == 0) {
+        name.erase(0, 4);
+    }
+    const auto opened = std::filesystem::path(name);
+    const auto size = ::_filelengthi64(descriptor);
+    const auto same = !name.empty() && size >= 0;
+#else
+    const auto descriptor = ::open(path.c_str(), O_RDONLY | O_NOFOLLOW);
+    if (descriptor < 0) {
+        return nullptr;
+    }
+    // the name leads to the very file which is open, links of the dirs above it are resolved
+    const auto opened = std::filesystem::weakly_canonical(path, ec);
+    struct stat held{};
+    struct stat named{};
+    const auto same = !ec && ::fstat(descriptor, &held) == 0 && S_ISREG(held.st_mode)
+        && ::stat(opened.c_str(), &named) == 0 && held.st_dev == named.st_dev && held.st_ino == named.st_ino;
+    const auto size = held.st_size;
+#endif
+    if (!same || std::mismatch(root.begin(), root.end(), opened.begin(), opened.end()).first != root.end()) {
+#ifdef _WIN32
+        ::_close(descriptor);
+#else
+        ::close(descriptor);
+#endif
+        return nullptr;
+    }
+    return std::make_shared<file_source>(path, (uint64_t)size, descriptor);
+}
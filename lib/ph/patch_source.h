@@ -0,0 +1,71 @@
+/* Copyright (C) 2025 Gleb Bezborodov - All Rights Reserved
+* You may use, distribute and modify this code under the
+ * terms of the MIT license.
+ *
+ * You should have received a copy of the MIT license with
+ * this file. If not, please write to: bezborodoff.gleb@gmail.com, or visit : https://github.com/glensand/patch-hub
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ph {
+
+    // lazy provider of patch bytes, patch_message pulls data from it chunk by chunk,
+    // so the whole patch is never held in memory
+    class patch_source {
+    public:
+        virtual ~patch_source() = default;
+        // copies up to size bytes starting from offset to out, returns count of copied bytes
+        virtual std::size_t read(uint64_t offset, uint8_t* out, std::size_t size) = 0;
+        virtual uint64_t size() const = 0;
+        // true if the bytes could be read without waiting for the disk, otherwise they are brought in background
+        // and resume (if set) is called once the first missing part is in. Sources which always read in place
+        // say true
+        virtual bool ready(uint64_t /*offset*/, std::size_t /*size*/, std::function<void()> /*resume*/) { return true; }
+    };
+
+    // file is opened on first read and closed once the last byte is read,
+    // returns nullptr if the file cannot be opened
+    std::shared_ptr<patch_source> create_file_source(const std::string& path);
+    // file is opened right away and stays open while the source lives, so the path may be renamed or removed
+    // meanwhile, returns nullptr if the file cannot be opened
+    std::shared_ptr<patch_source> create_held_file_source(const std::string& path);
+    // held file which is inside the dir, a link in place of the file is not followed and the place is checked
+    // through the opened file, so what is checked is what is read; returns nullptr if the file cannot be opened
+    // or is not inside the dir
+    std::shared_ptr<patch_source> create_file_source_within(const std::string& path, const std::string& dir);
+
+    // fixed set of threads doing disk reads for prefetch sources
+    class reader_pool final {
+    public:
+        explicit reader_pool(std::size_t threads);
+        ~reader_pool();
+        void enqueue(std::function<void()> task);
+    private:
+        void run();
+
+        std::vector<std::thread> m_threads;
+        std::deque<std::function<void()>> m_tasks;
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        bool m_running{ true };
+    };
+
+    // reads the next block of the underlying source on the pool while the current one is being sent,
+    // so disk reads overlap with network sends; memory per source is bounded by two blocks.
+    // Expects sequential access (as patch_message does), falls back to direct reads otherwise
+    std::shared_ptr<patch_source> create_prefetch_source(std::shared_ptr<patch_source> source,
+        reader_pool& pool, std::size_t block_size = 4 * 1024 * 1024);
+
+}
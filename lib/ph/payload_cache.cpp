@@ -0,0 +1,70 @@
+#include "payload_cache.h"
+#include "message.h"
+
+void ph::payload_cache::insert(const std::shared_ptr<patch>& p, bool pinned) {
+    if (const auto existing = m_entries.find(p.get()); existing != m_entries.end()) {
+        existing->second->pinned = pinned;
+        m_lru.splice(m_lru.begin(), m_lru, existing->second);
+        return;
+    }
+    m_lru.push_front(entry{ p, pinned });
+    m_entries.emplace(p.get(), m_lru.begin());
+    m_resident += p->file_size;
+    m_resident_bytes.store(m_resident, std::memory_order_relaxed);
+}
+
+void ph::payload_cache::unpin(const patch* p) {
+    if (const auto existing = m_entries.find(p); existing != m_entries.end()) {
+        existing->second->pinned = false;
+    }
+}
+
+void ph::payload_cache::erase(const patch* p) {
+    if (const auto existing = m_entries.find(p); existing != m_entries.end()) {
+        m_resident -= p->file_size;
+        m_resident_bytes.store(m_resident, std::memory_order_relaxed);
+        m_lru.erase(existing->second);
+        m_entries.erase(existing);
+    }
+}
+
+bool ph::payload_cache::touch(const patch* p) {
+    if (const auto existing = m_entries.find(p); existing != m_entries.end()) {
+        m_lru.splice(m_lru.begin(), m_lru, existing->second);
+        m_hits.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    m_misses.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+std::vector<std::shared_ptr<ph::patch>> ph::payload_cache::take_victims() {
+    std::vector<std::shared_ptr<patch>> victims;
+    if (m_budget == 0) {
+        return victims;
+    }
+    auto it = m_lru.end();
+    while (m_resident > m_budget && it != m_lru.begin()) {
+        --it;
+        if (it->pinned) {
+            continue;
+        }
+        m_resident -= it->p->file_size;
+        m_entries.erase(it->p.get());
+        victims.emplace_back(std::move(it->p));
+        it = m_lru.erase(it);
+    }
+    m_resident_bytes.store(m_resident, std::memory_order_relaxed);
+    m_evictions.fetch_add(victims.size(), std::memory_order_relaxed);
+    return victims;
+}
+
+ph::cache_stats ph::payload_cache::stats() const {
+    cache_stats stats;
+    stats.budget = m_budget;
+    stats.resident_bytes = m_resident_bytes.load(std::memory_order_relaxed);
+    stats.hits = m_hits.load(std::memory_order_relaxed);
+    stats.misses = m_misses.load(std::memory_order_relaxed);
+    stats.evictions = m_evictions.load(std::memory_order_relaxed);
+    return stats;
+}
@@ -0,0 +1,74 @@
+/* Copyright (C) 2025 Gleb Bezborodov - All Rights Reserved
+* You may use, distribute and modify this code under the
+ * terms of the MIT license.
+ *
+ * You should have received a copy of the MIT license with
+ * this file. If not, please write to: bezborodoff.gleb@gmail.com, or visit : https://github.com/glensand/patch-hub
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "service.h"
+
+namespace ph {
+
+    struct patch;
+
+    // lru over patch payloads held in memory, only does the bookkeeping,
+    // the owner decides how payload is loaded and dropped.
+    // Not thread safe except stats()
+    class payload_cache final {
+    public:
+        // zero budget means no limit, nothing is ever evicted
+        explicit payload_cache(uint64_t budget) : m_budget(budget) { }
+
+        // payload of the patch is in memory now, pinned payload is never evicted
+        // (e.g. uploaded patch which is not on disk yet)
+        void insert(const std::shared_ptr<patch>& p, bool pinned);
+        void unpin(const patch* p);
+        void erase(const patch* p);
+
+        // patch is about to be sent, returns true if its payload is in memory
+        bool touch(const patch* p);
+        bool contains(const patch* p) const { return m_entries.count(p) != 0; }
+        bool pinned(const patch* p) const {
+            const auto it = m_entries.find(p);
+            return it != end(m_entries) && it->second->pinned;
+        }
+        // payload of such size could be held without evicting everything else
+        bool admits(uint64_t size) const { return m_budget == 0 || size <= m_budget / 2; }
+        bool has_room(uint64_t size) const { return m_budget == 0 || m_resident + size <= m_budget; }
+
+        // least recently used payloads to be dropped to fit the budget, removed from the cache
+        std::vector<std::shared_ptr<patch>> take_victims();
+
+        cache_stats stats() const;
+
+    private:
+        struct entry final {
+            std::shared_ptr<patch> p;
+            bool pinned;
+        };
+        using lru_t = std::list<entry>;
+
+        // most recently used first
+        lru_t m_lru;
+        std::unordered_map<const patch*, lru_t::iterator> m_entries;
+        const uint64_t m_budget;
+        uint64_t m_resident{ 0 };
+
+        // read from other threads
+        std::atomic<uint64_t> m_resident_bytes{ 0 };
+        std::atomic<uint64_t> m_hits{ 0 };
+        std::atomic<uint64_t> m_misses{ 0 };
+        std::atomic<uint64_t> m_evictions{ 0 };
+    };
+
+}
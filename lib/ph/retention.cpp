@@ -0,0 +1,77 @@
+#include "retention.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+bool ph::split_tag(const std::string& tag, std::string& platform, uint64_t& revision) {
+    const auto separator = tag.find_last_of('_');
+    if (separator == std::string::npos || separator + 1 == tag.size() || separator == 0) {
+        return false;
+    }
+    revision = 0;
+    for (auto i = separator + 1; i < tag.size(); ++i) {
+        if (tag[i] < '0' || tag[i] > '9') {
+            return false;
+        }
+        revision = revision * 10 + (tag[i] - '0');
+    }
+    platform = tag.substr(0, separator);
+    return true;
+}
+
+std::vector<std::string> ph::expired_tags(std::vector<tag_info> tags,
+    const std::vector<retention_rule>& rules, std::chrono::system_clock::time_point now) {
+    struct revision_info final {
+        const tag_info* info;
+        uint64_t revision;
+    };
+    // platform -> its tags
+    std::unordered_map<std::string, std::vector<revision_info>> platforms;
+    for (const auto& info : tags) {
+        std::string platform;
+        uint64_t revision = 0;
+        if (!split_tag(info.tag, platform, revision)) {
+            platform = info.tag;
+        }
+        platforms[platform].push_back({ &info, revision });
+    }
+    const retention_rule* fallback = nullptr;
+    for (const auto& rule : rules) {
+        if (rule.platform.empty()) {
+            fallback = &rule;
+        }
+    }
+    std::vector<const tag_info*> expired;
+    for (auto& [platform, revisions] : platforms) {
+        const auto* rule = fallback;
+        for (const auto& r : rules) {
+            if (r.platform == platform) {
+                rule = &r;
+            }
+        }
+        if (rule == nullptr) {
+            continue;
+        }
+        // newest first
+        std::sort(begin(revisions), end(revisions), [](const auto& l, const auto& r) {
+            return l.revision > r.revision;
+        });
+        for (std::size_t i = 0; i < revisions.size(); ++i) {
+            const auto* info = revisions[i].info;
+            const auto too_old = rule->max_age.count() != 0 && now - info->updated > rule->max_age;
+            const auto too_many = rule->keep_last != 0 && i >= rule->keep_last;
+            if (too_old || too_many) {
+                expired.push_back(info);
+            }
+        }
+    }
+    std::sort(begin(expired), end(expired), [](const auto* l, const auto* r) {
+        return l->updated < r->updated;
+    });
+    std::vector<std::string> result;
+    result.reserve(expired.size());
+    for (const auto* info : expired) {
+        result.push_back(info->tag);
+    }
+    return result;
+}
@@ -0,0 +1,34 @@
+/* Copyright (C) 2025 Gleb Bezborodov - All Rights Reserved
+* You may use, distribute and modify this code under the
+ * terms of the MIT license.
+ *
+ * You should have received a copy of the MIT license with
+ * this file. If not, please write to: bezborodoff.gleb@gmail.com, or visit : https://github.com/glensand/patch-hub
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "service.h"
+
+namespace ph {
+
+    struct tag_info final {
+        std::string tag;
+        // last upload to the tag
+        std::chrono::system_clock::time_point updated;
+    };
+
+    // "platform_revision" -> platform, revision; false if the tag has no numeric revision
+    bool split_tag(const std::string& tag, std::string& platform, uint64_t& revision);
+
+    // tags to be removed according to the rules, oldest first;
+    // keep_last applies only to tags with revision, the whole tag is a platform otherwise
+    std::vector<std::string> expired_tags(std::vector<tag_info> tags,
+        const std::vector<retention_rule>& rules, std::chrono::system_clock::time_point now);
+
+}
@@ -1,15 +1,22 @@
 #include "service.h"
 
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>
 #include <cstdlib>
+#include <deque>
+#include <map>
 #include <thread>
 #include <iostream>
 #include <unordered_map>
-#include <array>
+#include <unordered_set>
 #include <vector>
 #include <fstream>
 #include <memory>
+#include <mutex>
+#include <random>
 #include <filesystem>
+#include <cstring>
 
 #include "hope-io/net/stream.h"
 #include "hope-io/net/event_loop.h"
@@ -19,242 +26,2168 @@
 
 #include "stream_wrapper.h"
 #include "message.h"
+#include "message_pool.h"
+#include "patch_index.h"
+#include "payload_cache.h"
+#include "retention.h"
+#include "timer_wheel.h"
+#include "token_bucket.h"
+#include "socket_address.h"
+#include "block_cache.h"
+#include "client.h"
+#include "patch_sink.h"
+#include "patch_source.h"
 #include "hope_thread/containers/queue/spsc_queue.h"
 #include "hope_thread/runtime/worker_thread.h"
 
 namespace ph {
 
+    // payload of a patch the hub already holds, lets the same content be linked into another tag without a copy
+    class linked_source final : public patch_source {
+    public:
+        explicit linked_source(std::shared_ptr<const patch> in_origin)
+            : origin(std::move(in_origin)) { }
+
+        virtual std::size_t read(uint64_t offset, uint8_t* out, std::size_t size) override {
+            if (origin->data != nullptr) {
+                std::memcpy(out, origin->data + offset, size);
+                return size;
+            }
+            return origin->source->read(offset, out, size);
+        }
+        virtual uint64_t size() const override {
+            return origin->file_size;
+        }
+
+        const std::shared_ptr<const patch> origin;
+    };
+
+    // tag being fetched from the upstream, gets waiting for it are answered once the headers are in
+    // and their payload goes out as it arrives
+    struct fetch_feed final {
+        // as the upstream announced them, sources read the files being received
+        std::vector<std::shared_ptr<patch>> patches;
+        uint64_t total{ 0 };
+        // payload of all patches received so far, in the order it is sent
+        std::atomic<uint64_t> received{ 0 };
+        // progress is on its way to the loop
+        std::atomic_bool announced{ false };
+        // loop thread only, the fetch is over and nothing more is received
+        bool done{ false };
+        // loop thread only, connections waiting for more payload
+        std::vector<int32_t> starving;
+
+        bool broken() const noexcept {
+            return done && received.load() < total;
+        }
+    };
+
+    // passes received payload on and tells how much of it is there
+    class feed_sink final : public patch_sink {
+    public:
+        feed_sink(std::shared_ptr<patch_sink> in_sink, std::function<void(std::size_t)> in_received)
+            : m_sink(std::move(in_sink)), m_received(std::move(in_received)) { }
+
+        virtual void write(uint64_t offset, const uint8_t* data, std::size_t size) override {
+            m_sink->write(offset, data, size);
+            m_received(size);
+        }
+
+    private:
+        std::shared_ptr<patch_sink> m_sink;
+        std::function<void(std::size_t)> m_received;
+    };
+
+    // bandwidth shared by downloads of one tag
+    struct tag_limit final {
+        token_bucket bucket;
+        std::size_t users{ 0 };
+    };
+    using tag_limits = std::unordered_map<std::string, tag_limit>;
+
+    // state of a connection, request while it is being read, then response while it is being written
+    struct client_state final {
+        message* msg{ nullptr };
+        bool active{ false };
+        bool responding{ false };
+        // largest chunk the client receives, zero if it did not tell
+        uint32_t peer_chunk{ 0 };
+        // chunk size of the response, grows while it is streamed
+        uint32_t chunk{ 0 };
+        // it is decided whether the request is served now or waits
+        bool admitted{ false };
+        // takes a slot of transfers
+        bool bulk{ false };
+        // waits for admission with the socket unread, ready if the request is fully read
+        bool waiting{ false };
+        bool ready{ false };
+        hope::io::event_loop::connection* connection{ nullptr };
+        // upload payload in memory accounted for this connection
+        uint64_t reserved{ 0 };
+        // response is a download, it is written in quanta and gives way to interactive ones
+        bool scheduled{ false };
+        bool interactive{ false };
+        token_bucket rate;
+        tag_limits::value_type* tag{ nullptr };
+        // subscription waits for a change with the socket unread
+        bool subscribed{ false };
+        // request waits for background work (e.g. get of a missing tag for the upstream) with nothing to send,
+        // it is executed again once the work is done and answered from what the work left
+        bool pending{ false };
+        bool resumed{ false };
+        // response is a tag still being fetched, it sends no payload before the payload is received
+        std::shared_ptr<fetch_feed> feed;
+        // rate limited response waits idle for its buckets to refill
+        bool throttled{ false };
+        // response waits idle for disk blocks the next chunk reads
+        bool cold{ false };
+        // bytes of the response written so far
+        uint64_t written{ 0 };
+    };
+
+    // client states indexed by descriptor, the os reuses the lowest free descriptors,
+    // so the slab stays as large as the peak count of connections and lookups are plain indexing
+    class client_slab final {
+    public:
+        client_state* find(int32_t descriptor) {
+            if (descriptor < 0 || std::size_t(descriptor) >= m_states.size() || !m_states[descriptor].active) {
+                return nullptr;
+            }
+            return &m_states[descriptor];
+        }
+        client_state* emplace(int32_t descriptor, message* msg) {
+            if (std::size_t(descriptor) >= m_states.size()) {
+                m_states.resize(std::max<std::size_t>(descriptor + 1, m_states.size() * 2));
+            }
+            auto& state = m_states[descriptor];
+            state = client_state{};
+            state.msg = msg;
+            state.active = true;
+            return &state;
+        }
+        static void erase(client_state* state) {
+            *state = {};
+        }
+    private:
+        std::vector<client_state> m_states;
+    };
+
+    // deadlines of a connection, activity only moves the timestamps, its timer checks them when it fires
+    struct connection_timer final {
+        using clock = std::chrono::steady_clock;
+
+        hope::io::event_loop::connection* connection{ nullptr };
+        clock::time_point created;
+        clock::time_point active;
+        // rate is measured from here
+        clock::time_point window;
+        uint64_t window_bytes{ 0 };
+        // first chunk of the request is received
+        bool header{ false };
+        // subscription is answered by then whatever happens
+        clock::time_point poll_until{ clock::time_point::max() };
+    };
+
+    // what a replica pulled for one tag of the primary
+    struct replica_update final {
+        std::string tag;
+        // written to the partial files, renamed into place by the loop
+        std::vector<std::shared_ptr<patch>> received;
+        std::vector<std::string> partial;
+        std::vector<std::string> removed;
+    };
+
+    // patch assembled from parts which come over several connections, published on commit
+    struct multipart_upload final {
+        std::shared_ptr<patch> meta;
+        // parts are written here, renamed into place on commit
+        std::string path;
+        // offset -> size of the parts taken, they never overlap
+        std::map<uint64_t, uint64_t> ranges;
+        uint64_t received{ 0 };
+        connection_timer::clock::time_point active;
+        bool committing{ false };
+        // commit is done, the patch is published if committed
+        bool done{ false };
+        bool committed{ false };
+        // io thread only
+        std::shared_ptr<patch_sink> sink;
+        bool broken{ false };
+
+        // part is taken if it lies inside the patch and misses every part taken before
+        bool take(uint64_t offset, const patch& part) {
+            const auto size = part.file_size;
+            if (committing || size == 0 || part.tag != meta->tag || part.name != meta->name
+                || size > meta->file_size || offset > meta->file_size - size) {
+                return false;
+            }
+            const auto next = ranges.lower_bound(offset);
+            if (next != end(ranges) && next->first < offset + size) {
+                return false;
+            }
+            if (next != begin(ranges) && std::prev(next)->first + std::prev(next)->second > offset) {
+                return false;
+            }
+            ranges.emplace_hint(next, offset, size);
+            received += size;
+            return true;
+        }
+    };
+
     class service_impl final : public service {
         using buffer_t = hope::io::event_loop::fixed_size_buffer;
+        // smallest chunk which still fits any patch header
+        constexpr static uint32_t min_chunk = 4 * 1024;
+        using clock = connection_timer::clock;
+        // deadlines are kept with this precision
+        constexpr static auto timer_tick = std::chrono::milliseconds(100);
+        // replica waits this long for changes at the primary, the primary answers as soon as one comes,
+        // the wait only bounds how long the replica takes to notice it is stopped
+        constexpr static auto replica_wait = std::chrono::milliseconds(1000);
+        // replica starts over this often after replication failed
+        constexpr static auto replica_retry = std::chrono::milliseconds(200);
     public:
-        using clients_t = std::unordered_map<int32_t, message*>;
-        using state_t = clients_t::iterator;
-        using exec_t = std::function<void(event_loop_stream_wrapper& stream, hope::io::event_loop::connection& c,
-            state_t in_state, message* msg)>;
+        using state_t = client_state*;
+
+        virtual void stop() override {
+            m_event_loop->stop();
+        }
+        explicit service_impl(const service_config& config)
+            : m_blocks(config.read_cache_budget, 1024 * 1024, [this](std::function<void()> read, std::function<void()> done) {
+                // blocks are read on the io thread, the loop goes on with other connections meanwhile
+                m_io_cmd.enqueue([this, read = std::move(read), done = std::move(done)]() mutable {
+                    read();
+                    post(m_io_done, std::move(done));
+                });
+            })
+            , m_cache(config.memory_budget)
+            , m_retention(config.retention)
+            , m_gc_interval(config.gc_interval)
+            , m_gc_batch(std::max<std::size_t>(config.gc_batch, 1))
+            , m_initial_chunk(config.initial_chunk == 0 ? 0 : std::max(config.initial_chunk, min_chunk))
+            , m_max_upload_bytes(config.max_upload_bytes)
+            , m_max_transfers(config.max_transfers)
+            , m_max_request_bytes(config.max_request_bytes != 0 ? config.max_request_bytes : config.max_upload_bytes)
+            , m_header_timeout(config.header_timeout)
+            , m_idle_timeout(config.idle_timeout)
+            , m_min_transfer_rate(config.min_transfer_rate)
+            , m_rate_window(std::max(config.rate_window, std::chrono::milliseconds(timer_tick)))
+            , m_epoch(clock::now())
+            , m_write_quantum(config.write_quantum == 0 ? 0 : std::max(config.write_quantum, min_chunk))
+            , m_connection_rate(config.connection_rate)
+            , m_tag_rate(config.tag_rate)
+            , m_max_subscribe_wait(config.max_subscribe_wait)
+            , m_change_log(std::max<std::size_t>(config.change_log, 1))
+            , m_upstream_host(config.upstream_host)
+            , m_upstream_port(config.upstream_port)
+            , m_local_dir(config.local_dir)
+            , m_upload_expiry(config.upload_expiry)
+            , m_max_multipart_size(config.max_multipart_size)
+            , m_max_multipart_uploads(config.max_multipart_uploads)
+            , m_primary_host(config.primary_host)
+            , m_primary_port(config.primary_port)
+            , m_cache_dir(config.cache_dir)
+            , m_wake_token(uint64_t(std::random_device{}()) << 32 | std::random_device{}())
+        {
+            if (!m_upstream_host.empty()) {
+                m_fetcher = std::make_unique<reader_pool>(1);
+            }
+            restore_from_cache();
+            m_running = true;
+            m_io = std::thread([this] {
+	            io();
+            });
+            if (!m_primary_host.empty()) {
+                // what is restored is what the replica holds of the primary
+                m_index.for_each([this](const std::shared_ptr<patch>& p) {
+                    auto meta = std::make_shared<patch>();
+                    meta->name = p->name;
+                    meta->tag = p->tag;
+                    meta->file_size = p->file_size;
+                    meta->hash = p->hash;
+                    m_mirror[p->tag].push_back(std::move(meta));
+                });
+                m_replicator = std::thread([this] {
+                    replicate();
+                });
+            }
+        }
+        virtual void run(int port) override {
+            m_event_loop = hope::io::create_event_loop();
+            LOG(INFO) << "Created event loop";
+            LOG(INFO) << "Run loop on port" << HOPE_VAL(port);
+            hope::io::event_loop::config ev_cfg;
+            ev_cfg.port = port;
+            m_ticking = true;
+            m_ticker = std::thread([this, port] {
+                tick(port);
+            });
+            try {
+                m_event_loop->run(ev_cfg,
+                    hope::io::event_loop::callbacks {
+                    [this] (auto&& c) { on_create(c); timed(); },
+                    [this] (auto&& c) { on_read(c); timed(); },
+                    [this] (auto&& c) { on_write(c); timed(); },
+                    [this] (auto&& c, auto&& err) { on_error(c, err); timed(); }
+                });
+            } catch (const std::exception& ex) {
+                LOG(LERR) << HOPE_VAL(ex.what());
+            }
+            {
+                std::lock_guard lock(m_wake_mutex);
+                m_ticking = false;
+            }
+            m_wake_cv.notify_one();
+            m_ticker.join();
+        }
+        virtual ~service_impl() override {
+            // the fetch in progress is completed, nothing waits for it anymore
+            m_fetcher.reset();
+            m_running.store(false);
+            m_io.join();
+            if (m_replicator.joinable()) {
+                m_replicator.join();
+            }
+            // clear queue for sure
+            std::function<void()> f;
+            while (m_io_cmd.try_dequeue(f)) {
+                f();
+            }
+            while (m_io_done.try_dequeue(f)) { }
+            while (m_fetch_done.try_dequeue(f)) { }
+            while (m_replica_done.try_dequeue(f)) { }
+            delete m_event_loop;
+        }
+
+        virtual replication_stats replication() const override {
+            replication_stats stats;
+            stats.primary_sequence = m_primary_sequence.load(std::memory_order_relaxed);
+            stats.applied_sequence = m_applied_sequence.load(std::memory_order_relaxed);
+            if (const auto since = m_behind_since.load(std::memory_order_relaxed); since != 0) {
+                stats.lag = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    clock::now().time_since_epoch() - clock::duration(since));
+            }
+            return stats;
+        }
+
+        virtual cache_stats stats() const override {
+            auto stats = m_cache.stats();
+            stats.disk_bytes = m_blocks.read_bytes() + m_load_bytes.load(std::memory_order_relaxed);
+            return stats;
+        }
+
+    private:
+        void on_create(hope::io::event_loop::connection& c) {
+            apply_io_results();
+            track(c);
+            reap_expired();
+            if (m_wake_descriptor < 0) {
+                // the hub may listen on a single address, the ticker reaches it where clients do
+                if (auto address = local_address(c.descriptor); !address.empty()) {
+                    std::lock_guard lock(m_wake_mutex);
+                    m_wake_host = std::move(address);
+                }
+            }
+            // TODO:: add ip address to connection, or add method to resolve desriptor
+            LOG(INFO) << "Created connection" << HOPE_VAL(c.descriptor);
+            c.set_state(hope::io::event_loop::connection_state::read);
+        }
+
+        void on_read(hope::io::event_loop::connection& c) {
+            apply_io_results();
+            touch(c, c.buffer->count(), true);
+            reap_expired();
+            if (c.descriptor == m_wake_descriptor) {
+                // the loop is awake, uploads in parts have no connection of their own to expire with
+                expire_uploads();
+                release_throttled();
+                return;
+            }
+            event_loop_stream_wrapper stream(*c.buffer);
+            if (stream.is_ready_to_read()) {
+                if (auto* state = m_clients.find(c.descriptor)) {
+                    auto* msg_ptr = state->msg;
+                    LOG(INFO) << "Got new chunk for message"
+                        << HOPE_VAL(message::str_type(msg_ptr->get_type()));
+                    handle_request(stream, c, state, msg_ptr);
+                } else if (is_wake(c)) {
+                    LOG(INFO) << "Wake connection" << HOPE_VAL(c.descriptor);
+                    m_wake_descriptor = c.descriptor;
+                    // it is quiet between ticks, which is no reason to close it
+                    untrack(c);
+                } else {
+                    auto* new_message = m_messages.peek_request(stream);
+                    if (new_message == nullptr) {
+                        LOG(LERR) << "Unsupported protocol version or request type, kill connection" << HOPE_VAL(c.descriptor);
+                        close(c);
+                        return;
+                    }
+                    if (new_message->get_type() == message::etype::upload_patch
+                        || new_message->get_type() == message::etype::upload_part) {
+                        // admission refuses larger uploads, the message itself does not trust the headers either
+                        static_cast<patch_message*>(new_message)->memory_limit =
+                            m_max_request_bytes != 0 ? m_max_request_bytes : UINT64_MAX;
+                    }
+                    state = m_clients.emplace(c.descriptor, new_message);
+                    handle_request(stream, c, state, new_message);
+                }
+            }
+        }
+
+        void on_write(hope::io::event_loop::connection& c) {
+            apply_io_results();
+            reap_expired();
+            if (auto* state = m_clients.find(c.descriptor)) {
+                auto* msg_ptr = state->msg;
+                bool complete = msg_ptr == nullptr;
+                if (!complete) {
+                    if (!may_write(*state)) {
+                        // the bucket refills with time, the connection waits idle until a tick finds it full enough
+                        throttle(c, state);
+                        return;
+                    }
+                    grow_chunk(*state, *msg_ptr);
+                    if (state->feed != nullptr && state->feed->broken()) {
+                        // the rest will not come, the client sees the transfer cut
+                        LOG(LERR) << "Fetch from upstream failed, kill connection" << HOPE_VAL(c.descriptor);
+                        complete = true;
+                    } else if (starved(*state, c)) {
+                        starve(c, state);
+                        return;
+                    } else if (cold(*state, c)) {
+                        return;
+                    } else {
+                        event_loop_stream_wrapper stream(*c.buffer);
+                        try {
+                            complete = msg_ptr->write(stream);
+                        } catch (const std::exception& ex) {
+                            // e.g. cached patch file is gone, the response cannot be finished anyway
+                            LOG(LERR) << "Cannot write message, kill connection" << HOPE_VAL(c.descriptor) << HOPE_VAL(ex.what());
+                            complete = true;
+                        }
+                        // previous chunk is gone, the next one is queued
+                        touch(c, c.buffer->count(), false);
+                        consume(*state, c.buffer->count());
+                        state->written += c.buffer->count();
+                    }
+                }
+                if (complete) {
+                    LOG(INFO) << "Send last chunk for msg, close connection" << HOPE_VAL(c.descriptor);
+                    m_messages.release(msg_ptr, false);
+                    close(c);
+                    finish(state);
+                }
+            } else {
+                LOG(INFO) << "Cannot find active state for client, kill connection" << HOPE_VAL(c.descriptor);
+                close(c);
+            }
+        }
+
+        void on_error(hope::io::event_loop::connection& c, const std::string& err) {
+            LOG(INFO) << "Fatal error" << HOPE_VAL(err);
+            untrack(c);
+            if (c.descriptor == m_wake_descriptor) {
+                m_wake_descriptor = -1;
+            }
+            if (auto* state = m_clients.find(c.descriptor)) {
+                m_messages.release(state->msg, !state->responding);
+                finish(state);
+            }
+        }
+
+        void handle_request(event_loop_stream_wrapper& stream, hope::io::event_loop::connection& c, state_t state, message* msg) {
+            bool complete = false;
+            try {
+                complete = msg->read(stream);
+            } catch (const std::exception& ex) {
+                // damaged or malformed data, nothing from this client could be trusted anymore
+                LOG(LERR) << "Cannot read message, kill connection" << HOPE_VAL(c.descriptor) << HOPE_VAL(ex.what());
+                m_messages.release(msg, true);
+                close(c);
+                finish(state);
+                return;
+            }
+            if (!state->admitted) {
+                const auto decision = admit(*state);
+                if (decision == admission::refuse) {
+                    LOG(LERR) << "Request is refused, kill connection" << HOPE_VAL(c.descriptor)
+                        << HOPE_VAL(message::str_type(msg->get_type()));
+                    m_messages.release(msg, true);
+                    close(c);
+                    finish(state);
+                    return;
+                }
+                if (decision == admission::wait) {
+                    LOG(INFO) << "Transfer waits for admission" << HOPE_VAL(c.descriptor);
+                    state->waiting = true;
+                    state->ready = complete;
+                    state->connection = &c;
+                    m_waiting.push_back(c.descriptor);
+                    // the hub keeps it waiting, not the client
+                    m_timers.disarm(uint32_t(c.descriptor));
+                    // socket is not read meanwhile
+                    c.set_state(hope::io::event_loop::connection_state::idle);
+                    return;
+                }
+            }
+	        if (complete) {
+                LOG(INFO) << "Message fully read";
+                execute(stream, c, state);
+            } // otherwise needs more reads
+        }
+
+        void execute(event_loop_stream_wrapper& stream, hope::io::event_loop::connection& c, state_t state) {
+            // handler is picked by the request type at compile time
+            visit_request(*state->msg, [&](auto& request) {
+                execute(stream, c, state, request);
+            });
+        }
+
+        enum class admission : uint8_t {
+            serve,
+            wait,
+            refuse,
+            // upload headers are not read yet
+            undecided,
+        };
+
+        // transfers take a slot and uploads their payload as well, the rest is served right away
+        admission admit(client_state& state) {
+            const auto type = state.msg->get_type();
+            if (!m_primary_host.empty() && (type == message::etype::upload_patch
+                || type == message::etype::offer || type == message::etype::delete_patch
+                || type == message::etype::local_upload || type == message::etype::upload_begin
+                || type == message::etype::upload_part || type == message::etype::upload_commit)) {
+                // replica holds what the primary holds, nothing else
+                return admission::refuse;
+            }
+            const auto upload = type == message::etype::upload_patch || type == message::etype::upload_part;
+            if (!upload && type != message::etype::get_patches
+                && type != message::etype::get_batch && type != message::etype::sync) {
+                state.admitted = true;
+                return admission::serve;
+            }
+            uint64_t bytes = 0;
+            if (upload) {
+                const auto& request = static_cast<const patch_message&>(*state.msg);
+                if (!request.headers_read()) {
+                    return admission::undecided;
+                }
+                bytes = request.memory_payload();
+                if (m_max_request_bytes != 0 && bytes > m_max_request_bytes) {
+                    return admission::refuse;
+                }
+            }
+            const auto busy = m_max_transfers != 0 && m_transfers >= m_max_transfers;
+            // the first upload gets in whatever its size is, the request limit takes care of it
+            const auto full = m_max_upload_bytes != 0 && m_upload_bytes != 0 && m_upload_bytes + bytes > m_max_upload_bytes;
+            if (busy || full) {
+                return admission::wait;
+            }
+            state.admitted = true;
+            state.bulk = true;
+            state.reserved = bytes;
+            ++m_transfers;
+            m_upload_bytes += bytes;
+            return admission::serve;
+        }
+
+        // waiting transfers are let in in arrival order while they fit
+        void wake() {
+            if (m_waking) {
+                // outer call goes on with whatever is freed
+                return;
+            }
+            m_waking = true;
+            while (!m_waiting.empty()) {
+                auto* state = m_clients.find(m_waiting.front());
+                if (state == nullptr || !state->waiting) {
+                    m_waiting.pop_front();
+                    continue;
+                }
+                if (admit(*state) != admission::serve) {
+                    break;
+                }
+                m_waiting.pop_front();
+                auto& c = *state->connection;
+                state->waiting = false;
+                state->connection = nullptr;
+                LOG(INFO) << "Transfer admitted" << HOPE_VAL(c.descriptor);
+                resume(c);
+                if (state->ready) {
+                    event_loop_stream_wrapper stream(*c.buffer);
+                    execute(stream, c, state);
+                } else {
+                    c.set_state(hope::io::event_loop::connection_state::read);
+                }
+            }
+            m_waking = false;
+        }
+
+        void close(hope::io::event_loop::connection& c) {
+            untrack(c);
+            c.set_state(hope::io::event_loop::connection_state::die);
+        }
+
+        bool limits_time() const {
+            return m_header_timeout.count() != 0 || m_idle_timeout.count() != 0 || m_min_transfer_rate != 0;
+        }
+
+        connection_timer* tracked(const hope::io::event_loop::connection& c) {
+            const auto id = std::size_t(c.descriptor);
+            if (id < m_peers.size() && m_peers[id].connection == &c) {
+                return &m_peers[id];
+            }
+            return nullptr;
+        }
+
+        void track(hope::io::event_loop::connection& c) {
+            if (c.descriptor < 0) {
+                return;
+            }
+            const auto id = std::size_t(c.descriptor);
+            if (id >= m_peers.size()) {
+                m_peers.resize(id + 1);
+            }
+            const auto now = clock::now();
+            m_peers[id] = connection_timer{ &c, now, now, now, 0, false };
+            schedule(uint32_t(id));
+        }
+
+        void untrack(hope::io::event_loop::connection& c) {
+            if (auto* peer = tracked(c)) {
+                peer->connection = nullptr;
+                m_timers.disarm(uint32_t(c.descriptor));
+            }
+        }
+
+        // bytes moved, the timer is not touched, it finds the new deadline when it fires
+        void touch(hope::io::event_loop::connection& c, uint64_t bytes, bool received) {
+            if (!limits_time()) {
+                return;
+            }
+            if (auto* peer = tracked(c)) {
+                peer->active = clock::now();
+                if (received && !peer->header) {
+                    peer->header = true;
+                    peer->window = peer->active;
+                }
+                peer->window_bytes += bytes;
+            }
+        }
+
+        // admitted transfer starts its deadlines over
+        void resume(hope::io::event_loop::connection& c) {
+            if (auto* peer = tracked(c)) {
+                peer->active = peer->window = clock::now();
+                peer->window_bytes = 0;
+                schedule(uint32_t(c.descriptor));
+            }
+        }
+
+        void schedule(uint32_t id) {
+            const auto& peer = m_peers[id];
+            if (peer.poll_until != clock::time_point::max()) {
+                // the hub keeps it waiting, nothing else is checked meanwhile
+                m_timers.arm(id, ticks(peer.poll_until));
+                return;
+            }
+            auto next = clock::time_point::max();
+            if (!peer.header && m_header_timeout.count() != 0) {
+                next = std::min(next, peer.created + m_header_timeout);
+            }
+            if (m_idle_timeout.count() != 0) {
+                next = std::min(next, peer.active + m_idle_timeout);
+            }
+            if (peer.header && m_min_transfer_rate != 0) {
+                next = std::min(next, peer.window + m_rate_window);
+            }
+            if (next != clock::time_point::max()) {
+                m_timers.arm(id, ticks(next));
+            }
+        }
+        // rounded up, a timer never fires before its deadline
+        uint64_t ticks(clock::time_point deadline) const {
+            return uint64_t((deadline - m_epoch + timer_tick - clock::duration(1)) / timer_tick);
+        }
+
+        // the loop has no timer of its own and calls back only on socket activity, so this thread keeps a connection
+        // to the hub and sends a tiny chunk over it every timer tick while the loop has deadlines or throttled
+        // downloads, and as soon as background work is done. A quiet hub with nothing timed gets no chunks
+        void tick(int port) {
+            uint8_t chunk[sizeof(uint32_t) + sizeof(m_wake_token)];
+            *(uint32_t*)chunk = uint32_t(sizeof(chunk));
+            std::memcpy(chunk + sizeof(uint32_t), &m_wake_token, sizeof(m_wake_token));
+            std::unique_ptr<hope::io::stream> stream;
+            std::string host;
+            while (true) {
+                {
+                    std::unique_lock lock(m_wake_mutex);
+                    const auto wanted = m_wake_cv.wait_for(lock, timer_tick, [this] { return m_wake_wanted || !m_ticking; });
+                    if (!m_ticking) {
+                        return;
+                    }
+                    if (!wanted && !m_timed.load(std::memory_order_relaxed)) {
+                        continue;
+                    }
+                    m_wake_wanted = false;
+                    host = m_wake_host;
+                }
+                try {
+                    // one connection for the life of the hub, opened again only if it breaks
+                    if (stream == nullptr) {
+                        stream.reset(hope::io::create_stream());
+                        stream->connect(host, port);
+                    }
+                    stream->write(chunk, sizeof(chunk));
+                } catch (const std::exception& ex) {
+                    LOG(LERR) << "Cannot wake the loop" << HOPE_VAL(ex.what());
+                    stream.reset();
+                }
+            }
+        }
+        // after every callback, the ticker keeps ticking only while there is something to wait for
+        void timed() {
+            m_timed.store(m_timers.size() != 0 || !m_throttled.empty() || !m_uploads.empty(), std::memory_order_relaxed);
+        }
+        // could be called from any thread
+        void wake_loop() {
+            {
+                std::lock_guard lock(m_wake_mutex);
+                m_wake_wanted = true;
+            }
+            m_wake_cv.notify_one();
+        }
+        // background work hands its result to the loop and wakes it up
+        void post(hope::threading::spsc_queue<std::function<void()>>& queue, std::function<void()> f) {
+            queue.enqueue(std::move(f));
+            wake_loop();
+        }
+        // the first chunk of the wake connection carries the token of this hub
+        bool is_wake(const hope::io::event_loop::connection& c) const {
+            const auto [data, size] = c.buffer->used_chunk();
+            return size == sizeof(uint32_t) + sizeof(m_wake_token)
+                && std::memcmp((const uint8_t*)data + sizeof(uint32_t), &m_wake_token, sizeof(m_wake_token)) == 0;
+        }
+
+        // timers are driven by loop callbacks, the wake connection makes sure there is one every tick;
+        // a connection is reaped on the first one past its deadline
+        void reap_expired() {
+            if (m_timers.size() == 0) {
+                return;
+            }
+            const auto now = clock::now();
+            m_timers.advance(uint64_t((now - m_epoch) / timer_tick), m_fired);
+            for (const auto id : m_fired) {
+                auto& peer = m_peers[id];
+                if (peer.connection == nullptr) {
+                    // closed by a connection reaped before
+                    continue;
+                }
+                if (peer.poll_until != clock::time_point::max()) {
+                    if (now < peer.poll_until) {
+                        schedule(id);
+                    } else if (auto* state = m_clients.find(int32_t(id)); state != nullptr && state->subscribed) {
+                        answer(state);
+                    }
+                    continue;
+                }
+                const char* reason = nullptr;
+                if (!peer.header && m_header_timeout.count() != 0 && now >= peer.created + m_header_timeout) {
+                    reason = "no request";
+                } else if (m_idle_timeout.count() != 0 && now >= peer.active + m_idle_timeout) {
+                    reason = "idle";
+                } else if (peer.header && m_min_transfer_rate != 0 && now >= peer.window + m_rate_window) {
+                    const auto expected = m_min_transfer_rate * std::chrono::duration_cast<std::chrono::milliseconds>(now - peer.window).count() / 1000;
+                    if (peer.window_bytes < expected) {
+                        reason = "too slow";
+                    } else {
+                        peer.window = now;
+                        peer.window_bytes = 0;
+                    }
+                }
+                if (reason != nullptr) {
+                    reap(*peer.connection, reason);
+                } else {
+                    schedule(id);
+                }
+            }
+            m_fired.clear();
+        }
+
+        void reap(hope::io::event_loop::connection& c, const char* reason) {
+            LOG(INFO) << "Reap connection" << HOPE_VAL(c.descriptor) << HOPE_VAL(reason);
+            auto reading = true;
+            if (auto* state = m_clients.find(c.descriptor)) {
+                reading = !state->responding;
+                m_messages.release(state->msg, !state->responding);
+                finish(state);
+            }
+            if (reading) {
+                // partial request is dropped, queued response chunk is still flushed before close
+                c.buffer->reset();
+            }
+            close(c);
+        }
+
+        // connection is done, its slot and memory go to waiting transfers
+        void finish(client_state* state) {
+            if (state->bulk) {
+                --m_transfers;
+                m_upload_bytes -= state->reserved;
+            }
+            if (state->interactive) {
+                --m_interactive;
+            }
+            if (state->tag != nullptr && --state->tag->second.users == 0) {
+                m_tag_limits.erase(state->tag->first);
+            }
+            if (state->subscribed) {
+                --m_subscribed;
+            }
+            client_slab::erase(state);
+            wake();
+        }
+
+        void execute(event_loop_stream_wrapper& stream, hope::io::event_loop::connection& c,
+            state_t in_state, list_patches_request& request) {
+            LOG(INFO) << "Got list message" << HOPE_VAL(c.descriptor) << HOPE_VAL(request.tags.value.size());
+            auto* response = m_messages.acquire<list_patches_response>();
+            if (request.tags.value.empty()) {
+                response->patches.reserve(m_index.size());
+                m_index.for_each([response](const std::shared_ptr<patch>& p) {
+                    response->patches.emplace_back(p);
+                });
+            }
+            for (const auto& tag : request.tags.value) {
+                m_index.get(tag, response->patches);
+            }
+            compatible(request.get_version(), response->patches);
+            respond(stream, c, in_state, &request, response);
+        }
+
+        void execute(event_loop_stream_wrapper& stream, hope::io::event_loop::connection& c,
+            state_t in_state, subscribe_request& request) {
+            LOG(INFO) << "Got subscribe request" << HOPE_VAL(c.descriptor) << HOPE_VAL(request.prefix)
+                << HOPE_VAL(request.after);
+            const auto wait = std::min<std::chrono::milliseconds>(std::chrono::milliseconds(request.timeout), m_max_subscribe_wait);
+            auto* response = m_messages.acquire<subscribe_response>();
+            if (changes(request, *response) || wait.count() == 0) {
+                respond(stream, c, in_state, &request, response);
+                return;
+            }
+            m_messages.release(response, false);
+            LOG(INFO) << "Subscription waits for changes" << HOPE_VAL(c.descriptor);
+            in_state->subscribed = true;
+            in_state->connection = &c;
+            ++m_subscribed;
+            if (m_subscribers.size() > 2 * m_subscribed + 16) {
+                // answered ones are dropped lazily
+                m_subscribers.erase(std::remove_if(begin(m_subscribers), end(m_subscribers), [this](int32_t descriptor) {
+                    const auto* state = m_clients.find(descriptor);
+                    return state == nullptr || !state->subscribed;
+                }), end(m_subscribers));
+            }
+            m_subscribers.push_back(c.descriptor);
+            if (auto* peer = tracked(c)) {
+                peer->poll_until = clock::now() + wait;
+                schedule(uint32_t(c.descriptor));
+            }
+            // socket is not read meanwhile
+            c.set_state(hope::io::event_loop::connection_state::idle);
+        }
+
+        // tags of the prefix changed after the sequence of the request, true if there is something to tell
+        bool changes(const subscribe_request& request, subscribe_response& response) const {
+            response.sequence = m_sequence;
+            const auto oldest = m_changes.empty() ? m_sequence + 1 : m_changes.front().first;
+            if (request.after > m_sequence || request.after + 1 < oldest) {
+                response.missed = 1;
+                return true;
+            }
+            // the log is ordered by sequence
+            auto it = std::upper_bound(begin(m_changes), end(m_changes), request.after,
+                [](uint64_t after, const auto& change) { return after < change.first; });
+            for (; it != end(m_changes); ++it) {
+                const auto& tag = it->second;
+                if (tag.compare(0, request.prefix.size(), request.prefix) == 0
+                    && std::find(begin(response.tags), end(response.tags), tag) == end(response.tags)) {
+                    response.tags.push_back(tag);
+                }
+            }
+            return !response.tags.empty();
+        }
+
+        void record(const std::string& tag) {
+            m_changes.emplace_back(++m_sequence, tag);
+            if (m_changes.size() > m_change_log) {
+                m_changes.pop_front();
+            }
+        }
+        // every tag of the patches once
+        void record(const std::vector<std::shared_ptr<patch>>& patches) {
+            const auto first = m_sequence;
+            for (const auto& p : patches) {
+                const auto recorded = std::min<std::size_t>(m_sequence - first, m_changes.size());
+                const auto seen = std::any_of(end(m_changes) - std::ptrdiff_t(recorded), end(m_changes),
+                    [&p](const auto& change) { return change.second == p->tag; });
+                if (!seen) {
+                    record(p->tag);
+                }
+            }
+            notify();
+        }
+
+        // waiting subscriptions which see recorded changes are answered
+        void notify() {
+            if (m_subscribed == 0) {
+                return;
+            }
+            for (std::size_t i = 0; i < m_subscribers.size(); ++i) {
+                auto* state = m_clients.find(m_subscribers[i]);
+                if (state == nullptr || !state->subscribed) {
+                    continue;
+                }
+                // waiting ones are at the end of the log, only the newest changes are looked at
+                if (subscribe_response probe; changes(static_cast<const subscribe_request&>(*state->msg), probe)) {
+                    answer(state);
+                }
+            }
+        }
+
+        void answer(client_state* state) {
+            auto& c = *state->connection;
+            state->subscribed = false;
+            state->connection = nullptr;
+            --m_subscribed;
+            if (auto* peer = tracked(c)) {
+                peer->poll_until = clock::time_point::max();
+            }
+            resume(c);
+            LOG(INFO) << "Answer subscription" << HOPE_VAL(c.descriptor);
+            auto* response = m_messages.acquire<subscribe_response>();
+            changes(static_cast<const subscribe_request&>(*state->msg), *response);
+            event_loop_stream_wrapper stream(*c.buffer);
+            respond(stream, c, state, state->msg, response);
+        }
+
+        void execute(event_loop_stream_wrapper& stream, hope::io::event_loop::connection& c,
+            state_t in_state, upload_patch_request& request) {
+            LOG(INFO) << "Got upload message" << HOPE_VAL(c.descriptor);
+            for (const auto& p : request.patches) {
+                LOG(INFO) << HOPE_VAL(p->name) << HOPE_VAL(p->file_size) << HOPE_VAL(p->tag);
+                put(p);
+            }
+            record(request.patches);
+            auto* response = m_messages.acquire<upload_patch_response>();
+            // send names and meta back, so the client be sure everethyng is ok
+            response->patches = request.patches;
+            writing(response->patches);
+            m_io_cmd.enqueue([this, patches = response->patches] {
+                cput(patches);
+                // on disk now, memory could be given back
+                post(m_io_done, [this, patches] {
+                    for (const auto& p : patches) {
+                        m_cache.unpin(p.get());
+                        m_writing.erase(p.get());
+                    }
+                    evict();
+                });
+            });
+            respond(stream, c, in_state, &request, response);
+        }
+
+        void execute(event_loop_stream_wrapper& stream, hope::io::event_loop::connection& c,
+            state_t in_state, upload_begin_request& request) {
+            LOG(INFO) << "Got upload begin" << HOPE_VAL(c.descriptor) << HOPE_VAL(request.tag)
+                << HOPE_VAL(request.name) << HOPE_VAL(request.file_size);
+            auto* response = m_messages.acquire<upload_begin_response>();
+            expire_uploads();
+            if ((m_max_multipart_size != 0 && request.file_size > m_max_multipart_size)
+                || (m_max_multipart_uploads != 0 && m_uploads.size() >= m_max_multipart_uploads)) {
+                // no upload id, the client sends the patch the usual way, which is admitted as any upload
+                LOG(INFO) << "Upload in parts is refused" << HOPE_VAL(request.file_size) << HOPE_VAL(m_uploads.size());
+                respond(stream, c, in_state, &request, response);
+                return;
+            }
+            auto upload = std::make_shared<multipart_upload>();
+            upload->meta = std::make_shared<patch>();
+            upload->meta->tag = request.tag;
+            upload->meta->name = request.name;
+            upload->meta->file_size = request.file_size;
+            upload->meta->hash = request.hash;
+            upload->active = clock::now();
+            const auto id = ++m_upload_id;
+            // unique per upload, so uploads of the same patch do not write to each other
+            upload->path = partial_path();
+            m_uploads.emplace(id, upload);
+            m_io_cmd.enqueue([upload] {
+                std::error_code ec;
+                std::filesystem::create_directories(std::filesystem::path(upload->path).parent_path(), ec);
+                upload->sink = create_file_sink(upload->path, upload->meta->file_size);
+                if (upload->sink == nullptr) {
+                    LOG(LERR) << "Cannot create upload file" << HOPE_VAL(upload->path);
+                    upload->broken = true;
+                }
+            });
+            response->upload = id;
+            respond(stream, c, in_state, &request, response);
+        }
+
+        void execute(event_loop_stream_wrapper& stream, hope::io::event_loop::connection& c,
+            state_t in_state, upload_part_request& request) {
+            LOG(INFO) << "Got upload part" << HOPE_VAL(c.descriptor) << HOPE_VAL(request.upload) << HOPE_VAL(request.offset);
+            auto* response = m_messages.acquire<upload_part_response>();
+            const auto it = m_uploads.find(request.upload);
+            if (it != end(m_uploads) && request.patches.size() == 1 && it->second->take(request.offset, *request.patches.front())) {
+                const auto& upload = it->second;
+                upload->active = clock::now();
+                response->received = upload->received;
+                // written in order with the commit, which goes to the same queue after every part
+                m_io_cmd.enqueue([upload, part = request.patches.front(), offset = request.offset] {
+                    if (upload->broken) {
+                        return;
+                    }
+                    try {
+                        upload->sink->write(offset, part->data, part->file_size);
+                    } catch (const std::exception& ex) {
+                        LOG(LERR) << "Cannot write upload part" << HOPE_VAL(upload->path) << HOPE_VAL(ex.what());
+                        upload->broken = true;
+                    }
+                });
+            } else {
+                LOG(LERR) << "Upload part is not taken" << HOPE_VAL(request.upload) << HOPE_VAL(request.offset);
+            }
+            respond(stream, c, in_state, &request, response);
+        }
+
+        void execute(event_loop_stream_wrapper& stream, hope::io::event_loop::connection& c,
+            state_t in_state, upload_commit_request& request) {
+            LOG(INFO) << "Got upload commit" << HOPE_VAL(c.descriptor) << HOPE_VAL(request.upload);
+            const auto it = m_uploads.find(request.upload);
+            if (!in_state->resumed && it != end(m_uploads) && !it->second->committing
+                && it->second->received == it->second->meta->file_size) {
+                const auto& upload = it->second;
+                upload->committing = true;
+                park(c, in_state);
+                m_io_cmd.enqueue([this, descriptor = c.descriptor, msg = &request, upload] {
+                    const auto assembled = assemble(*upload);
+                    post(m_io_done, [this, descriptor, msg, upload, assembled] {
+                        if (assembled) {
+                            const auto& p = upload->meta;
+                            p->source = m_blocks.share(create_file_source(cache_path(*p)));
+                            put(p);
+                            record(std::vector<std::shared_ptr<patch>>{ p });
+                        }
+                        upload->done = true;
+                        upload->committed = assembled;
+                        upload->active = clock::now();
+                        auto* state = m_clients.find(descriptor);
+                        if (state != nullptr && state->pending && state->msg == msg) {
+                            unpark(state);
+                        }
+                    });
+                });
+                return;
+            }
+            auto* response = m_messages.acquire<upload_commit_response>();
+            if (in_state->resumed && it != end(m_uploads)) {
+                if (it->second->committed) {
+                    response->patches.push_back(it->second->meta);
+                }
+                m_uploads.erase(it);
+            }
+            respond(stream, c, in_state, &request, response);
+        }
+
+        // io thread, every part is on disk, the file is verified and renamed into place with its meta
+        bool assemble(multipart_upload& upload) const {
+            upload.sink.reset();
+            auto& p = *upload.meta;
+            std::error_code ec;
+            if (!upload.broken) {
+                std::ifstream file(upload.path, std::ios::binary);
+                uint64_t hash = 0;
+                const auto read = file.is_open() && read_hashed(file, p.file_size, nullptr, hash);
+                file.close();
+                if (read && (p.hash == 0 || p.hash == hash)) {
+                    p.hash = hash;
+                    write_meta(p);
+                    std::filesystem::create_directories(std::filesystem::path(cache_path(p)).parent_path(), ec);
+                    std::filesystem::rename(upload.path, cache_path(p), ec);
+                    if (!ec) {
+                        return true;
+                    }
+                    LOG(LERR) << "Cannot rename patch" << HOPE_VAL(upload.path) << HOPE_VAL(ec.message());
+                } else {
+                    LOG(LERR) << "Assembled patch is not what the client told" << HOPE_VAL(p.tag) << HOPE_VAL(p.name)
+                        << HOPE_VAL(p.hash) << HOPE_VAL(hash);
+                }
+            }
+            std::filesystem::remove(upload.path, ec);
+            return false;
+        }
+
+        // uploads nobody sends to anymore are dropped with what they received
+        void expire_uploads() {
+            const auto now = clock::now();
+            for (auto it = begin(m_uploads); it != end(m_uploads);) {
+                const auto upload = it->second;
+                if (now - upload->active < m_upload_expiry || (upload->committing && !upload->done)) {
+                    ++it;
+                    continue;
+                }
+                LOG(INFO) << "Upload expired" << HOPE_VAL(it->first) << HOPE_VAL(upload->meta->tag) << HOPE_VAL(upload->meta->name);
+                if (!upload->done) {
+                    m_io_cmd.enqueue([upload] {
+                        upload->sink.reset();
+                        std::error_code ec;
+                        std::filesystem::remove(upload->path, ec);
+                    });
+                }
+                it = m_uploads.erase(it);
+            }
+        }
+
+        void execute(event_loop_stream_wrapper& stream, hope::io::event_loop::connection& c,
+            state_t in_state, local_upload_request& request) {
+            LOG(INFO) << "Got local upload" << HOPE_VAL(c.descriptor) << HOPE_VAL(request.patches.size());
+            // paths name files of this host, a peer elsewhere must not make the hub publish them
+            if (!in_state->resumed && !m_local_dir.empty() && request.paths.size() == request.patches.size()
+                && loopback_peer(c.descriptor)) {
+                park(c, in_state);
+                m_io_cmd.enqueue([this, descriptor = c.descriptor, msg = &request, patches = request.patches, paths = request.paths] {
+                    auto stored = import(patches, paths);
+                    post(m_io_done, [this, descriptor, msg, stored = std::move(stored)] {
+                        for (const auto& p : stored) {
+                            p->source = m_blocks.share(create_file_source(cache_path(*p)));
+                            put(p);
+                        }
+                        record(stored);
+                        auto* state = m_clients.find(descriptor);
+                        if (state != nullptr && state->pending && state->msg == msg) {
+                            msg->patches = stored;
+                            unpark(state);
+                        }
+                    });
+                });
+                return;
+            }
+            auto* response = m_messages.acquire<local_upload_response>();
+            // nothing is taken if the fast path is off, the client sends the patches through the socket then
+            if (in_state->resumed) {
+                response->patches = std::move(request.patches);
+            }
+            respond(stream, c, in_state, &request, response);
+        }
+
+        // io thread, files of the client are copied rather than linked, it may change them afterwards
+        std::vector<std::shared_ptr<patch>> import(const std::vector<std::shared_ptr<patch>>& patches,
+            const std::vector<std::string>& paths) const {
+            std::vector<std::shared_ptr<patch>> stored;
+            std::error_code ec;
+            for (std::size_t i = 0; i < patches.size(); ++i) {
+                const auto& p = patches[i];
+                // nothing outside of the dir is read on behalf of a client, the file is read through
+                // the very handle which was checked
+                const auto source = create_file_source_within(paths[i], m_local_dir);
+                if (source == nullptr) {
+                    LOG(LERR) << "File is not in the local dir" << HOPE_VAL(paths[i]);
+                    continue;
+                }
+                const auto path = cache_path(*p);
+                const auto partial = partial_path();
+                std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+                ec.clear();
+                // copied and hashed in one pass
+                const auto size = source->size();
+                uint64_t hash = 0;
+                bool copied = false;
+                {
+                    std::ofstream file(partial, std::ios::binary);
+                    std::vector<uint8_t> block(std::min<uint64_t>(size, 1024 * 1024));
+                    hasher h;
+                    try {
+                        for (uint64_t offset = 0; offset < size && file;) {
+                            const auto count = source->read(offset, block.data(),
+                                (std::size_t)std::min<uint64_t>(block.size(), size - offset));
+                            h.update(block.data(), count);
+                            file.write((const char*)block.data(), (std::streamsize)count);
+                            offset += count;
+                        }
+                        copied = file.is_open() && file.good();
+                    } catch (const std::exception& ex) {
+                        LOG(LERR) << "Cannot read local file" << HOPE_VAL(paths[i]) << HOPE_VAL(ex.what());
+                    }
+                    hash = h.digest();
+                }
+                if (!copied || (p->hash != 0 && p->hash != hash)) {
+                    LOG(LERR) << "Local file is not copied or not what the client told" << HOPE_VAL(paths[i])
+                        << HOPE_VAL(p->hash) << HOPE_VAL(hash);
+                    std::filesystem::remove(partial, ec);
+                    ec.clear();
+                    continue;
+                }
+                p->file_size = size;
+                p->hash = hash;
+                write_meta(*p);
+                std::filesystem::rename(partial, path, ec);
+                if (ec) {
+                    LOG(LERR) << "Cannot rename patch" << HOPE_VAL(partial) << HOPE_VAL(ec.message());
+                    ec.clear();
+                    continue;
+                }
+                stored.push_back(p);
+            }
+            return stored;
+        }
+
+        void execute(event_loop_stream_wrapper& stream, hope::io::event_loop::connection& c,
+            state_t in_state, local_download_request& request) {
+            LOG(INFO) << "Got local download" << HOPE_VAL(c.descriptor) << HOPE_VAL(request.tag);
+            auto* response = m_messages.acquire<local_download_response>();
+            m_index.get(request.tag, response->patches);
+            compatible(request.get_version(), response->patches);
+            // without paths the client downloads the patches through the socket,
+            // a peer elsewhere gets none since they tell where the cache is
+            if (!m_local_dir.empty() && loopback_peer(c.descriptor)) {
+                for (const auto& p : response->patches) {
+                    // the file is complete only once its cput is done, pinned ones may have none
+                    const auto written = m_writing.count(p.get()) == 0 && !m_cache.pinned(p.get());
+                    response->paths.push_back(written ? std::filesystem::absolute(cache_path(*p)).string() : std::string());
+                }
+            }
+            respond(stream, c, in_state, &request, response);
+        }
+
+        void execute(event_loop_stream_wrapper& stream, hope::io::event_loop::connection& c,
+            state_t in_state, offer_request& request) {
+            LOG(INFO) << "Got upload offer" << HOPE_VAL(c.descriptor) << HOPE_VAL(request.patches.size());
+            auto* response = m_messages.acquire<offer_response>();
+            std::vector<std::shared_ptr<patch>> linked;
+            for (const auto& p : request.patches) {
+                // content already held by the hub, by hash and size
+                const auto origin = m_index.find_content(p->hash, p->file_size);
+                // peers without hashes in protocol upload everything
+                if (request.get_version() < protocol::hashed || origin == nullptr) {
+                    response->missing.emplace_back(p);
+                    continue;
+                }
+                if (is_stored(*p)) {
+                    // nothing to do, exactly this patch is already here
+                    continue;
+                }
+                auto link = std::make_shared<patch>();
+                link->name = p->name;
+                link->tag = p->tag;
+                link->file_size = origin->file_size;
+                link->hash = origin->hash;
+                link->source = std::make_shared<linked_source>(origin);
+                LOG(INFO) << "Linked patch" << HOPE_VAL(link->name) << HOPE_VAL(link->tag)
+                    << HOPE_VAL(origin->name) << HOPE_VAL(origin->tag);
+                put(link);
+                linked.emplace_back(std::move(link));
+            }
+            LOG(INFO) << "Patches to upload" << HOPE_VAL(response->missing.size()) << HOPE_VAL(linked.size());
+            if (!linked.empty()) {
+                record(linked);
+                writing(linked);
+                m_io_cmd.enqueue([this, patches = std::move(linked)] {
+                    cput(patches);
+                    post(m_io_done, [this, patches] {
+                        for (const auto& p : patches) {
+                            m_writing.erase(p.get());
+                        }
+                    });
+                });
+            }
+            respond(stream, c, in_state, &request, response);
+        }
+
+        void execute(event_loop_stream_wrapper& stream, hope::io::event_loop::connection& c,
+            state_t in_state, get_patches_request& request) {
+            LOG(INFO) << "Got patch request" << HOPE_VAL(c.descriptor) << HOPE_VAL(request.tag);
+            auto* response = m_messages.acquire<get_patches_response>();
+            m_index.get(request.tag, response->patches);
+            if (response->patches.empty()) {
+                if (const auto it = m_feeds.find(request.tag); it != end(m_feeds)) {
+                    // still being fetched, sent on as it arrives
+                    response->patches = it->second->patches;
+                    compatible(request.get_version(), response->patches);
+                    if (response->patches.size() != it->second->patches.size()) {
+                        // payload of what is left would not go in the order it arrives, the whole tag is waited for
+                        m_messages.release(response, false);
+                        park(c, in_state);
+                        m_fetching[request.tag].push_back(c.descriptor);
+                        return;
+                    }
+                    in_state->feed = it->second;
+                } else if (m_fetcher != nullptr && !in_state->resumed) {
+                    m_messages.release(response, false);
+                    fetch(c, in_state, request.tag);
+                    return;
+                }
+            }
+            compatible(request.get_version(), response->patches);
+            for (const auto& p : response->patches) {
+                LOG(INFO) << "Found patch:" << HOPE_VAL(p->name) << HOPE_VAL(p->file_size) << HOPE_VAL(p->tag);
+            }
+            if (in_state->feed == nullptr) {
+                warm(response->patches);
+            }
+            limit_tag(*in_state, request.tag);
+            respond(stream, c, in_state, &request, response);
+        }
+
+        // nothing to send until background work of the request is done, the connection waits idle
+        // and the work picks it up with unpark
+        void park(hope::io::event_loop::connection& c, state_t in_state) {
+            in_state->pending = true;
+            in_state->resumed = true;
+            in_state->connection = &c;
+            // the hub keeps it waiting, not the client
+            m_timers.disarm(uint32_t(c.descriptor));
+            c.set_state(hope::io::event_loop::connection_state::idle);
+        }
+        // background work of the parked request is done, the request is executed again
+        // and answered from what the work left
+        void unpark(state_t state) {
+            auto& c = *state->connection;
+            state->pending = false;
+            state->connection = nullptr;
+            resume(c);
+            event_loop_stream_wrapper stream(*c.buffer);
+            execute(stream, c, state);
+        }
+
+        // the tag is fetched once however many gets wait for it, they are answered once its headers are in
+        // and do not wait for the whole tag
+        void fetch(hope::io::event_loop::connection& c, state_t in_state, const std::string& tag) {
+            LOG(INFO) << "Tag is missing, fetch it from upstream" << HOPE_VAL(c.descriptor) << HOPE_VAL(tag);
+            park(c, in_state);
+            auto& waiting = m_fetching[tag];
+            waiting.push_back(c.descriptor);
+            if (waiting.size() > 1) {
+                return;
+            }
+            m_fetcher->enqueue([this, tag] {
+                auto patches = pull(tag);
+                post(m_fetch_done, [this, tag, patches = std::move(patches)] {
+                    fetched(tag, patches);
+                });
+            });
+        }
 
-        virtual void stop() override {
-            m_event_loop->stop();
+        // fetch thread, patches of the tag are stored to the cache dir the way cput does it,
+        // the loop is told about the payload as it is received
+        std::vector<std::shared_ptr<patch>> pull(const std::string& tag) {
+            const auto feed = std::make_shared<fetch_feed>();
+            auto published = false;
+            const auto received = [this, &tag, &feed, &published](std::size_t size) {
+                if (!published) {
+                    // headers go before any payload, every patch is known now
+                    published = true;
+                    post(m_fetch_done, [this, tag, feed] {
+                        stream_fetch(tag, feed);
+                    });
+                }
+                feed->received += size;
+                if (!feed->announced.exchange(true)) {
+                    post(m_fetch_done, [this, feed] {
+                        feed_starving(*feed);
+                    });
+                }
+            };
+            try {
+                std::unique_ptr<client> upstream(client::create(m_upstream_host, m_upstream_port));
+                std::vector<std::string> partial;
+                auto patches = receive(partial, [&](const client::sink_factory_t& sinks) {
+                    return upstream->download(tag, [&](const patch& p) -> std::shared_ptr<patch_sink> {
+                        auto sink = sinks(p);
+                        if (sink == nullptr) {
+                            return nullptr;
+                        }
+                        auto meta = std::make_shared<patch>();
+                        meta->name = p.name;
+                        meta->tag = p.tag;
+                        meta->file_size = p.file_size;
+                        meta->hash = p.hash;
+                        // the file is renamed into place once received, the source keeps reading it anyway
+                        meta->source = create_held_file_source(partial.back());
+                        if (meta->source == nullptr) {
+                            throw std::runtime_error("Cannot read fetched patch: " + p.name);
+                        }
+                        feed->total += p.file_size;
+                        feed->patches.push_back(std::move(meta));
+                        return std::make_shared<feed_sink>(std::move(sink), received);
+                    });
+                });
+                place(patches, partial);
+                LOG(INFO) << "Fetched tag from upstream" << HOPE_VAL(tag) << HOPE_VAL(patches.size());
+                return patches;
+            } catch (const std::exception& ex) {
+                LOG(LERR) << "Cannot fetch tag from upstream" << HOPE_VAL(tag) << HOPE_VAL(ex.what());
+            }
+            return {};
         }
-        service_impl()
-        {
-            m_exec[(uint8_t)message::etype::list_patches] = [&]
-                (event_loop_stream_wrapper& stream, hope::io::event_loop::connection& c,
-                    state_t in_state, message* msg) {
-                delete msg;
-                LOG(INFO) << "Got list message" << HOPE_VAL(c.descriptor);
-                list_patches_response response;
-                for (const auto& [_, array] : m_patch_registry) {
-                    for (const auto& p : array) {
-                        response.patches.emplace_back(p);
-                    }
-                }
-                // 8kb inside buffer should be enough to write all registered stuff (i hope)
-                response.write(stream);
-                in_state->second = nullptr;
+
+        // patches another hub sends are written to partial files, one per patch in the order of the patches,
+        // nothing is left behind if the transfer fails
+        template<typename TFetch>
+        std::vector<std::shared_ptr<patch>> receive(std::vector<std::string>& partial, TFetch&& fetch) const {
+            try {
+                auto patches = fetch([this, &partial](const patch& p) {
+                    partial.push_back(partial_path());
+                    return create_file_sink(partial.back(), p.file_size);
+                });
+                for (const auto& p : patches) {
+                    // file is closed with its sink
+                    p->sink.reset();
+                }
+                return patches;
+            } catch (...) {
+                for (const auto& path : partial) {
+                    std::error_code ec;
+                    std::filesystem::remove(path, ec);
+                }
+                partial.clear();
+                throw;
+            }
+        }
+
+        // received patches are renamed into place with their meta, those which cannot be are dropped
+        void place(std::vector<std::shared_ptr<patch>>& patches, const std::vector<std::string>& partial) const {
+            std::size_t placed = 0;
+            for (std::size_t i = 0; i < patches.size(); ++i) {
+                const auto path = cache_path(*patches[i]);
+                write_meta(*patches[i]);
+                std::error_code ec;
+                std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+                std::filesystem::rename(partial[i], path, ec);
+                if (ec) {
+                    LOG(LERR) << "Cannot rename patch" << HOPE_VAL(path) << HOPE_VAL(ec.message());
+                    std::filesystem::remove(partial[i], ec);
+                    continue;
+                }
+                patches[placed++] = std::move(patches[i]);
+            }
+            patches.resize(placed);
+        }
+
+        // headers of the tag being fetched are in, gets waiting for it are answered
+        void stream_fetch(const std::string& tag, const std::shared_ptr<fetch_feed>& feed) {
+            m_feeds[tag] = feed;
+            if (const auto it = m_fetching.find(tag); it != end(m_fetching)) {
+                unpark_fetching(tag, it->second);
+            }
+        }
+
+        // more payload of a tag being fetched is in, or the fetch is over
+        void feed_starving(fetch_feed& feed) {
+            feed.announced = false;
+            const auto starving = std::move(feed.starving);
+            feed.starving.clear();
+            for (const auto descriptor : starving) {
+                auto* state = m_clients.find(descriptor);
+                // descriptor may be reused by another connection meanwhile
+                if (state == nullptr || state->feed.get() != &feed || state->connection == nullptr) {
+                    continue;
+                }
+                auto& c = *state->connection;
+                state->connection = nullptr;
+                resume(c);
                 c.set_state(hope::io::event_loop::connection_state::write);
-            };
-            m_exec[uint8_t((uint8_t)message::etype::upload_patch)] = [&](event_loop_stream_wrapper& stream,
-                hope::io::event_loop::connection& c, state_t in_state, message* msg) {
-                const auto request = static_cast<upload_patch_request*>(msg);
-                LOG(INFO) << "Got upload message" << HOPE_VAL(c.descriptor);
-                for (const auto& p : request->patches) {
-                    LOG(INFO) << HOPE_VAL(p->name) << HOPE_VAL(p->file_size) << HOPE_VAL(p->tag);
-                    auto& entry = m_patch_registry[p->tag];
-                    bool replaced = false;
-                    for (auto& maybepatch : entry) {
-                        if (maybepatch->name == p->name) {
-                            maybepatch = p;
-                            replaced = true;
+            }
+        }
+
+        // payload of a tag being fetched goes out only once received, the next chunk may take up to its limit
+        bool starved(client_state& state, const hope::io::event_loop::connection& c) {
+            if (state.feed == nullptr || state.feed->done) {
+                return false;
+            }
+            return state.feed->received.load() < state.written + next_chunk(state, c);
+        }
+        uint64_t next_chunk(client_state& state, const hope::io::event_loop::connection& c) {
+            const auto capacity = uint64_t(c.buffer->free_space() + c.buffer->count());
+            const auto limit = write_limit(state);
+            return limit == 0 ? capacity : std::min<uint64_t>(limit, capacity);
+        }
+
+        // disk blocks the next chunk reads are brought by the io thread, the connection waits idle meanwhile
+        bool cold(client_state& state, hope::io::event_loop::connection& c) {
+            auto ready = true;
+            visit(*state.msg, [&](auto& msg) {
+                if constexpr (std::is_base_of_v<patch_message, std::decay_t<decltype(msg)>>) {
+                    msg.next_reads(next_chunk(state, c), [&](patch_source& source, uint64_t offset, std::size_t size) {
+                        const auto warm = source.ready(offset, size, ready
+                            ? std::function<void()>([this, descriptor = c.descriptor] { warmed(descriptor); }) : nullptr);
+                        ready = ready && warm;
+                    });
+                }
+            });
+            if (ready) {
+                return false;
+            }
+            state.cold = true;
+            state.connection = &c;
+            // the hub keeps it waiting, not the client
+            m_timers.disarm(uint32_t(c.descriptor));
+            c.buffer->reset();
+            c.set_state(hope::io::event_loop::connection_state::idle);
+            return true;
+        }
+        void warmed(int32_t descriptor) {
+            auto* state = m_clients.find(descriptor);
+            // closed meanwhile, the descriptor may be reused by another connection
+            if (state == nullptr || !state->cold) {
+                return;
+            }
+            auto& c = *state->connection;
+            state->cold = false;
+            state->connection = nullptr;
+            resume(c);
+            c.set_state(hope::io::event_loop::connection_state::write);
+        }
+        void starve(hope::io::event_loop::connection& c, state_t state) {
+            state->connection = &c;
+            state->feed->starving.push_back(c.descriptor);
+            // the hub keeps it waiting, not the client
+            m_timers.disarm(uint32_t(c.descriptor));
+            c.buffer->reset();
+            c.set_state(hope::io::event_loop::connection_state::idle);
+        }
+
+        void fetched(const std::string& tag, const std::vector<std::shared_ptr<patch>>& patches) {
+            std::vector<std::shared_ptr<patch>> local;
+            if (m_index.get(tag, local)) {
+                // uploaded here meanwhile, that one wins
+                LOG(INFO) << "Tag is already here, fetched patches are dropped" << HOPE_VAL(tag);
+            } else if (!patches.empty()) {
+                for (const auto& p : patches) {
+                    p->source = m_blocks.share(create_file_source(cache_path(*p)));
+                    put(p);
+                }
+                record(patches);
+            }
+            if (const auto it = m_feeds.find(tag); it != end(m_feeds)) {
+                const auto feed = it->second;
+                m_feeds.erase(it);
+                feed->done = true;
+                feed_starving(*feed);
+            }
+            const auto waiting = m_fetching.extract(tag);
+            unpark_fetching(tag, waiting.mapped());
+        }
+        void unpark_fetching(const std::string& tag, const std::vector<int32_t>& waiting) {
+            for (const auto descriptor : waiting) {
+                auto* state = m_clients.find(descriptor);
+                // descriptor may be reused by another get meanwhile
+                if (state != nullptr && state->pending && state->msg->get_type() == message::etype::get_patches
+                    && static_cast<const get_patches_request&>(*state->msg).tag == tag) {
+                    unpark(state);
+                }
+            }
+        }
+
+        // replica thread, the primary is asked for changes and every changed tag is brought to what it holds
+        void replicate() {
+            std::unique_ptr<client> primary(client::create(m_primary_host, m_primary_port));
+            uint64_t after = 0;
+            // everything is compared at first and after the change stream is lost
+            auto full = true;
+            while (m_running.load(std::memory_order_acquire)) {
+                try {
+                    std::unordered_set<std::string> tags;
+                    if (full) {
+                        // sequence goes first, whatever changes after it is told by the next subscribe
+                        after = primary->subscribe("", 0, std::chrono::milliseconds(0)).sequence;
+                        for (const auto& [tag, patches] : m_mirror) {
+                            tags.insert(tag);
+                        }
+                    } else {
+                        const auto changes = primary->subscribe("", after, replica_wait);
+                        if (changes.missed) {
+                            LOG(INFO) << "Replica missed changes of primary, compare everything";
+                            behind();
+                            full = true;
+                            continue;
+                        }
+                        if (changes.tags.empty()) {
+                            continue;
+                        }
+                        behind();
+                        tags.insert(begin(changes.tags), end(changes.tags));
+                        after = changes.sequence;
+                    }
+                    m_primary_sequence.store(after, std::memory_order_relaxed);
+                    std::unordered_map<std::string, std::vector<std::shared_ptr<patch>>> remote;
+                    // only the changed tags are listed, the whole registry is compared on resync
+                    const auto listed = full ? primary->list() : primary->list({ begin(tags), end(tags) });
+                    for (const auto& p : listed) {
+                        remote[p->tag].push_back(p);
+                    }
+                    for (const auto& [tag, patches] : remote) {
+                        tags.insert(tag);
+                    }
+                    for (const auto& tag : tags) {
+                        auto update = pull_changes(*primary, tag, remote[tag]);
+                        if (!update.received.empty() || !update.removed.empty()) {
+                            post(m_replica_done, [this, update = std::move(update)]() mutable {
+                                replicated(update);
+                            });
                         }
                     }
-                    if (!replaced) {
-                        entry.emplace_back(p);
+                    post(m_replica_done, [this, sequence = after] {
+                        m_applied_sequence.store(sequence, std::memory_order_relaxed);
+                        if (sequence >= m_primary_sequence.load(std::memory_order_relaxed)) {
+                            m_behind_since.store(0, std::memory_order_relaxed);
+                        }
+                    });
+                    full = false;
+                } catch (const std::exception& ex) {
+                    LOG(LERR) << "Replication failed, start over" << HOPE_VAL(ex.what());
+                    behind();
+                    full = true;
+                    primary.reset(client::create(m_primary_host, m_primary_port));
+                    for (auto i = 0; i < 5 && m_running.load(std::memory_order_acquire); ++i) {
+                        std::this_thread::sleep_for(replica_retry);
                     }
                 }
-                upload_patch_response response;
-                // send names and meta back, so the client be sure everethyng is ok
-                response.patches = request->patches;
-                delete msg;
-                // 8kb inside buffer should be enough to write all registered stuff (i hope)
-                response.write(stream);
-                in_state->second = nullptr;
-                c.set_state(hope::io::event_loop::connection_state::write);
-                m_io_cmd.enqueue([this, patches = response.patches] {
-                    cput(patches);
-                });
+            }
+        }
+
+        void behind() {
+            int64_t caught_up = 0;
+            m_behind_since.compare_exchange_strong(caught_up, clock::now().time_since_epoch().count(),
+                std::memory_order_relaxed);
+        }
+
+        // replica thread, differing patches of the tag are received, the loop puts them in place
+        replica_update pull_changes(client& primary, const std::string& tag,
+            const std::vector<std::shared_ptr<patch>>& remote) {
+            auto& local = m_mirror[tag];
+            replica_update update{ tag, {}, {}, {} };
+            const auto same = [](const patch& l, const patch& r) {
+                return l.name == r.name && l.file_size == r.file_size && l.hash == r.hash;
             };
-            m_exec[uint8_t(message::etype::get_patches)] = [&](event_loop_stream_wrapper& stream,
-                hope::io::event_loop::connection& c, state_t in_state, message* msg) {
-                const auto get_patches_request = static_cast<ph::get_patches_request*>(msg);
-                LOG(INFO) << "Got patch request" << HOPE_VAL(c.descriptor) << HOPE_VAL(get_patches_request->tag);
-                auto entry = m_patch_registry[get_patches_request->tag];
-                auto* response = new get_patches_response;
-                response->patches = entry;
-                for (const auto& p : response->patches) {
-                    LOG(INFO) << "Found patch:" << HOPE_VAL(p->name) << HOPE_VAL(p->file_size) << HOPE_VAL(p->tag);
+            for (const auto& p : local) {
+                if (std::none_of(begin(remote), end(remote), [&p](const auto& r) { return r->name == p->name; })) {
+                    update.removed.push_back(p->name);
                 }
-                delete msg;
-                // if complete remove msg right now
-                if (response->write(stream)) {
-                    delete response;
-                    in_state->second = nullptr;
-                } else {
-                    in_state->second = response;
-                }
-                c.set_state(hope::io::event_loop::connection_state::write);
-            };
-            m_exec[uint8_t(message::etype::delete_patch)] = [&](event_loop_stream_wrapper& stream,
-                hope::io::event_loop::connection& c, state_t in_state, message* msg) {
-                const auto delete_patch = static_cast<delete_patch_request*>(msg);
-                LOG(INFO) << "Delete patch request" << HOPE_VAL(c.descriptor) << HOPE_VAL(delete_patch->tag);
-                delete_patch_response response;
-                const auto& entry = m_patch_registry.find(delete_patch->tag);
-                if (entry != m_patch_registry.end()) {
-                    response.removed_patches = entry->second;
-                    for (const auto& p : response.removed_patches) {
-                        LOG(INFO) << "Removed patch:" << HOPE_VAL(p->name) << HOPE_VAL(p->file_size) << HOPE_VAL(p->tag);
-                    }
-                    m_patch_registry.erase(entry);
-                }
-                response.write(stream);
-                delete msg;
-                in_state->second = nullptr;
-                c.set_state(hope::io::event_loop::connection_state::write);
-                m_io_cmd.enqueue([this, patches = response.removed_patches] {
-                    cdelete(patches);
+            }
+            const auto changed = std::any_of(begin(remote), end(remote), [&](const auto& r) {
+                return std::none_of(begin(local), end(local), [&](const auto& l) { return same(*l, *r); });
+            });
+            if (changed) {
+                update.received = receive(update.partial, [&](const client::sink_factory_t& sinks) {
+                    return primary.sync(tag, local, sinks);
                 });
-            };
-            restore_from_cache();
-            m_running = true;
-            m_io = std::thread([this] {
-	            io();
+            }
+            LOG(INFO) << "Replicated tag" << HOPE_VAL(tag) << HOPE_VAL(update.received.size()) << HOPE_VAL(update.removed.size());
+            local.erase(std::remove_if(begin(local), end(local), [&](const auto& l) {
+                return std::find(begin(update.removed), end(update.removed), l->name) != end(update.removed)
+                    || std::any_of(begin(update.received), end(update.received), [&l](const auto& r) { return r->name == l->name; });
+            }), end(local));
+            for (const auto& p : update.received) {
+                auto meta = std::make_shared<patch>();
+                meta->name = p->name;
+                meta->tag = p->tag;
+                meta->file_size = p->file_size;
+                meta->hash = p->hash;
+                local.push_back(std::move(meta));
+            }
+            if (local.empty()) {
+                m_mirror.erase(tag);
+            }
+            return update;
+        }
+
+        // files of the tag are renamed and removed here, so they change in the order the replica pulled them
+        void replicated(replica_update& update) {
+            if (!update.removed.empty()) {
+                std::vector<std::shared_ptr<patch>> removed;
+                for (auto& p : m_index.erase(update.tag)) {
+                    if (std::find(begin(update.removed), end(update.removed), p->name) != end(update.removed)) {
+                        m_cache.erase(p.get());
+                        removed.emplace_back(std::move(p));
+                    } else {
+                        m_index.put(std::move(p));
+                    }
+                }
+                cdelete(removed);
+                if (std::vector<std::shared_ptr<patch>> left; update.received.empty() && !m_index.get(update.tag, left)) {
+                    m_tag_updated.erase(update.tag);
+                }
+            }
+            place(update.received, update.partial);
+            for (const auto& p : update.received) {
+                p->source = m_blocks.share(create_file_source(cache_path(*p)));
+                put(p);
+            }
+            record(update.tag);
+            notify();
+        }
+
+        void execute(event_loop_stream_wrapper& stream, hope::io::event_loop::connection& c,
+            state_t in_state, get_batch_request& request) {
+            LOG(INFO) << "Got batch request" << HOPE_VAL(c.descriptor) << HOPE_VAL(request.tags.size());
+            auto* response = m_messages.acquire<get_batch_response>();
+            for (const auto& tag : request.tags) {
+                if (!m_index.get(tag, response->patches)) {
+                    LOG(INFO) << "No patches for" << HOPE_VAL(tag);
+                }
+            }
+            compatible(request.get_version(), response->patches);
+            warm(response->patches);
+            respond(stream, c, in_state, &request, response);
+        }
+
+        void execute(event_loop_stream_wrapper& stream, hope::io::event_loop::connection& c,
+            state_t in_state, sync_request& request) {
+            LOG(INFO) << "Got sync request" << HOPE_VAL(c.descriptor) << HOPE_VAL(request.tag)
+                << HOPE_VAL(request.local.size());
+            std::unordered_map<std::string, const patch*> local;
+            for (const auto& p : request.local) {
+                local.emplace(p->name, p.get());
+            }
+            auto* response = m_messages.acquire<sync_response>();
+            std::vector<std::shared_ptr<patch>> entry;
+            m_index.get(request.tag, entry);
+            for (const auto& p : entry) {
+                const auto existing = local.find(p->name);
+                if (existing == end(local) || existing->second->hash != p->hash
+                    || existing->second->file_size != p->file_size) {
+                    response->patches.emplace_back(p);
+                }
+            }
+            LOG(INFO) << "Patches to sync" << HOPE_VAL(response->patches.size());
+            compatible(request.get_version(), response->patches);
+            warm(response->patches);
+            limit_tag(*in_state, request.tag);
+            respond(stream, c, in_state, &request, response);
+        }
+
+        void execute(event_loop_stream_wrapper& stream, hope::io::event_loop::connection& c,
+            state_t in_state, delete_patch_request& request) {
+            LOG(INFO) << "Delete patch request" << HOPE_VAL(c.descriptor) << HOPE_VAL(request.tag);
+            auto* response = m_messages.acquire<delete_patch_response>();
+            response->removed_patches = m_index.erase(request.tag);
+            for (const auto& p : response->removed_patches) {
+                LOG(INFO) << "Removed patch:" << HOPE_VAL(p->name) << HOPE_VAL(p->file_size) << HOPE_VAL(p->tag);
+                m_cache.erase(p.get());
+            }
+            m_tag_updated.erase(request.tag);
+            if (!response->removed_patches.empty()) {
+                record(request.tag);
+                notify();
+            }
+            m_io_cmd.enqueue([this, patches = response->removed_patches] {
+                cdelete(patches);
             });
+            compatible(request.get_version(), response->removed_patches);
+            respond(stream, c, in_state, &request, response);
         }
-        virtual void run(int port) override {
-            m_event_loop = hope::io::create_event_loop();
-            LOG(INFO) << "Created event loop";
-            LOG(INFO) << "Run loop on port" << HOPE_VAL(port);
-            hope::io::event_loop::config ev_cfg;
-            ev_cfg.port = port;
-            try {
-                m_event_loop->run(ev_cfg,
-                    hope::io::event_loop::callbacks {
-                    [this] (auto&& c) { on_create(c); },
-                    [this] (auto&& c) { on_read(c); },
-                    [this] (auto&& c) { on_write(c); },
-                    [this] (auto&& c, auto&& err) { on_error(c, err); }
+
+        // stores or replaces patch with the same name inside its tag
+        void put(const std::shared_ptr<patch>& p) {
+            m_tag_updated[p->tag] = std::chrono::system_clock::now();
+            if (const auto replaced = m_index.put(p)) {
+                m_cache.erase(replaced.get());
+            }
+            if (p->data != nullptr) {
+                // stays in memory at least until it is written to disk
+                m_cache.insert(p, true);
+                evict();
+            }
+        }
+
+        std::string cache_path(const patch& p) const {
+            return m_cache_dir + "/" + p.tag + "/" + p.name;
+        }
+
+        // patches are about to be sent, the cold ones are served from disk this time
+        // and loaded to memory in background for the next requests
+        void warm(const std::vector<std::shared_ptr<patch>>& patches) {
+            for (const auto& p : patches) {
+                if (const auto* linked = dynamic_cast<const linked_source*>(p->source.get())) {
+                    // served through the origin, keep it hot, but never load it through a link
+                    m_cache.touch(linked->origin.get());
+                    continue;
+                }
+                if (m_cache.touch(p.get()) || p->data != nullptr
+                    || !m_cache.admits(p->file_size) || !m_loading.emplace(p.get()).second) {
+                    continue;
+                }
+                m_io_cmd.enqueue([this, p, path = cache_path(*p)] {
+                    std::unique_ptr<uint8_t[]> data;
+                    if (!load(path, *p, data)) {
+                        LOG(LERR) << "Cannot load patch from cache" << HOPE_VAL(path);
+                        data.reset();
+                    } else {
+                        m_load_bytes.fetch_add(p->file_size, std::memory_order_relaxed);
+                    }
+                    // std::function wants copyable lambda
+                    auto holder = std::make_shared<std::unique_ptr<uint8_t[]>>(std::move(data));
+                    post(m_io_done, [this, p, holder] {
+                        m_loading.erase(p.get());
+                        // deleted, replaced or loaded already while the file was being read
+                        if (*holder == nullptr || p->data != nullptr || !m_index.contains(p)) {
+                            return;
+                        }
+                        p->data = holder->release();
+                        p->source.reset();
+                        m_cache.insert(p, false);
+                        evict();
+                    });
                 });
-            } catch (const std::exception& ex) {
-                LOG(LERR) << HOPE_VAL(ex.what());
             }
         }
-        virtual ~service_impl() override {
-            m_running.store(false);
-            m_io.join();
-            // clear queue for sure
+
+        // io thread, reads cached patch verifying its hash
+        bool load(const std::string& path, const patch& p, std::unique_ptr<uint8_t[]>& data) const {
+            std::ifstream file(path, std::ios::binary);
+            if (!file.is_open()) {
+                return false;
+            }
+            data.reset(new uint8_t[p.file_size]);
+            uint64_t hash = 0;
+            return read_hashed(file, p.file_size, data.get(), hash) && hash == p.hash;
+        }
+
+        // hashes the file block by block while reading, data could be null if only the hash is needed
+        static bool read_hashed(std::istream& file, uint64_t size, uint8_t* data, uint64_t& hash) {
+            constexpr static uint64_t block_size = 1024 * 1024;
+            std::vector<uint8_t> block(data == nullptr ? std::min(block_size, size) : 0);
+            hasher h;
+            for (uint64_t offset = 0; offset < size; offset += block_size) {
+                const auto count = std::min(block_size, size - offset);
+                auto* target = data != nullptr ? data + offset : block.data();
+                if (!file.read((char*)target, (std::streamsize)count)) {
+                    return false;
+                }
+                h.update(target, count);
+            }
+            hash = h.digest();
+            return true;
+        }
+
+        // drops least recently used payloads over the budget, they are served from disk from now on
+        void evict() {
+            const auto victims = m_cache.take_victims();
+            for (const auto& p : victims) {
+                auto source = m_blocks.share(create_file_source(cache_path(*p)));
+                if (source == nullptr) {
+                    LOG(LERR) << "Cannot evict patch, no file in cache" << HOPE_VAL(p->tag) << HOPE_VAL(p->name);
+                    m_cache.insert(p, true);
+                    continue;
+                }
+                p->source = std::move(source);
+                delete[] p->data;
+                p->data = nullptr;
+            }
+            if (!victims.empty()) {
+                const auto stats = m_cache.stats();
+                LOG(INFO) << "Evicted patches" << HOPE_VAL(victims.size()) << HOPE_VAL(stats.resident_bytes)
+                    << HOPE_VAL(stats.budget) << HOPE_VAL(stats.hits) << HOPE_VAL(stats.misses) << HOPE_VAL(stats.evictions);
+            }
+        }
+
+        // results of background io are applied on the loop thread, so patches are touched by one thread only
+        void apply_io_results() {
             std::function<void()> f;
-            while (m_io_cmd.try_dequeue(f)) {
+            while (m_io_done.try_dequeue(f)) {
+                f();
+            }
+            while (m_fetch_done.try_dequeue(f)) {
+                f();
+            }
+            while (m_replica_done.try_dequeue(f)) {
                 f();
             }
-            delete m_event_loop;
         }
 
-    private:
-        void on_create(hope::io::event_loop::connection& c) {
-            // TODO:: add ip address to connection, or add method to resolve desriptor
-            LOG(INFO) << "Created connection" << HOPE_VAL(c.descriptor);
-            c.set_state(hope::io::event_loop::connection_state::read);
+        // same name, size and content is already stored within the tag
+        bool is_stored(const patch& p) const {
+            const auto stored = m_index.find(p.tag, p.name);
+            return stored != nullptr && stored->hash == p.hash && stored->file_size == p.file_size;
         }
 
-        void on_read(hope::io::event_loop::connection& c) {
-            event_loop_stream_wrapper stream(*c.buffer);
-            if (stream.is_ready_to_read()) {
-                if (auto state = m_active_clients.find(c.descriptor); state != end(m_active_clients)) {
-                    auto* msg_ptr = state->second;
-                    LOG(INFO) << "Got new chunk for message"
-                        << HOPE_VAL(message::str_type(msg_ptr->get_type()));
-                    handle_request(stream, c, state, msg_ptr);
-                } else {
-                    auto* new_message = message::peek_request(stream);
-                    state = m_active_clients.emplace(c.descriptor, new_message).first;
-                    handle_request(stream, c, state, new_message);
-                }
+        // answers with the protocol version of the request, first chunk is written right now,
+        // the rest is streamed from on_write
+        void respond(event_loop_stream_wrapper& stream, hope::io::event_loop::connection& c,
+            state_t in_state, message* request, message* response) {
+            response->set_version(request->get_version());
+            // short peer chunk would not fit a single patch header
+            in_state->peer_chunk = request->get_peer_chunk() == 0 ? 0 : std::max(request->get_peer_chunk(), min_chunk);
+            in_state->chunk = m_initial_chunk;
+            const auto type = request->get_type();
+            in_state->scheduled = type == message::etype::get_patches || type == message::etype::get_batch
+                || type == message::etype::sync;
+            if (!in_state->scheduled) {
+                in_state->interactive = true;
+                ++m_interactive;
+            } else if (m_connection_rate != 0) {
+                in_state->rate = token_bucket(m_connection_rate, std::max<uint64_t>(m_connection_rate, min_chunk));
+            }
+            response->set_chunk_limit(write_limit(*in_state));
+            m_messages.release(request, true);
+            in_state->responding = true;
+            if (starved(*in_state, c)) {
+                in_state->msg = response;
+                starve(c, in_state);
+                return;
+            }
+            bool complete = false;
+            try {
+                complete = response->write(stream);
+                consume(*in_state, c.buffer->count());
+                in_state->written = c.buffer->count();
+            } catch (const std::exception& ex) {
+                LOG(LERR) << "Cannot write message, kill connection" << HOPE_VAL(c.descriptor) << HOPE_VAL(ex.what());
+                m_messages.release(response, false);
+                close(c);
+                finish(in_state);
+                return;
             }
+            if (complete) {
+                m_messages.release(response, false);
+                in_state->msg = nullptr;
+            } else {
+                in_state->msg = response;
+            }
+            c.set_state(hope::io::event_loop::connection_state::write);
         }
 
-        void on_write(hope::io::event_loop::connection& c) {
-            if (auto state = m_active_clients.find(c.descriptor); state != end(m_active_clients)) {
-                auto* msg_ptr = state->second;
-                bool complete = msg_ptr == nullptr;
-                if (!complete) {
-                    event_loop_stream_wrapper stream(*c.buffer);
-                    complete = msg_ptr->write(stream);
+        // small responses and first chunks of bulk streams are written quickly and do not hold the loop
+        // for a whole buffer of file reads, long streams reach full chunks after a few writes
+        void grow_chunk(client_state& state, message& msg) {
+            state.chunk = state.chunk > UINT32_MAX / 2 ? UINT32_MAX : state.chunk * 2;
+            msg.set_chunk_limit(write_limit(state));
+        }
+        // downloads take turns by quanta, shrink to the smallest one while interactive responses are
+        // in flight and do not take more than their rate allows
+        uint32_t write_limit(client_state& state) {
+            auto limit = chunk_limit(state);
+            if (!state.scheduled) {
+                return limit;
+            }
+            const auto quantum = m_interactive != 0 ? min_chunk : m_write_quantum;
+            if (quantum != 0) {
+                limit = limit == 0 ? quantum : std::min(limit, quantum);
+            }
+            const auto allowed = allowance(state);
+            if (allowed != UINT64_MAX) {
+                const auto rated = uint32_t(std::clamp<uint64_t>(allowed, min_chunk, UINT32_MAX));
+                limit = limit == 0 ? rated : std::min(limit, rated);
+            }
+            return limit;
+        }
+        uint64_t allowance(client_state& state) {
+            if (!state.rate.limited() && state.tag == nullptr) {
+                return UINT64_MAX;
+            }
+            const auto now = clock::now();
+            auto allowed = state.rate.available(now);
+            if (state.tag != nullptr) {
+                allowed = std::min(allowed, state.tag->second.bucket.available(now));
+            }
+            return allowed;
+        }
+        // rate limited download waits until a smallest chunk could go
+        bool may_write(client_state& state) {
+            return allowance(state) >= min_chunk;
+        }
+        void throttle(hope::io::event_loop::connection& c, state_t state) {
+            state->throttled = true;
+            state->connection = &c;
+            m_throttled.push_back(c.descriptor);
+            // the hub keeps it waiting, not the client
+            m_timers.disarm(uint32_t(c.descriptor));
+            c.buffer->reset();
+            c.set_state(hope::io::event_loop::connection_state::idle);
+        }
+        // every tick, downloads go on once their buckets pay for a chunk, the rest keep waiting
+        void release_throttled() {
+            if (m_throttled.empty()) {
+                return;
+            }
+            const auto throttled = std::move(m_throttled);
+            m_throttled.clear();
+            for (const auto descriptor : throttled) {
+                auto* state = m_clients.find(descriptor);
+                // closed meanwhile, the descriptor may be reused by another connection
+                if (state == nullptr || !state->throttled) {
+                    continue;
                 }
-                if (complete) {
-                    LOG(INFO) << "Send last chunk for msg, close connection" << HOPE_VAL(c.descriptor);
-                    delete msg_ptr;
-                    m_active_clients.erase(state);
-                    c.set_state(hope::io::event_loop::connection_state::die);
+                if (!may_write(*state)) {
+                    m_throttled.push_back(descriptor);
+                    continue;
                 }
-            } else {
-                LOG(INFO) << "Cannot find active state for client, kill connection" << HOPE_VAL(c.descriptor);
-                c.set_state(hope::io::event_loop::connection_state::die);
+                auto& c = *state->connection;
+                state->throttled = false;
+                state->connection = nullptr;
+                resume(c);
+                c.set_state(hope::io::event_loop::connection_state::write);
             }
         }
-
-        void on_error(hope::io::event_loop::connection& c, const std::string& err) {
-            LOG(INFO) << "Fatal error" << HOPE_VAL(err);
-            if (auto active_message = m_active_clients.find(c.descriptor); active_message != end(m_active_clients)) {
-                delete active_message->second;
-                m_active_clients.erase(active_message);
+        void consume(client_state& state, uint64_t bytes) {
+            state.rate.consume(bytes);
+            if (state.tag != nullptr) {
+                state.tag->second.bucket.consume(bytes);
+            }
+        }
+        // downloads of the tag share its rate
+        void limit_tag(client_state& state, const std::string& tag) {
+            if (m_tag_rate == 0) {
+                return;
+            }
+            auto [it, inserted] = m_tag_limits.try_emplace(tag);
+            if (inserted) {
+                it->second.bucket = token_bucket(m_tag_rate, std::max<uint64_t>(m_tag_rate, min_chunk));
             }
+            ++it->second.users;
+            state.tag = &*it;
+        }
+        static uint32_t chunk_limit(const client_state& state) {
+            if (state.chunk == 0 || state.peer_chunk == 0) {
+                return std::max(state.chunk, state.peer_chunk);
+            }
+            return std::min(state.chunk, state.peer_chunk);
         }
 
-        void handle_request(event_loop_stream_wrapper& stream, hope::io::event_loop::connection& c, state_t state_iterator, message* msg) {
-	        if (const auto complete = msg->read(stream)) {
-                LOG(INFO) << "Message fully read";
-                m_exec[(int8_t)msg->get_type()](stream, c, state_iterator, msg);
-            } // otherwise needs more reads
+        // legacy clients cannot describe huge patches or long lists, such entries are skipped
+        // filters in place, the response keeps its storage
+        void compatible(uint8_t version, std::vector<std::shared_ptr<patch>>& patches) const {
+            const auto last = std::remove_if(begin(patches), end(patches), [version](const auto& p) {
+                if (!p->fits(version)) {
+                    LOG(LERR) << "Patch does not fit protocol, skipped" << HOPE_VAL(p->name) << HOPE_VAL(version);
+                    return true;
+                }
+                return false;
+            });
+            patches.erase(last, end(patches));
+            if (patches.size() > protocol::max_count(version)) {
+                LOG(LERR) << "Too many patches for protocol, list truncated" << HOPE_VAL(version);
+                patches.resize(protocol::max_count(version));
+            }
         }
 
         void io() {
+            auto next_gc = std::chrono::steady_clock::now() + m_gc_interval;
             while (m_running.load(std::memory_order_acquire)) {
                 std::this_thread::sleep_for(std::chrono::milliseconds(100)); // most stable stuff ever
                 std::function<void()> f;
                 while (m_io_cmd.try_dequeue(f)) {
 	                f();
                 }
+                const auto now = std::chrono::steady_clock::now();
+                if (!m_retention.empty() && m_primary_host.empty() && (now >= next_gc || m_gc_more.load()) && !m_gc_queued.exchange(true)) {
+                    next_gc = now + m_gc_interval;
+                    m_gc_more = false;
+                    // registry belongs to the loop, collection itself runs there, only disk work comes back here
+                    post(m_io_done, [this] {
+                        collect();
+                    });
+                }
+            }
+        }
+
+        // removes a batch of tags expired by retention rules, files are deleted by io thread
+        void collect() {
+            m_gc_queued = false;
+            std::vector<tag_info> tags;
+            tags.reserve(m_tag_updated.size());
+            for (const auto& [tag, updated] : m_tag_updated) {
+                tags.push_back({ tag, updated });
+            }
+            auto expired = expired_tags(std::move(tags), m_retention, std::chrono::system_clock::now());
+            if (expired.size() > m_gc_batch) {
+                expired.resize(m_gc_batch);
+                m_gc_more = true;
+            }
+            std::vector<std::shared_ptr<patch>> removed;
+            for (const auto& tag : expired) {
+                for (auto& p : m_index.erase(tag)) {
+                    m_cache.erase(p.get());
+                    removed.emplace_back(std::move(p));
+                }
+                m_tag_updated.erase(tag);
+                record(tag);
+                LOG(INFO) << "Tag expired" << HOPE_VAL(tag);
+            }
+            notify();
+            if (!removed.empty()) {
+                m_io_cmd.enqueue([this, patches = std::move(removed)] {
+                    cdelete(patches);
+                });
             }
         }
 
         void restore_from_cache() {
             LOG(INFO) << "Restore from cache";
             std::filesystem::path p = m_cache_dir;
+            {
+                // whatever was being written when the hub went down
+                std::error_code ec;
+                std::filesystem::remove_all(p / m_partial_dir, ec);
+            }
             try {
-                for (const auto& entry : std::filesystem::recursive_directory_iterator(p)) {
+                for (auto it = std::filesystem::recursive_directory_iterator(p);
+                    it != std::filesystem::recursive_directory_iterator(); ++it) {
+                    const auto& entry = *it;
+                    if (entry.is_directory() && (entry.path().filename() == m_meta_dir || entry.path().filename() == m_partial_dir)) {
+                        it.disable_recursion_pending();
+                        continue;
+                    }
                     if (entry.is_regular_file()) {
                         const auto new_p = entry.path().string();
                         const auto filename = entry.path().filename().string();
                         // /cache/platform_revision/
-                        auto parent_path = entry.path().parent_path().string();
-                        auto tag = std::string(parent_path.c_str() + 6, parent_path.size() - 6);
+                        const auto tag = std::filesystem::relative(entry.path().parent_path(), p).generic_string();
                         LOG(INFO) << "Trying to restore patch" << HOPE_VAL(tag) << HOPE_VAL(filename);
-                        std::ifstream file(new_p, std::ios::binary | std::ios::ate);
-                        if (file.is_open()) {
-                            const auto size = file.tellg();
-                            file.seekg(0, std::ios::beg);
-                            auto new_patch = std::make_shared<patch>();
-                            new_patch->file_size = (uint32_t)size;
-                            new_patch->name = filename;
-                            new_patch->data = new uint8_t[size];
-                            new_patch->tag = tag;
-                            if (!file.read((char*)new_patch->data, size)) {
-                                LOG(LERR) << "Cannot read file" << HOPE_VAL(new_p);
-                            } else {
-                                m_patch_registry[tag].emplace_back(std::move(new_patch));
+                        auto new_patch = std::make_shared<patch>();
+                        std::error_code ec;
+                        new_patch->file_size = entry.file_size(ec);
+                        if (ec) {
+                            LOG(LERR) << "Cannot open file" << HOPE_VAL(new_p);
+                            continue;
+                        }
+                        new_patch->name = filename;
+                        new_patch->tag = tag;
+                        uint64_t stored_size = 0, stored_hash = 0;
+                        const auto stored = read_meta(*new_patch, stored_size, stored_hash) && stored_hash != 0;
+                        // hot set is kept while it fits the budget and is hashed as it is loaded. The rest is served
+                        // from disk with the hash its meta tells: nothing is read now, receivers check the hash
+                        // of what they get, so a damaged file shows on serve
+                        const auto resident = m_cache.has_room(new_patch->file_size);
+                        auto read = true;
+                        if (resident || !stored) {
+                            std::ifstream file(new_p, std::ios::binary);
+                            if (resident) {
+                                new_patch->data = new uint8_t[new_patch->file_size];
                             }
+                            read = file.is_open() && read_hashed(file, new_patch->file_size, new_patch->data, new_patch->hash);
                         } else {
-                            LOG(LERR) << "Cannot open file" << HOPE_VAL(new_p);
+                            new_patch->hash = stored_hash;
+                        }
+                        if (!resident) {
+                            new_patch->source = m_blocks.share(create_file_source(new_p));
+                        }
+                        if (!read) {
+                            LOG(LERR) << "Cannot read file" << HOPE_VAL(new_p);
+                        } else if (stored && (stored_size != new_patch->file_size || stored_hash != new_patch->hash)) {
+                            LOG(LERR) << "Cached patch is damaged, skipped" << HOPE_VAL(new_p)
+                                << HOPE_VAL(stored_size) << HOPE_VAL(stored_hash) << HOPE_VAL(new_patch->hash);
+                        } else {
+                            if (resident) {
+                                m_cache.insert(new_patch, false);
+                            }
+                            // the newest file tells when the tag was uploaded
+                            const auto updated = std::chrono::file_clock::to_sys(entry.last_write_time(ec));
+                            auto& tag_updated = m_tag_updated[tag];
+                            tag_updated = std::max(tag_updated,
+                                std::chrono::time_point_cast<std::chrono::system_clock::duration>(updated));
+                            m_index.put(std::move(new_patch));
                         }
                     }
                 }
@@ -268,11 +2201,16 @@ namespace ph {
             catch (...){
                 LOG(INFO) << "Cache load err unknown";
             }
-            for (const auto& [k, patches] : m_patch_registry) {
-                LOG(INFO) << "Loaded patches for" << HOPE_VAL(k);
-                for (const auto& p : patches) {
-                    LOG(INFO) << HOPE_VAL(p->name);
-                }
+            LOG(INFO) << "Loaded patches" << HOPE_VAL(m_index.size());
+            m_index.for_each([](const std::shared_ptr<patch>& p) {
+                LOG(INFO) << HOPE_VAL(p->tag) << HOPE_VAL(p->name);
+            });
+        }
+
+        // patches whose files are being written by cput, their files are not handed out meanwhile
+        void writing(const std::vector<std::shared_ptr<patch>>& patches) {
+            for (const auto& p : patches) {
+                m_writing.insert(p.get());
             }
         }
 
@@ -290,9 +2228,57 @@ namespace ph {
                 catch (const std::filesystem::filesystem_error& e) {
                     LOG(INFO) << "Crete folder err" << HOPE_VAL(e.what());
                 }
-                std::ofstream cache(path);
+                if (const auto* linked = dynamic_cast<const linked_source*>(p->source.get())) {
+                    // same content is already on disk, link it instead of one more copy
+                    const auto origin_path = m_cache_dir + "/" + linked->origin->tag + "/" + linked->origin->name;
+                    std::error_code ec;
+                    std::filesystem::create_hard_link(origin_path, path, ec);
+                    if (!ec) {
+                        write_meta(*p);
+                        LOG(INFO) << "Patch linked successfully" << HOPE_VAL(path) << HOPE_VAL(origin_path);
+                        continue;
+                    }
+                    LOG(INFO) << "Cannot link patch, copy it" << HOPE_VAL(path) << HOPE_VAL(ec.message());
+                    // origin payload may be evicted at any moment on the loop thread, copy it from disk
+                    const auto partial = partial_path();
+                    std::filesystem::copy_file(origin_path, partial,
+                        std::filesystem::copy_options::overwrite_existing, ec);
+                    if (!ec) {
+                        write_meta(*p);
+                        std::filesystem::rename(partial, path, ec);
+                    }
+                    if (ec) {
+                        LOG(LERR) << "Cannot copy patch" << HOPE_VAL(path) << HOPE_VAL(ec.message());
+                    }
+                    continue;
+                }
+                const auto partial = partial_path();
+                std::ofstream cache(partial, std::ios::binary);
                 if (cache.is_open()) {
-	                cache.write((char*)p->data, p->file_size);
+                    if (p->data != nullptr) {
+	                    cache.write((char*)p->data, p->file_size);
+                    } else {
+                        std::vector<uint8_t> block(std::min<uint64_t>(p->file_size, 1024 * 1024));
+                        for (uint64_t offset = 0; offset < p->file_size;) {
+                            const auto count = p->source->read(offset, block.data(),
+                                (std::size_t)std::min<uint64_t>(block.size(), p->file_size - offset));
+                            cache.write((char*)block.data(), count);
+                            offset += count;
+                        }
+                    }
+                    cache.close();
+                    std::error_code ec;
+                    if (!cache) {
+                        LOG(LERR) << "Cannot write patch" << HOPE_VAL(partial);
+                        std::filesystem::remove(partial, ec);
+                        continue;
+                    }
+                    write_meta(*p);
+                    std::filesystem::rename(partial, path, ec);
+                    if (ec) {
+                        LOG(LERR) << "Cannot rename patch" << HOPE_VAL(partial) << HOPE_VAL(ec.message());
+                        continue;
+                    }
                     LOG(INFO) << "Patch preserver successfully" << HOPE_VAL(path);
                 } else {
                     LOG(INFO) << "Cannot open file" << HOPE_VAL(path);
@@ -300,6 +2286,40 @@ namespace ph {
 	        }
         }
 
+        // patches are written to a file of their own in the partial dir and renamed into place once complete,
+        // so a crash never leaves a truncated patch under the real name; the dir is dropped on restore
+        std::string partial_path() const {
+            const auto dir = m_cache_dir + "/" + m_partial_dir;
+            std::error_code ec;
+            std::filesystem::create_directories(dir, ec);
+            return dir + "/" + std::to_string(m_partial_id++);
+        }
+
+        // size and hash of cached patch, stored aside in the meta dir, verified on restore
+        std::string meta_path(const patch& p) const {
+            return m_cache_dir + "/" + m_meta_dir + "/" + p.tag + "/" + p.name;
+        }
+
+        void write_meta(const patch& p) const {
+            const auto path = meta_path(p);
+            std::error_code ec;
+            std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+            std::ofstream meta(path, std::ios::binary);
+            meta.write((const char*)&p.file_size, sizeof(p.file_size));
+            meta.write((const char*)&p.hash, sizeof(p.hash));
+            if (!meta) {
+                LOG(LERR) << "Cannot write patch meta" << HOPE_VAL(path);
+            }
+        }
+
+        // returns false if there is no meta (e.g. cache made by older hub)
+        bool read_meta(const patch& p, uint64_t& size, uint64_t& hash) const {
+            std::ifstream meta(meta_path(p), std::ios::binary);
+            meta.read((char*)&size, sizeof(size));
+            meta.read((char*)&hash, sizeof(hash));
+            return (bool)meta;
+        }
+
         void cdelete(const std::vector<std::shared_ptr<patch>>& patches) {
             for (const auto& p : patches) {
                 const auto subdir = m_cache_dir + "/" + p->tag + "/";
@@ -308,31 +2328,144 @@ namespace ph {
                     if (std::filesystem::remove(path)) {
                         LOG(INFO) << "Removed old patch from cache" << HOPE_VAL(path);
                     }
+                    std::filesystem::remove(meta_path(*p));
                 }
                 catch (const std::filesystem::filesystem_error& e) {
                     LOG(INFO) << "Cannot remove patch (not always an error)" << HOPE_VAL(e.what());
                 }
+                // fails for non empty ones, that is fine
+                std::error_code ec;
+                std::filesystem::remove(subdir, ec);
+                std::filesystem::remove(std::filesystem::path(meta_path(*p)).parent_path(), ec);
             }
         }
 
         std::atomic_bool m_running;
         hope::io::event_loop* m_event_loop{ nullptr };
 
+        // outlives every patch, their sources read through it
+        block_cache m_blocks;
+        // read by background loads, io thread
+        std::atomic<uint64_t> m_load_bytes{ 0 };
+
         // client id (raw socket) to client state
-        std::unordered_map<int32_t, message*> m_active_clients;
-        std::array<exec_t, (int8_t)message::etype::count> m_exec;
+        client_slab m_clients;
+        message_pool m_messages;
 
-        using patch_array_t = std::vector<std::shared_ptr<patch>>;
         using patch_key_t = std::string;
 
-        std::unordered_map<patch_key_t, patch_array_t> m_patch_registry;
+        patch_index m_index;
+        payload_cache m_cache;
+        // patches being loaded from disk by io thread
+        std::unordered_set<const patch*> m_loading;
+        // cput of these is not done yet
+        std::unordered_set<const patch*> m_writing;
         hope::threading::spsc_queue<std::function<void()>> m_io_cmd;
+        // io thread -> loop thread
+        hope::threading::spsc_queue<std::function<void()>> m_io_done;
+
+        // tag -> last upload, retention rules are checked against it
+        std::unordered_map<patch_key_t, std::chrono::system_clock::time_point> m_tag_updated;
+        const std::vector<retention_rule> m_retention;
+        const std::chrono::seconds m_gc_interval;
+        const std::size_t m_gc_batch;
+        const uint32_t m_initial_chunk;
+        // admission control, see service_config
+        const uint64_t m_max_upload_bytes;
+        const std::size_t m_max_transfers;
+        const uint64_t m_max_request_bytes;
+        uint64_t m_upload_bytes{ 0 };
+        std::size_t m_transfers{ 0 };
+        // descriptors in arrival order
+        std::deque<int32_t> m_waiting;
+        bool m_waking{ false };
+        // connection deadlines, see service_config
+        const std::chrono::milliseconds m_header_timeout;
+        const std::chrono::milliseconds m_idle_timeout;
+        const uint64_t m_min_transfer_rate;
+        const std::chrono::milliseconds m_rate_window;
+        const clock::time_point m_epoch;
+        timer_wheel m_timers;
+        // by descriptor
+        std::vector<connection_timer> m_peers;
+        std::vector<uint32_t> m_fired;
+        // write scheduling, see service_config
+        const uint32_t m_write_quantum;
+        const uint64_t m_connection_rate;
+        const uint64_t m_tag_rate;
+        // responses to small requests being written
+        std::size_t m_interactive{ 0 };
+        tag_limits m_tag_limits;
+        // descriptors of downloads waiting for their buckets
+        std::vector<int32_t> m_throttled;
+        // subscriptions, see service_config
+        const std::chrono::milliseconds m_max_subscribe_wait;
+        const std::size_t m_change_log;
+        // sequence -> changed tag, the newest at the end
+        std::deque<std::pair<uint64_t, std::string>> m_changes;
+        uint64_t m_sequence{ 0 };
+        // descriptors of waiting subscriptions, answered ones are skipped
+        std::vector<int32_t> m_subscribers;
+        std::size_t m_subscribed{ 0 };
+        // read-through proxy, see service_config
+        const std::string m_upstream_host;
+        const int m_upstream_port;
+        // tag -> descriptors of gets waiting for it
+        std::unordered_map<std::string, std::vector<int32_t>> m_fetching;
+        // tags being fetched whose headers are in
+        std::unordered_map<std::string, std::shared_ptr<fetch_feed>> m_feeds;
+        std::unique_ptr<reader_pool> m_fetcher;
+        // fetch thread -> loop thread
+        hope::threading::spsc_queue<std::function<void()>> m_fetch_done;
+        // same host fast path, see service_config
+        const std::string m_local_dir;
+        // uploads sent in parts, see service_config
+        const std::chrono::seconds m_upload_expiry;
+        const uint64_t m_max_multipart_size;
+        const std::size_t m_max_multipart_uploads;
+        std::unordered_map<uint64_t, std::shared_ptr<multipart_upload>> m_uploads;
+        uint64_t m_upload_id{ 0 };
+        // replica mode, see service_config
+        const std::string m_primary_host;
+        const int m_primary_port;
+        // replica thread only, tag -> meta of the patches pulled from the primary
+        std::unordered_map<std::string, std::vector<std::shared_ptr<patch>>> m_mirror;
+        std::atomic<uint64_t> m_primary_sequence{ 0 };
+        std::atomic<uint64_t> m_applied_sequence{ 0 };
+        // steady clock ticks, zero while the replica is caught up
+        std::atomic<int64_t> m_behind_since{ 0 };
+        std::thread m_replicator;
+        // replica thread -> loop thread
+        hope::threading::spsc_queue<std::function<void()>> m_replica_done;
+        // collection is waiting for the loop
+        std::atomic_bool m_gc_queued{ false };
+        // last pass hit the batch limit
+        std::atomic_bool m_gc_more{ false };
         std::thread m_io;
 
-        const std::string m_cache_dir = "cache/";
+        const std::string m_cache_dir;
+        // inside cache dir, so it lives on the same volume
+        const std::string m_meta_dir = ".meta";
+        const std::string m_partial_dir = ".partial";
+        // names of partial files, any thread takes the next one; another hub on the same dir starts elsewhere
+        mutable std::atomic<uint64_t> m_partial_id{ uint64_t(std::random_device{}()) << 32 };
+
+        // self wakeup of the loop, see tick
+        const uint64_t m_wake_token;
+        std::thread m_ticker;
+        std::mutex m_wake_mutex;
+        std::condition_variable m_wake_cv;
+        bool m_wake_wanted{ false };
+        bool m_ticking{ false };
+        // address the ticker connects to, loopback until a client tells where the hub listens
+        std::string m_wake_host{ "127.0.0.1" };
+        // loop has deadlines or throttled downloads
+        std::atomic_bool m_timed{ false };
+        // loop thread
+        int32_t m_wake_descriptor{ -1 };
     };
 
-    service* create_service() {
-        return new service_impl();
+    service* create_service(const service_config& config) {
+        return new service_impl(config);
     }
 }
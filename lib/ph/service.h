@@ -8,8 +8,10 @@
 
 #pragma once
 
+#include <chrono>
 #include <string>
 #include <cstdint>
+#include <vector>
 #include "hope_logger/log_helper.h"
 
 #define INFO hope::log::log_level::info
@@ -23,13 +25,113 @@ namespace ph {
 
     using revision_t = uint32_t;
 
+    // tags are "platform_revision", rule decides which revisions of the platform are kept
+    struct retention_rule final {
+        // rule with empty platform applies to platforms without own rule
+        std::string platform;
+        // newest revisions kept, zero means no limit
+        uint32_t keep_last{ 0 };
+        // tags not updated for longer are removed, zero means no limit
+        std::chrono::seconds max_age{ 0 };
+    };
+
+    struct service_config final {
+        // bytes of patch payload kept in memory, colder patches are served from the disk cache;
+        // zero means everything stays in memory
+        uint64_t memory_budget{ 0 };
+        // nothing is removed automatically without rules
+        std::vector<retention_rule> retention;
+        std::chrono::seconds gc_interval{ 60 };
+        // tags removed per pass, the rest waits for the next one
+        std::size_t gc_batch{ 64 };
+        // first chunk of a response, every next one is twice as large up to what the client receives;
+        // zero sends full chunks right away
+        uint32_t initial_chunk{ 64 * 1024 };
+        // payload of uploads being received into memory; uploads above it wait with their socket unread,
+        // so tcp holds the clients back. Zero means no limit
+        uint64_t max_upload_bytes{ 0 };
+        // uploads and downloads served at once, others wait in arrival order; list, delete and offer
+        // never wait. Zero means no limit
+        std::size_t max_transfers{ 0 };
+        // largest payload a single upload may keep in memory, larger ones are refused;
+        // zero means max_upload_bytes, or no limit when that is zero too
+        uint64_t max_request_bytes{ 1024ull * 1024 * 1024 };
+        // connection is closed when its request does not start to arrive in time, zero means no limit
+        std::chrono::milliseconds header_timeout{ 30000 };
+        // connection is closed when nothing is received or sent for this long, zero means no limit;
+        // transfers waiting for admission are not counted
+        std::chrono::milliseconds idle_timeout{ 120000 };
+        // transfer moving fewer bytes per second over the window is closed, zero means no limit;
+        // progress is seen once per chunk, so the window should fit a few of them
+        uint64_t min_transfer_rate{ 0 };
+        std::chrono::milliseconds rate_window{ 30000 };
+        // largest chunk a download writes per turn of the loop, so big transfers take turns and small
+        // requests are not stuck behind them; zero lets downloads grow to full chunks
+        uint32_t write_quantum{ 256 * 1024 };
+        // bytes per second of a single download, zero means no limit
+        uint64_t connection_rate{ 0 };
+        // bytes per second of all get and sync downloads of one tag together, zero means no limit
+        uint64_t tag_rate{ 0 };
+        // disk blocks of patches served from disk kept for other downloads of the same patch,
+        // zero makes every download read the disk on its own
+        uint64_t read_cache_budget{ 64 * 1024 * 1024 };
+        // longest a subscription waits for a change before it is answered with none
+        std::chrono::milliseconds max_subscribe_wait{ 60000 };
+        // tag changes remembered for subscribers which come back with an older sequence
+        std::size_t change_log{ 4096 };
+        // edge mode, a tag missing here is fetched from the upstream hub on get, stored and served locally
+        // from then on, empty host means the hub serves only what it holds
+        std::string upstream_host;
+        int upstream_port{ 1556 };
+        // replica mode, uploads and deletes of the primary hub are pulled in the background, the replica
+        // itself takes no uploads or deletes and has no retention of its own, empty host means none
+        std::string primary_host;
+        int primary_port{ 1556 };
+        // patches are stored and restored from here
+        std::string cache_dir{ "cache/" };
+        // same host fast path, clients hand files inside this dir over by path and the hub copies them itself,
+        // and they read cached patches right from the cache dir; payload never goes through the socket.
+        // Only peers connected over loopback get it. Empty turns it off, clients use the socket then
+        std::string local_dir;
+        // upload sent in parts which gets no part or commit for this long is dropped with what it received
+        std::chrono::seconds upload_expiry{ 3600 };
+        // largest patch sent in parts, its file is allocated on begin; a larger one is told to upload
+        // the usual way. Zero means no limit
+        uint64_t max_multipart_size{ 16ull * 1024 * 1024 * 1024 };
+        // uploads sent in parts open at once, one more is told to upload the usual way; zero means no limit
+        std::size_t max_multipart_uploads{ 64 };
+    };
+
+    struct cache_stats final {
+        uint64_t budget{ 0 };
+        uint64_t resident_bytes{ 0 };
+        // patch requested for download was (or was not) in memory
+        uint64_t hits{ 0 };
+        uint64_t misses{ 0 };
+        uint64_t evictions{ 0 };
+        // read from disk to serve patches which are not in memory, background loads included
+        uint64_t disk_bytes{ 0 };
+    };
+
+    struct replication_stats final {
+        // sequence of the primary change stream last seen, and the last one applied here
+        uint64_t primary_sequence{ 0 };
+        uint64_t applied_sequence{ 0 };
+        // how long the replica is behind the primary, zero when it holds everything the primary told about
+        std::chrono::milliseconds lag{ 0 };
+    };
+
     class service {
     public:
         virtual ~service() = default;
         virtual void run(int port = 1556) = 0;
         virtual void stop() = 0;
+        // could be called from any thread
+        virtual cache_stats stats() const = 0;
+        // zeroes if the hub is not a replica, could be called from any thread
+        virtual replication_stats replication() const = 0;
     };
 
-    service* create_service();
+    service* create_service(const service_config& config = {});
 
 }
\ No newline at end of file
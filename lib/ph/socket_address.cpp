@@ -0,0 +1,57 @@
+#include "socket_address.h"
+
+#include <cstring>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+namespace ph {
+
+    std::string local_address(int32_t descriptor) {
+        sockaddr_storage address{};
+        socklen_t size = sizeof(address);
+        if (getsockname(descriptor, (sockaddr*)&address, &size) != 0) {
+            return {};
+        }
+        const void* bytes = nullptr;
+        if (address.ss_family == AF_INET) {
+            bytes = &((const sockaddr_in*)&address)->sin_addr;
+        } else if (address.ss_family == AF_INET6) {
+            bytes = &((const sockaddr_in6*)&address)->sin6_addr;
+        } else {
+            return {};
+        }
+        char text[INET6_ADDRSTRLEN]{};
+        if (inet_ntop(address.ss_family, bytes, text, sizeof(text)) == nullptr) {
+            return {};
+        }
+        return text;
+    }
+
+    bool loopback_peer(int32_t descriptor) {
+        sockaddr_storage address{};
+        socklen_t size = sizeof(address);
+        if (getpeername(descriptor, (sockaddr*)&address, &size) != 0) {
+            return false;
+        }
+        if (address.ss_family == AF_INET) {
+            // 127.0.0.0/8
+            return (ntohl(((const sockaddr_in*)&address)->sin_addr.s_addr) >> 24) == 127;
+        }
+        if (address.ss_family == AF_INET6) {
+            const auto& ip = ((const sockaddr_in6*)&address)->sin6_addr;
+            static const uint8_t mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+            // ::1, or a v4 loopback address mapped to v6
+            return IN6_IS_ADDR_LOOPBACK(&ip) || (std::memcmp(ip.s6_addr, mapped, sizeof(mapped)) == 0 && ip.s6_addr[12] == 127);
+        }
+        return false;
+    }
+
+}
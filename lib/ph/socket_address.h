@@ -0,0 +1,23 @@
+/* Copyright (C) 2025 Gleb Bezborodov - All Rights Reserved
+* You may use, distribute and modify this code under the
+ * terms of the MIT license.
+ *
+ * You should have received a copy of the MIT license with
+ * this file. If not, please write to: bezborodoff.gleb@gmail.com, or visit : https://github.com/glensand/patch-hub
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace ph {
+
+    // descriptors of event loop connections are os sockets, these ask the os about their ends
+
+    // numeric address the connection was accepted on, empty if the os does not tell
+    std::string local_address(int32_t descriptor);
+    // the peer is on this host, connected over a loopback address
+    bool loopback_peer(int32_t descriptor);
+
+}
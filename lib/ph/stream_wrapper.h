@@ -9,17 +9,78 @@
 #pragma once
 
 #include "hope-io/net/event_loop.h"
+#include <algorithm>
+#include <cassert>
 #include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 namespace ph {
+
+    namespace protocol {
+        // 16 bit counts and string lengths, 32 bit file sizes, type byte goes first without any header
+        constexpr uint8_t legacy = 1;
+        // varint counts and string lengths, 64 bit file sizes
+        constexpr uint8_t wide = 2;
+        // patch headers carry content hash
+        constexpr uint8_t hashed = 3;
+        // payload chunks of patch streams end with crc32c of the payload part, patch hash is verified
+        constexpr uint8_t checked = 4;
+        // message header carries the largest chunk the sender is able to receive
+        constexpr uint8_t sized = 5;
+        // list requests may name the tags to list
+        constexpr uint8_t filtered = 6;
+        constexpr uint8_t current = filtered;
+        // set in the type byte by versioned peers, next byte holds the protocol version
+        constexpr uint8_t versioned_flag = 0x80;
+
+        constexpr uint64_t max_count(const uint8_t version) {
+            return version == legacy ? UINT16_MAX : UINT64_MAX;
+        }
+        constexpr uint64_t max_file_size(const uint8_t version) {
+            return version == legacy ? UINT32_MAX : UINT64_MAX;
+        }
+        constexpr std::size_t varint_size(uint64_t value) {
+            std::size_t size = 1;
+            while (value >= 0x80) {
+                value >>= 7;
+                ++size;
+            }
+            return size;
+        }
+        constexpr std::size_t count_size(const uint8_t version, const uint64_t value) {
+            return version == legacy ? sizeof(uint16_t) : varint_size(value);
+        }
+        constexpr std::size_t file_size_size(const uint8_t version) {
+            return version == legacy ? sizeof(uint32_t) : sizeof(uint64_t);
+        }
+        constexpr std::size_t string_size(const uint8_t version, const std::string& value) {
+            return count_size(version, value.size()) + value.size();
+        }
+    }
+
+    // piece of an outgoing chunk, either part of the buffer or memory referenced as is
+    struct chunk_segment final {
+        const void* data;
+        std::size_t size;
+    };
+
     struct event_loop_stream_wrapper final {
         enum class estate : uint8_t{
             read,
             write,
             none,
         };
+        // smaller pieces are cheaper to copy than to send separately
+        constexpr static std::size_t min_referenced = 16 * 1024;
+
         explicit event_loop_stream_wrapper(hope::io::event_loop::fixed_size_buffer& in_buffer)
             : buffer(in_buffer) { }
+        // outgoing chunk is described by segments, big payload pieces are not copied to the buffer,
+        // segments are valid until the buffer and the written data are
+        event_loop_stream_wrapper(hope::io::event_loop::fixed_size_buffer& in_buffer, std::vector<chunk_segment>& in_segments)
+            : segments(&in_segments), buffer(in_buffer) { }
 
         [[nodiscard]] bool is_ready_to_read() const {
             if (buffer.count() > sizeof(uint32_t)) {
@@ -32,8 +93,38 @@ namespace ph {
         void write(const void *data, std::size_t length) const {
             begin_write();
             buffer.write(data, length);
-            const auto used_chunk = buffer.used_chunk();
-            *(uint32_t*)used_chunk.first = (uint32_t)used_chunk.second;  // NOLINT(clang-diagnostic-cast-qual)
+        }
+        // payload which stays alive until the chunk is sent, referenced instead of copied if segments are gathered
+        void write_payload(const void* data, std::size_t length) const {
+            if (segments == nullptr || length < min_referenced) {
+                write(data, length);
+                return;
+            }
+            begin_write();
+            assert(length <= space());
+            flush_segment();
+            segments->push_back({ data, length });
+            referenced += length;
+        }
+        // lets producer fill free part of the chunk in place: fill(uint8_t* out, std::size_t size),
+        // returns count of bytes it has written
+        template<typename TFill>
+        std::size_t write_in_place(TFill&& fill) const {
+            begin_write();
+            const auto [dat, size] = buffer.free_chunk();
+            const std::size_t written = fill((uint8_t*)dat, std::min(size - referenced, space()));
+            buffer.handle_write(written);
+            return written;
+        }
+        // lets consumer take bytes of the chunk in place: consume(const uint8_t* data, std::size_t size),
+        // returns count of bytes it has taken
+        template<typename TConsume>
+        std::size_t read_in_place(TConsume&& consume) const {
+            begin_read();
+            const auto [dat, size] = buffer.used_chunk();
+            const std::size_t taken = consume((const uint8_t*)dat, size);
+            buffer.handle_read(taken);
+            return taken;
         }
         size_t read(void *data, std::size_t length) const {
             begin_read();
@@ -43,6 +134,80 @@ namespace ph {
 
         auto free_space() const noexcept { return buffer.free_space(); }
         auto count() const noexcept { return buffer.count(); }
+
+        // space left in the current outgoing chunk (frame header accounted)
+        std::size_t writable() const {
+            begin_write();
+            return space();
+        }
+        // largest chunk the buffer holds, frame header included
+        std::size_t capacity() const {
+            begin_write();
+            return buffer.free_space() + buffer.count();
+        }
+        // outgoing chunk is not larger than limit bytes, frame header included; zero means the whole buffer
+        void set_chunk_limit(const std::size_t in_limit) noexcept { limit = in_limit; }
+        // bytes left in the current incoming chunk (frame header accounted)
+        std::size_t readable() const {
+            begin_read();
+            return buffer.count();
+        }
+
+        // puts length of the outgoing chunk to its frame header, once the chunk is filled
+        void end_chunk() const {
+            if (state == estate::write) {
+                const auto used_chunk = buffer.used_chunk();
+                *(uint32_t*)used_chunk.first = uint32_t(used_chunk.second + referenced);  // NOLINT(clang-diagnostic-cast-qual)
+                if (segments != nullptr) {
+                    flush_segment();
+                }
+            }
+        }
+
+        void set_version(const uint8_t in_version) noexcept { version = in_version; }
+        uint8_t get_version() const noexcept { return version; }
+
+        // element counts and string lengths, encoding depends on protocol version
+        void write_count(uint64_t value) {
+            if (version == protocol::legacy) {
+                assert(value <= protocol::max_count(version));
+                write((uint16_t)value);
+            } else {
+                while (value >= 0x80) {
+                    write(uint8_t(value | 0x80));
+                    value >>= 7;
+                }
+                write(uint8_t(value));
+            }
+        }
+        uint64_t read_count() {
+            if (version == protocol::legacy) {
+                return read<uint16_t>();
+            }
+            uint64_t value = 0;
+            for (uint32_t shift = 0; shift < 64; shift += 7) {
+                const auto byte = read<uint8_t>();
+                value |= uint64_t(byte & 0x7f) << shift;
+                if ((byte & 0x80) == 0) {
+                    break;
+                }
+            }
+            return value;
+        }
+        void write_file_size(const uint64_t value) {
+            if (version == protocol::legacy) {
+                assert(value <= protocol::max_file_size(version));
+                write((uint32_t)value);
+            } else {
+                write(value);
+            }
+        }
+        uint64_t read_file_size() {
+            if (version == protocol::legacy) {
+                return read<uint32_t>();
+            }
+            return read<uint64_t>();
+        }
         template<typename TValue>
         void write(const TValue &val) {
             static_assert(std::is_trivial_v<std::decay_t<TValue>>,
@@ -66,11 +231,32 @@ namespace ph {
         void begin_write() const {
             if (state != estate::write) {
                 buffer.reset();
+                referenced = 0;
+                flushed = 0;
+                if (segments != nullptr) {
+                    segments->clear();
+                }
                 // seek buffer to 4 bytes, for event-loop it is important to know count of bytes we'll receive at this stage
                 buffer.handle_write(sizeof(uint32_t));
             }
             state = estate::write;
         }
+        std::size_t space() const {
+            const auto used = buffer.count() + referenced;
+            const auto free = buffer.free_space() - referenced;
+            if (limit == 0) {
+                return free;
+            }
+            return limit > used ? std::min(limit - used, free) : 0;
+        }
+        // buffer bytes written since the last segment
+        void flush_segment() const {
+            const auto used_chunk = buffer.used_chunk();
+            if (used_chunk.second > flushed) {
+                segments->push_back({ (const uint8_t*)used_chunk.first + flushed, used_chunk.second - flushed });
+                flushed = used_chunk.second;
+            }
+        }
         void begin_read() const {
             if (state != estate::read) {
                 // skip first 4 bytes, belongs to loop wrapper
@@ -79,12 +265,22 @@ namespace ph {
             state = estate::read;
         }
         mutable estate state = estate::none;
+        uint8_t version = protocol::legacy;
+        std::vector<chunk_segment>* segments{ nullptr };
+        // payload bytes of the chunk which are not in the buffer
+        mutable std::size_t referenced{ 0 };
+        mutable std::size_t flushed{ 0 };
+        std::size_t limit{ 0 };
         hope::io::event_loop::fixed_size_buffer& buffer;  // NOLINT(cppcoreguidelines-avoid-const-or-ref-data-members)
     };
 
     template <>
     inline void event_loop_stream_wrapper::read<std::string>(std::string& val) {
-        const auto size = read<uint16_t>();
+        const auto size = read_count();
+        // strings never span chunks, a longer one comes from a damaged or hostile peer
+        if (size > readable()) {
+            throw std::runtime_error("String is longer than the chunk");
+        }
         if (size > 0) {
             val.resize(size);
             read(val.data(), size);
@@ -92,7 +288,7 @@ namespace ph {
     }
     template <>
     inline void event_loop_stream_wrapper::write<std::string>(const std::string& val) {
-        write((uint16_t)val.size());
+        write_count(val.size());
         write(val.c_str(), val.size());
     }
 }
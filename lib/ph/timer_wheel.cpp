@@ -0,0 +1,94 @@
+#include "timer_wheel.h"
+
+void ph::timer_wheel::arm(uint32_t id, uint64_t tick) {
+    if (id >= m_nodes.size()) {
+        m_nodes.resize(id + 1);
+    }
+    if (m_nodes[id].slot != none) {
+        unlink(id);
+    } else {
+        ++m_size;
+    }
+    // current slot is already handled
+    m_nodes[id].tick = tick > m_now ? tick : m_now + 1;
+    place(id);
+}
+
+void ph::timer_wheel::disarm(uint32_t id) {
+    if (armed(id)) {
+        unlink(id);
+        --m_size;
+    }
+}
+
+void ph::timer_wheel::advance(uint64_t tick, std::vector<uint32_t>& fired) {
+    while (m_now < tick) {
+        if (m_size == 0) {
+            m_now = tick;
+            break;
+        }
+        ++m_now;
+        // upper levels first, what they spill may land in lower slots turning at the same tick
+        for (auto level = levels - 1; level > 0; --level) {
+            const auto shift = level * bits;
+            if ((m_now & ((uint64_t(1) << shift) - 1)) == 0) {
+                cascade(uint16_t(level * slots + ((m_now >> shift) & (slots - 1))));
+            }
+        }
+        auto& head = m_heads[m_now & (slots - 1)];
+        while (head != nil) {
+            const auto id = uint32_t(head);
+            unlink(id);
+            --m_size;
+            fired.push_back(id);
+        }
+    }
+}
+
+void ph::timer_wheel::place(uint32_t id) {
+    auto& n = m_nodes[id];
+    // level of the highest 6 bit group in which the tick differs from now,
+    // the slot turns when now reaches the tick in that group
+    const auto diff = n.tick ^ m_now;
+    uint32_t level = 0;
+    while (level < levels && (diff >> ((level + 1) * bits)) != 0) {
+        ++level;
+    }
+    if (level == levels) {
+        // beyond the range, the first slot of the last level turns when the range rolls over
+        n.slot = uint16_t((levels - 1) * slots);
+    } else {
+        n.slot = uint16_t(level * slots + ((n.tick >> (level * bits)) & (slots - 1)));
+    }
+    n.prev = nil;
+    n.next = m_heads[n.slot];
+    if (n.next != nil) {
+        m_nodes[n.next].prev = int32_t(id);
+    }
+    m_heads[n.slot] = int32_t(id);
+}
+
+void ph::timer_wheel::unlink(uint32_t id) {
+    auto& n = m_nodes[id];
+    if (n.prev != nil) {
+        m_nodes[n.prev].next = n.next;
+    } else {
+        m_heads[n.slot] = n.next;
+    }
+    if (n.next != nil) {
+        m_nodes[n.next].prev = n.prev;
+    }
+    n.prev = n.next = nil;
+    n.slot = none;
+}
+
+void ph::timer_wheel::cascade(uint16_t slot) {
+    auto id = m_heads[slot];
+    m_heads[slot] = nil;
+    while (id != nil) {
+        const auto next = m_nodes[id].next;
+        m_nodes[id].prev = m_nodes[id].next = nil;
+        place(uint32_t(id));
+        id = next;
+    }
+}
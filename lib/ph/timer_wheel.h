@@ -0,0 +1,67 @@
+/* Copyright (C) 2025 Gleb Bezborodov - All Rights Reserved
+* You may use, distribute and modify this code under the
+ * terms of the MIT license.
+ *
+ * You should have received a copy of the MIT license with
+ * this file. If not, please write to: bezborodoff.gleb@gmail.com, or visit : https://github.com/glensand/patch-hub
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ph {
+
+    // hierarchical timing wheel over abstract ticks, timers are keyed by small ids (descriptors).
+    // Four levels of 64 slots cover 2^24 ticks, farther timers are placed again when the last level turns.
+    // Arming and disarming are O(1), a timer is moved at most once per level. Not thread safe
+    class timer_wheel final {
+    public:
+        // timer of the id fires at the tick or a bit later if the wheel is advanced in steps,
+        // armed timer is moved to the new tick; past ticks fire on the next advance
+        void arm(uint32_t id, uint64_t tick);
+        void disarm(uint32_t id);
+        bool armed(uint32_t id) const { return id < m_nodes.size() && m_nodes[id].slot != none; }
+
+        // ids of expired timers are appended in order of expiry, they are disarmed
+        void advance(uint64_t tick, std::vector<uint32_t>& fired);
+
+        uint64_t now() const { return m_now; }
+        std::size_t size() const { return m_size; }
+
+    private:
+        constexpr static uint32_t bits = 6;
+        constexpr static uint32_t slots = 1u << bits;
+        constexpr static uint32_t levels = 4;
+        constexpr static int32_t nil = -1;
+        constexpr static uint16_t none = UINT16_MAX;
+
+        struct node final {
+            uint64_t tick{ 0 };
+            int32_t prev{ nil };
+            int32_t next{ nil };
+            // level * slots + slot
+            uint16_t slot{ none };
+        };
+
+        void place(uint32_t id);
+        void unlink(uint32_t id);
+        // timers of the slot are placed again against current tick
+        void cascade(uint16_t slot);
+
+        std::vector<node> m_nodes;
+        std::array<int32_t, levels * slots> m_heads = make_heads();
+        uint64_t m_now{ 0 };
+        std::size_t m_size{ 0 };
+
+        static std::array<int32_t, levels * slots> make_heads() {
+            std::array<int32_t, levels * slots> heads;
+            heads.fill(nil);
+            return heads;
+        }
+    };
+
+}
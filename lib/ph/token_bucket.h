@@ -0,0 +1,62 @@
+/* Copyright (C) 2025 Gleb Bezborodov - All Rights Reserved
+* You may use, distribute and modify this code under the
+ * terms of the MIT license.
+ *
+ * You should have received a copy of the MIT license with
+ * this file. If not, please write to: bezborodoff.gleb@gmail.com, or visit : https://github.com/glensand/patch-hub
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+namespace ph {
+
+    // bytes per second, refilled lazily when asked; a chunk may take more than is left,
+    // the debt is paid by waiting. Zero rate means no limit
+    class token_bucket final {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        token_bucket() = default;
+        token_bucket(uint64_t rate, uint64_t burst, clock::time_point now = clock::now())
+            : m_rate(rate), m_burst(int64_t(std::max(rate == 0 ? 0 : burst, uint64_t(1))))
+            , m_tokens(m_burst), m_last(now) { }
+
+        bool limited() const { return m_rate != 0; }
+
+        // bytes which could go now
+        uint64_t available(clock::time_point now) {
+            if (!limited()) {
+                return UINT64_MAX;
+            }
+            const auto missing = m_burst - m_tokens;
+            if (missing > 0) {
+                const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - m_last).count();
+                // long pause just fills the bucket, so the product below does not overflow
+                const auto added = elapsed > missing * 1000000 / int64_t(m_rate)
+                    ? missing : int64_t(m_rate) * elapsed / 1000000;
+                if (added > 0) {
+                    m_tokens += added;
+                    m_last = now;
+                }
+            } else {
+                m_last = now;
+            }
+            return m_tokens > 0 ? uint64_t(m_tokens) : 0;
+        }
+
+        void consume(uint64_t bytes) {
+            m_tokens -= int64_t(bytes);
+        }
+
+    private:
+        uint64_t m_rate{ 0 };
+        int64_t m_burst{ 0 };
+        int64_t m_tokens{ 0 };
+        clock::time_point m_last;
+    };
+
+}
@@ -1,5 +1,7 @@
 #include <csignal>
 #include <functional>
+#include <sstream>
+#include <string>
 
 #include "ph/service.h"
 
@@ -25,8 +27,49 @@ int main(int argc, char* argv[]) {
     if (argc > 1) {
 	    //port = std::stoi(argv[1]);
     }
+    ph::service_config config;
+    if (argc > 2) {
+        // megabytes of patch payload kept in memory
+        config.memory_budget = std::stoull(argv[2]) * 1024 * 1024;
+    }
+    if (argc > 3) {
+        // comma separated platform:keep_last[:max_age_hours], '*' platform applies to the others
+        std::stringstream rules(argv[3]);
+        std::string rule;
+        while (std::getline(rules, rule, ',')) {
+            std::stringstream fields(rule);
+            std::string platform, keep_last, max_age;
+            std::getline(fields, platform, ':');
+            std::getline(fields, keep_last, ':');
+            std::getline(fields, max_age, ':');
+            auto& r = config.retention.emplace_back();
+            r.platform = platform == "*" ? "" : platform;
+            r.keep_last = keep_last.empty() ? 0 : std::stoul(keep_last);
+            r.max_age = std::chrono::hours(max_age.empty() ? 0 : std::stoul(max_age));
+        }
+    }
+    // host[:port] of another hub
+    const auto endpoint = [](const std::string& address, std::string& host, int& port) {
+        const auto colon = address.rfind(':');
+        host = address.substr(0, colon);
+        if (colon != std::string::npos) {
+            port = std::stoi(address.substr(colon + 1));
+        }
+    };
+    if (argc > 4 && argv[4][0] != '\0') {
+        // upstream hub, missing tags are fetched from it
+        endpoint(argv[4], config.upstream_host, config.upstream_port);
+    }
+    if (argc > 5 && argv[5][0] != '\0') {
+        // primary hub, the hub is its read only replica
+        endpoint(argv[5], config.primary_host, config.primary_port);
+    }
+    if (argc > 6) {
+        // clients on this host hand files inside it over by path
+        config.local_dir = argv[6];
+    }
 
-    auto serv = ph::create_service();
+    auto serv = ph::create_service(config);
     glob_handler = [serv] {
         serv->stop();
     };
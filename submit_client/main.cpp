@@ -1,68 +1,121 @@
+#include <algorithm>
+#include <atomic>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <thread>
+#include <unordered_set>
 
 #include "ph/client.h"
 #include "consolelib/disco.h"
 #include "hope-io/net/init.h"
 #include "ph/service.h"
 
-char* load_file(const std::string& filename, uint32_t& size);
-
 int main(int argc, char *argv[]) {
     if (argc < 4) {
-        std::cout << "Usage:ip tag_prefix path\n";
+        std::cout << "Usage:ip tag_prefix path [port] [connections] [reader_threads]\n";
         return -1;
     }
     std::string ip = argv[1];
     std::string tag = argv[2];
     std::string path = argv[3];
     int port = 1556;
-    if (argc > 5) {
+    if (argc > 4) {
         port = std::stoi(argv[4]);
     }
+    std::size_t connections = 1;
+    if (argc > 5) {
+        connections = std::max(std::stoi(argv[5]), 1);
+    }
+    std::size_t reader_threads = connections;
+    if (argc > 6) {
+        reader_threads = std::max(std::stoi(argv[6]), 1);
+    }
 
     hope::io::init();
 
-    auto client = ph::client::create(ip, 1556);
     ph::client::plist_t plist;
     for (const auto& entry : std::filesystem::directory_iterator(path)) {
         if (entry.is_regular_file()) {
             auto p = std::make_shared<ph::patch>();
             p->name = "PH_Redist_" + entry.path().filename().string();
             p->tag = tag;
-            p->data = (uint8_t*)load_file(entry.path().string(), p->file_size);
-            if (p->data == nullptr) {
+            p->source = ph::create_file_source(entry.path().string());
+            if (p->source == nullptr) {
                 std::cout << "Cannot load file[" << entry.path().string() << "]\n";
             }
             else {
+                p->file_size = p->source->size();
                 plist.push_back(std::move(p));
                 std::cout << entry.path().string() << "\n";
             }
         }
     }
 
-    const auto uploaded = client->upload(plist);
-    std::cout << "Uploaded patches:\n";
-    for (const auto& p : uploaded) {
-        p->print();
+    // biggest files first, each one goes to the least loaded connection
+    std::sort(begin(plist), end(plist), [](const auto& l, const auto& r) {
+        return l->file_size > r->file_size;
+    });
+    std::vector<ph::client::plist_t> shares(std::min(connections, std::max<std::size_t>(plist.size(), 1)));
+    std::vector<uint64_t> share_size(shares.size());
+    for (auto& p : plist) {
+        const auto share = std::min_element(begin(share_size), end(share_size)) - begin(share_size);
+        share_size[share] += p->file_size;
+        shares[share].push_back(std::move(p));
     }
 
-    return 0;
-}
-
-char* load_file(const std::string& filename, uint32_t& size) {
-    std::ifstream file(filename, std::ios::binary | std::ios::ate);
-    if (!file) return nullptr;
-
-    size = file.tellg();
-    file.seekg(0, std::ios::beg);
+    // the hub links content by hash and size, so only files of a size it already holds are worth hashing
+    // up front; the rest is read once, while it is sent
+    std::unordered_set<uint64_t> held_sizes;
+    try {
+        const auto client = std::unique_ptr<ph::client>(ph::client::create(ip, port));
+        for (const auto& p : client->list()) {
+            held_sizes.insert(p->file_size);
+        }
+    } catch (const std::exception& ex) {
+        std::cout << "Cannot list patches of the hub, everything is uploaded: " << ex.what() << '\n';
+    }
 
-    char* buffer = new char[size];
-    if (!file.read(buffer, size)) {
-        delete[] buffer;
-        return nullptr;
+    // disk reads of the next block run on the pool while the current one is being sent
+    ph::reader_pool pool(reader_threads);
+    std::mutex output_mutex;
+    std::atomic_bool failed = false;
+    std::vector<std::thread> uploaders;
+    for (auto& share : shares) {
+        uploaders.emplace_back([&, share = std::move(share)]() mutable {
+            for (auto& p : share) {
+                p->source = ph::create_prefetch_source(std::move(p->source), pool);
+            }
+            ph::client::plist_t offered;
+            ph::client::plist_t sent;
+            for (auto& p : share) {
+                (held_sizes.count(p->file_size) != 0 ? offered : sent).push_back(std::move(p));
+            }
+            try {
+                const auto client = std::unique_ptr<ph::client>(ph::client::create(ip, port));
+                auto uploaded = sent.empty() ? ph::client::plist_t{} : client->upload(sent);
+                if (!offered.empty()) {
+                    // content the hub already has is linked there, only changed files travel
+                    auto changed = client->upload_changed(offered);
+                    uploaded.insert(end(uploaded), begin(changed), end(changed));
+                }
+                std::lock_guard lock(output_mutex);
+                std::cout << "Uploaded patches:\n";
+                for (const auto& p : uploaded) {
+                    p->print();
+                }
+            } catch (const std::exception& ex) {
+                failed = true;
+                std::lock_guard lock(output_mutex);
+                std::cout << "An exception occurred: " << ex.what() << '\n';
+            }
+        });
+    }
+    for (auto& t : uploaders) {
+        t.join();
     }
-    return buffer;
+
+    return failed ? -1 : 0;
 }
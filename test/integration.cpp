@@ -1,9 +1,16 @@
 #include "ph/service.h"
 #include "ph/client.h"
 #include "ph/message.h"
+#include "ph/hash_ring.h"
+#include "hope-io/net/factory.h"
+#include <algorithm>
+#include <atomic>
 #include <thread>
 #include <unordered_set>
 #include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <vector>
 
 // uploaded patches
 ph::client::plist_t list;
@@ -33,6 +40,26 @@ void run_list(int port = 1555) {
         }
         assert(found);
     }
+    const auto& tag = list.front()->tag;
+    const auto expected = std::count_if(begin(list), end(list), [&tag](const auto& p) { return p->tag == tag; });
+    const auto tagged = client->list({ tag });
+    assert((std::ptrdiff_t)tagged.size() == expected);
+    for (const auto& p : tagged) {
+        assert(p->tag == tag);
+    }
+}
+
+void run_legacy_list(int port = 1555) {
+    std::cout << "// ----------- List patches with legacy protocol // -----------\n";
+    auto client = ph::client::create("localhost", port, ph::protocol::legacy);
+    const auto plist = client->list();
+    assert(plist.size() == list.size());
+    // the hub does not get the tags and lists everything, the client keeps the asked ones
+    const auto& tag = list.front()->tag;
+    for (const auto& p : client->list({ tag })) {
+        assert(p->tag == tag);
+    }
+    delete client;
 }
 
 void run_download(int port = 1555) {
@@ -61,6 +88,94 @@ void run_download(int port = 1555) {
     }
 }
 
+void run_batch_download(int port = 1555) {
+    std::cout << "// ----------- Batch download patches // -----------" << std::endl;
+    auto client = ph::client::create("localhost", port);
+    std::vector<std::string> tags;
+    for (const auto& p : list) {
+        tags.emplace_back(p->tag);
+    }
+    const auto downloaded = client->download_batch(tags);
+    assert(downloaded.size() == list.size());
+    for (const auto& p : downloaded) {
+        bool found = false;
+        for (const auto& gp : list) {
+            if (p->name == gp->name && p->tag == gp->tag) {
+                found = true;
+                assert(p->file_size == gp->file_size);
+                assert(std::memcmp(p->data, gp->data, p->file_size) == 0);
+            }
+        }
+        assert(found);
+    }
+    delete client;
+}
+
+void run_sync(int port = 1555) {
+    std::cout << "// ----------- Sync patches // -----------" << std::endl;
+    auto client = ph::client::create("localhost", port);
+    auto local_copy = [](const std::shared_ptr<ph::patch>& gp, uint64_t hash) {
+        auto p = std::make_shared<ph::patch>();
+        p->name = gp->name;
+        p->tag = gp->tag;
+        p->file_size = gp->file_size;
+        p->hash = hash;
+        return p;
+    };
+    // up to date locally
+    const auto& actual = list[0];
+    const auto actual_hash = ph::hasher::hash(actual->data, actual->file_size);
+    auto downloaded = client->sync(actual->tag, { local_copy(actual, actual_hash) }, {});
+    assert(downloaded.empty());
+    // damaged locally
+    const auto& damaged = list[1];
+    downloaded = client->sync(damaged->tag, { local_copy(damaged, 0) }, {});
+    assert(downloaded.size() == 1);
+    assert(downloaded[0]->hash == ph::hasher::hash(damaged->data, damaged->file_size));
+    assert(std::memcmp(downloaded[0]->data, damaged->data, damaged->file_size) == 0);
+    // missing locally
+    downloaded = client->sync(damaged->tag, {}, {});
+    assert(downloaded.size() == 1);
+    delete client;
+}
+
+void run_upload_changed(int port = 1555) {
+    std::cout << "// ----------- Upload changed patches // -----------" << std::endl;
+    auto client = ph::client::create("localhost", port);
+    // next revision: the first patch has new content, others are the same
+    const std::string tag = "random_platform_next";
+    std::vector<uint8_t> changed(list[0]->file_size, 42);
+    ph::client::plist_t next;
+    for (const auto& gp : list) {
+        auto p = std::make_shared<ph::patch>();
+        p->name = gp->name;
+        p->tag = tag;
+        p->file_size = gp->file_size;
+        p->data = next.empty() ? changed.data() : gp->data;
+        next.push_back(std::move(p));
+    }
+    const auto uploaded = client->upload_changed(next);
+    assert(uploaded.size() == next.size());
+    const auto downloaded = client->download(tag);
+    assert(downloaded.size() == next.size());
+    for (const auto& p : downloaded) {
+        bool found = false;
+        for (const auto& np : next) {
+            if (p->name == np->name) {
+                found = true;
+                assert(p->file_size == np->file_size);
+                assert(std::memcmp(p->data, np->data, p->file_size) == 0);
+            }
+        }
+        assert(found);
+    }
+    for (auto& p : next) {
+        p->data = nullptr;
+    }
+    assert(client->pdelete(tag).size() == next.size());
+    delete client;
+}
+
 void run_delete(int port = 1555) {
     std::cout << "// ----------- Delete patches // -----------" << std::endl;
     auto client = ph::client::create("localhost", port);
@@ -104,11 +219,815 @@ void run_cache() {
     delete sv;
 }
 
+void run_memory_budget() {
+    std::cout << "// ----------- Run memory budget test // -----------" << std::endl;
+    // patches uploaded by cache test are restored, only some of them fit
+    ph::service_config config;
+    config.memory_budget = 96 * 1024;
+    ph::service* sv = nullptr;
+    std::thread servicet([&] {
+        sv = ph::create_service(config);
+        sv->run(1558);
+    });
+    while (!sv) { std::this_thread::yield(); }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    assert(sv->stats().resident_bytes <= config.memory_budget);
+    // cold patches are served from disk and loaded in background, then hot ones get evicted
+    for (auto i = 0; i < 3; ++i) {
+        run_download(1558);
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    }
+    const auto stats = sv->stats();
+    assert(stats.hits + stats.misses == 3 * list.size());
+    assert(stats.misses > 0);
+    assert(stats.resident_bytes <= config.memory_budget);
+    // repeated downloads share disk blocks: a patch is read once to be served and once more to be loaded
+    // if it could ever fit in memory
+    uint64_t expected = 0;
+    for (const auto& p : list) {
+        expected += p->file_size <= config.memory_budget / 2 ? 2 * p->file_size : p->file_size;
+    }
+    assert(stats.disk_bytes > 0 && stats.disk_bytes <= expected);
+    sv->stop();
+    servicet.join();
+    delete sv;
+}
+
+void run_retention() {
+    std::cout << "// ----------- Run retention test // -----------" << std::endl;
+    ph::service_config config;
+    auto& rule = config.retention.emplace_back();
+    rule.platform = "gc_platform";
+    rule.keep_last = 1;
+    config.gc_interval = std::chrono::seconds(1);
+    config.gc_batch = 1;
+    ph::service* sv = nullptr;
+    std::thread servicet([&] {
+        sv = ph::create_service(config);
+        sv->run(1559);
+    });
+    while (!sv) { std::this_thread::yield(); }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    auto client = ph::client::create("localhost", 1559);
+    ph::client::plist_t revisions;
+    for (auto i = 1; i <= 3; ++i) {
+        auto p = std::make_shared<ph::patch>();
+        p->name = "gc_patch";
+        p->tag = "gc_platform_" + std::to_string(i);
+        p->file_size = list.front()->file_size;
+        p->data = list.front()->data;
+        revisions.emplace_back(std::move(p));
+    }
+    client->upload(revisions);
+    // one tag per pass, collection is applied on the next request
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    client->list();
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    const auto plist = client->list();
+    std::unordered_set<std::string> tags;
+    for (const auto& p : plist) {
+        tags.emplace(p->tag);
+    }
+    assert(tags.count("gc_platform_3") == 1);
+    assert(tags.count("gc_platform_2") == 0);
+    assert(tags.count("gc_platform_1") == 0);
+    // tags of other platforms are not touched
+    assert(tags.count(list.front()->tag) == 1);
+    client->pdelete("gc_platform_3");
+    delete client;
+    sv->stop();
+    servicet.join();
+    // io queue is flushed on destruction
+    delete sv;
+    assert(!std::filesystem::exists("cache/gc_platform_1"));
+    for (auto& p : revisions) {
+        p->data = nullptr;
+    }
+}
+
+void run_admission() {
+    std::cout << "// ----------- Run admission test // -----------" << std::endl;
+    // one transfer at a time and room for about one upload, the rest waits its turn
+    ph::service_config config;
+    config.max_transfers = 1;
+    config.max_upload_bytes = 96 * 1024;
+    config.max_request_bytes = 256 * 1024;
+    ph::service* sv = nullptr;
+    std::thread servicet([&] {
+        sv = ph::create_service(config);
+        sv->run(1560);
+    });
+    while (!sv) { std::this_thread::yield(); }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    constexpr static auto uploaders = 4;
+    std::vector<ph::client::plist_t> uploads(uploaders);
+    std::vector<std::thread> clients;
+    for (auto i = 0; i < uploaders; ++i) {
+        for (auto j = 0; j < 2; ++j) {
+            auto p = std::make_shared<ph::patch>();
+            p->name = "admission_patch" + std::to_string(j);
+            p->tag = "admission_platform_" + std::to_string(i);
+            p->file_size = list[j]->file_size;
+            p->data = list[j]->data;
+            uploads[i].emplace_back(std::move(p));
+        }
+        clients.emplace_back([&, i] {
+            auto client = ph::client::create("localhost", 1560);
+            const auto uploaded = client->upload(uploads[i]);
+            assert(uploaded.size() == uploads[i].size());
+            delete client;
+        });
+    }
+    // small requests are served while transfers wait
+    for (auto i = 0; i < 2; ++i) {
+        clients.emplace_back([] {
+            auto client = ph::client::create("localhost", 1560);
+            const auto downloaded = client->download(list.front()->tag);
+            assert(downloaded.size() == 1);
+            client->list();
+            delete client;
+        });
+    }
+    for (auto& t : clients) {
+        t.join();
+    }
+
+    auto client = ph::client::create("localhost", 1560);
+    for (auto i = 0; i < uploaders; ++i) {
+        const auto tag = "admission_platform_" + std::to_string(i);
+        const auto downloaded = client->download(tag);
+        assert(downloaded.size() == 2);
+        for (const auto& p : downloaded) {
+            assert(p->file_size == list[p->name.back() - '0']->file_size);
+        }
+        client->pdelete(tag);
+    }
+    delete client;
+    sv->stop();
+    servicet.join();
+    delete sv;
+    for (auto& upload : uploads) {
+        for (auto& p : upload) {
+            p->data = nullptr;
+        }
+    }
+}
+
+void run_reaping() {
+    std::cout << "// ----------- Run reaping test // -----------" << std::endl;
+    ph::service_config config;
+    config.header_timeout = std::chrono::milliseconds(300);
+    config.idle_timeout = std::chrono::milliseconds(600);
+    ph::service* sv = nullptr;
+    std::thread servicet([&] {
+        sv = ph::create_service(config);
+        sv->run(1561);
+    });
+    while (!sv) { std::this_thread::yield(); }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    // one never sends a request, another stalls in the middle of an upload chunk
+    std::unique_ptr<hope::io::stream> silent(hope::io::create_stream());
+    silent->connect("localhost", 1561);
+    std::unique_ptr<hope::io::stream> stalled(hope::io::create_stream());
+    stalled->connect("localhost", 1561);
+    stalled->write(uint32_t(1024));
+    stalled->write(uint8_t(ph::message::etype::upload_patch));
+    // nothing else goes on at the hub, deadlines are checked on its own ticks
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    for (auto* stream : { silent.get(), stalled.get() }) {
+        auto closed = false;
+        try {
+            stream->read<uint8_t>();
+        } catch (const std::exception&) {
+            closed = true;
+        }
+        assert(closed);
+    }
+    sv->stop();
+    servicet.join();
+    delete sv;
+}
+
+void run_scheduling() {
+    std::cout << "// ----------- Run scheduling test // -----------" << std::endl;
+    ph::service_config config;
+    config.connection_rate = 128 * 1024;
+    ph::service* sv = nullptr;
+    std::thread servicet([&] {
+        sv = ph::create_service(config);
+        sv->run(1562);
+    });
+    while (!sv) { std::this_thread::yield(); }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    ph::client::plist_t patches;
+    uint64_t total = 0;
+    for (auto i = 0; i < 8; ++i) {
+        auto p = std::make_shared<ph::patch>();
+        p->name = "sched_patch" + std::to_string(i);
+        p->tag = "sched_platform";
+        p->file_size = list[i % list.size()]->file_size;
+        p->data = list[i % list.size()]->data;
+        total += p->file_size;
+        patches.emplace_back(std::move(p));
+    }
+    auto client = ph::client::create("localhost", 1562);
+    client->upload(patches);
+
+    std::atomic_bool downloaded{ false };
+    double download_seconds = 0;
+    std::thread download([&] {
+        auto downloader = ph::client::create("localhost", 1562);
+        const auto start = std::chrono::steady_clock::now();
+        assert(downloader->download("sched_platform").size() == patches.size());
+        download_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        downloaded = true;
+        delete downloader;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    // small request is not stuck behind the throttled download
+    assert(client->list().size() > patches.size());
+    assert(!downloaded);
+    download.join();
+    // a second of burst, the rest goes at the rate
+    assert(download_seconds >= 0.8 * double(total - config.connection_rate) / config.connection_rate);
+
+    client->pdelete("sched_platform");
+    delete client;
+    sv->stop();
+    servicet.join();
+    delete sv;
+    for (auto& p : patches) {
+        p->data = nullptr;
+    }
+}
+
+void run_subscribe() {
+    std::cout << "// ----------- Run subscribe test // -----------" << std::endl;
+    ph::service* sv = nullptr;
+    std::thread servicet([&] {
+        sv = ph::create_service();
+        sv->run(1563);
+    });
+    while (!sv) { std::this_thread::yield(); }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    auto client = ph::client::create("localhost", 1563);
+    // restored patches are no news, nothing is waited for without timeout
+    const auto start = client->subscribe("sub_", 0, std::chrono::milliseconds(0));
+    assert(!start.missed && start.tags.empty());
+
+    const auto upload = [&](const std::string& tag) {
+        auto p = std::make_shared<ph::patch>();
+        p->name = "sub_patch";
+        p->tag = tag;
+        p->file_size = list.front()->file_size;
+        p->data = list.front()->data;
+        client->upload({ p });
+        p->data = nullptr;
+    };
+    ph::client::changes got;
+    std::atomic_bool answered{ false };
+    std::thread subscriber([&] {
+        auto waiting = ph::client::create("localhost", 1563);
+        got = waiting->subscribe("sub_", start.sequence, std::chrono::seconds(30));
+        answered = true;
+        delete waiting;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    // other prefix does not wake it
+    upload("other_platform_1");
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    assert(!answered);
+    upload("sub_platform_1");
+    subscriber.join();
+    assert(!got.missed && got.tags == std::vector<std::string>{ "sub_platform_1" });
+    assert(got.sequence > start.sequence);
+
+    // changes after the sequence are answered right away, delete is a change as well
+    client->pdelete("sub_platform_1");
+    client->pdelete("other_platform_1");
+    const auto deleted = client->subscribe("sub_", got.sequence, std::chrono::seconds(30));
+    assert(deleted.tags == std::vector<std::string>{ "sub_platform_1" });
+    // sequence the hub never gave out, e.g. before its restart
+    assert(client->subscribe("", deleted.sequence + 100, std::chrono::seconds(30)).missed);
+
+    // nothing changes, the subscription is answered with nothing after its timeout,
+    // nothing else goes on at the hub meanwhile
+    const auto waited_from = std::chrono::steady_clock::now();
+    const auto none = client->subscribe("sub_", deleted.sequence, std::chrono::milliseconds(300));
+    const auto waited = std::chrono::steady_clock::now() - waited_from;
+    assert(!none.missed && none.tags.empty() && none.sequence == deleted.sequence);
+    assert(waited >= std::chrono::milliseconds(300) && waited < std::chrono::seconds(5));
+
+    delete client;
+    sv->stop();
+    servicet.join();
+    delete sv;
+}
+
+void run_proxy() {
+    std::cout << "// ----------- Run proxy test // -----------" << std::endl;
+    std::filesystem::remove_all("cache_edge");
+    ph::service* upstream = nullptr;
+    std::thread upstreamt([&] {
+        upstream = ph::create_service();
+        upstream->run(1564);
+    });
+    // the edge keeps what it fetched in a cache of its own
+    ph::service_config edge_config;
+    edge_config.upstream_host = "localhost";
+    edge_config.upstream_port = 1564;
+    edge_config.cache_dir = "cache_edge/";
+    ph::service* edge = nullptr;
+    std::thread edget([&] {
+        edge = ph::create_service(edge_config);
+        edge->run(1565);
+    });
+    while (!upstream || !edge) { std::this_thread::yield(); }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    auto origin = ph::client::create("localhost", 1564);
+    ph::client::plist_t uploaded;
+    for (auto i = 0; i < 3; ++i) {
+        auto p = std::make_shared<ph::patch>();
+        p->name = "edge_patch" + std::to_string(i);
+        p->tag = "edge_platform_1";
+        p->file_size = list[i]->file_size;
+        p->data = list[i]->data;
+        uploaded.push_back(p);
+    }
+    // large enough to reach the waiting gets in many chunks while it is still being fetched
+    std::vector<uint8_t> large(3 * 1024 * 1024 + 5);
+    for (std::size_t i = 0; i < large.size(); ++i) {
+        large[i] = uint8_t(i * 7 + i / 4096);
+    }
+    auto big = std::make_shared<ph::patch>();
+    // named like a partial file, which it is not, the edge restores it after restart
+    big->name = "edge_patch_large.part";
+    big->tag = "edge_platform_1";
+    big->file_size = large.size();
+    big->data = large.data();
+    uploaded.push_back(big);
+    origin->upload(uploaded);
+
+    const auto check = [&](const ph::client::plist_t& got) {
+        assert(got.size() == uploaded.size());
+        for (const auto& p : got) {
+            const auto it = std::find_if(begin(uploaded), end(uploaded), [&p](const auto& u) { return u->name == p->name; });
+            assert(it != end(uploaded) && (*it)->file_size == p->file_size);
+            assert(std::memcmp((*it)->data, p->data, p->file_size) == 0);
+        }
+    };
+    // misses of the same tag wait for one fetch
+    std::vector<std::thread> readers;
+    for (auto i = 0; i < 3; ++i) {
+        readers.emplace_back([&] {
+            auto reader = ph::client::create("localhost", 1565);
+            check(reader->download("edge_platform_1"));
+            delete reader;
+        });
+    }
+    for (auto& t : readers) {
+        t.join();
+    }
+    auto client = ph::client::create("localhost", 1565);
+    // tag the upstream does not have either
+    assert(client->download("edge_platform_missing").empty());
+
+    // gone upstream, the edge keeps its copy
+    origin->pdelete("edge_platform_1");
+    upstream->stop();
+    upstreamt.join();
+    // served from the edge now
+    check(client->download("edge_platform_1"));
+    assert(client->download("edge_platform_2").empty());
+    delete client;
+
+    // and from what the edge stored, the upstream is still away
+    edge->stop();
+    edget.join();
+    delete edge;
+    edge = nullptr;
+    edget = std::thread([&] {
+        edge = ph::create_service(edge_config);
+        edge->run(1565);
+    });
+    while (!edge) { std::this_thread::yield(); }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    client = ph::client::create("localhost", 1565);
+    check(client->download("edge_platform_1"));
+    client->pdelete("edge_platform_1");
+
+    for (auto& p : uploaded) {
+        p->data = nullptr;
+    }
+    delete origin;
+    delete client;
+    edge->stop();
+    edget.join();
+    delete edge;
+    delete upstream;
+    std::filesystem::remove_all("cache_edge");
+}
+
+void run_replication() {
+    std::cout << "// ----------- Run replication test // -----------" << std::endl;
+    std::filesystem::remove_all("cache_primary");
+    std::filesystem::remove_all("cache_replica");
+    ph::service* primary = nullptr;
+    std::thread primaryt([&] {
+        ph::service_config config;
+        config.cache_dir = "cache_primary/";
+        primary = ph::create_service(config);
+        primary->run(1566);
+    });
+    while (!primary) { std::this_thread::yield(); }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    auto origin = ph::client::create("localhost", 1566);
+    const auto upload = [&](const std::string& tag, std::size_t count) {
+        ph::client::plist_t patches;
+        for (std::size_t i = 0; i < count; ++i) {
+            auto p = std::make_shared<ph::patch>();
+            p->name = "repl_patch" + std::to_string(i);
+            p->tag = tag;
+            p->file_size = list[i]->file_size;
+            p->data = list[i]->data;
+            patches.push_back(p);
+        }
+        origin->upload(patches);
+        for (auto& p : patches) {
+            p->data = nullptr;
+        }
+    };
+    // held before the replica starts, it is compared in full at first
+    upload("repl_platform_1", 2);
+
+    ph::service* replica = nullptr;
+    std::thread replicat([&] {
+        ph::service_config config;
+        config.cache_dir = "cache_replica/";
+        config.primary_host = "localhost";
+        config.primary_port = 1566;
+        replica = ph::create_service(config);
+        replica->run(1567);
+    });
+    while (!replica) { std::this_thread::yield(); }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    auto reader = ph::client::create("localhost", 1567);
+    // pulled changes are seen on the next request to the replica
+    const auto wait_for = [&](const std::string& tag, std::size_t count) {
+        for (auto i = 0; i < 100; ++i) {
+            const auto got = reader->download(tag);
+            if (got.size() == count) {
+                for (const auto& p : got) {
+                    const auto& uploaded = *list[p->name.back() - '0'];
+                    assert(p->file_size == uploaded.file_size && std::memcmp(p->data, uploaded.data, p->file_size) == 0);
+                }
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        assert(false);
+    };
+    wait_for("repl_platform_1", 2);
+    upload("repl_platform_2", 3);
+    wait_for("repl_platform_2", 3);
+    // one patch less, the other ones are the same
+    origin->pdelete("repl_platform_2");
+    upload("repl_platform_2", 1);
+    wait_for("repl_platform_2", 1);
+    origin->pdelete("repl_platform_1");
+    wait_for("repl_platform_1", 0);
+    assert(std::filesystem::exists("cache_replica/repl_platform_2/repl_patch0"));
+    assert(!std::filesystem::exists("cache_replica/repl_platform_2/repl_patch1"));
+
+    // replica takes no writes of its own
+    {
+        auto writer = std::unique_ptr<ph::client>(ph::client::create("localhost", 1567));
+        auto p = std::make_shared<ph::patch>();
+        p->name = "repl_patch0";
+        p->tag = "repl_platform_3";
+        p->file_size = list[0]->file_size;
+        p->data = list[0]->data;
+        auto refused = false;
+        try {
+            writer->upload({ p });
+        } catch (const std::exception&) {
+            refused = true;
+        }
+        p->data = nullptr;
+        assert(refused);
+    }
+    for (auto i = 0; i < 100 && replica->replication().lag.count() != 0; ++i) {
+        reader->list();
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    const auto stats = replica->replication();
+    assert(stats.lag.count() == 0 && stats.applied_sequence == stats.primary_sequence && stats.applied_sequence != 0);
+
+    // reads are spread over the replicas, the one which is down is skipped
+    auto spread = std::unique_ptr<ph::client>(ph::client::create_replicated({ "localhost", 1566 },
+        { { "localhost", 1567 }, { "localhost", 1599 } }));
+    for (auto i = 0; i < 4; ++i) {
+        assert(spread->download("repl_platform_2").size() == 1);
+    }
+    assert(!spread->pdelete("repl_platform_2").empty());
+
+    delete reader;
+    delete origin;
+    replica->stop();
+    replicat.join();
+    delete replica;
+    primary->stop();
+    primaryt.join();
+    delete primary;
+}
+
+void run_sharding() {
+    std::cout << "// ----------- Run sharding test // -----------" << std::endl;
+    constexpr static auto nodes = 3;
+    ph::service* hubs[nodes] = { };
+    std::vector<std::thread> hubt;
+    std::vector<ph::client::endpoint> endpoints;
+    for (auto i = 0; i < nodes; ++i) {
+        const auto dir = "cache_shard" + std::to_string(i) + "/";
+        std::filesystem::remove_all(dir);
+        hubt.emplace_back([&hubs, i, dir] {
+            ph::service_config config;
+            config.cache_dir = dir;
+            hubs[i] = ph::create_service(config);
+            hubs[i]->run(1568 + i);
+        });
+        endpoints.push_back({ "localhost", 1568 + i });
+    }
+    for (auto* const& hub : hubs) {
+        while (!hub) { std::this_thread::yield(); }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    auto cluster = std::unique_ptr<ph::client>(ph::client::create_sharded(endpoints));
+    constexpr static auto tags = 12;
+    ph::client::plist_t patches;
+    for (auto i = 0; i < tags; ++i) {
+        auto p = std::make_shared<ph::patch>();
+        p->name = "shard_patch";
+        p->tag = "shard_platform_" + std::to_string(i);
+        p->file_size = list[i % list.size()]->file_size;
+        p->data = list[i % list.size()]->data;
+        patches.push_back(p);
+    }
+    assert(cluster->upload(patches).size() == tags);
+
+    // every tag is held by one node only, and it is the one every client routes it to
+    ph::hash_ring ring;
+    for (const auto& e : endpoints) {
+        ring.add(e.host + ":" + std::to_string(e.port));
+    }
+    std::size_t held = 0;
+    for (auto i = 0; i < nodes; ++i) {
+        auto node = std::unique_ptr<ph::client>(ph::client::create("localhost", 1568 + i));
+        for (const auto& p : node->list()) {
+            if (p->tag.rfind("shard_platform_", 0) == 0) {
+                assert(ring.owner(p->tag) == std::size_t(i));
+                ++held;
+            }
+        }
+    }
+    assert(held == tags);
+    std::size_t listed = 0;
+    for (const auto& p : cluster->list()) {
+        listed += p->tag.rfind("shard_platform_", 0) == 0 ? 1 : 0;
+    }
+    assert(listed == tags);
+
+    for (const auto& p : patches) {
+        const auto got = cluster->download(p->tag);
+        assert(got.size() == 1 && std::memcmp(got.front()->data, p->data, p->file_size) == 0);
+    }
+    std::vector<std::string> batch;
+    for (auto i = 0; i < tags; i += 2) {
+        batch.push_back("shard_platform_" + std::to_string(i));
+    }
+    assert(cluster->download_batch(batch).size() == batch.size());
+    for (const auto& p : patches) {
+        assert(cluster->pdelete(p->tag).size() == 1);
+        p->data = nullptr;
+    }
+
+    for (auto* hub : hubs) {
+        hub->stop();
+    }
+    for (auto& t : hubt) {
+        t.join();
+    }
+    for (auto* hub : hubs) {
+        delete hub;
+    }
+}
+
+void run_local() {
+    std::cout << "// ----------- Run local transfer test // -----------" << std::endl;
+    std::filesystem::remove_all("cache_local");
+    std::filesystem::remove_all("local_share");
+    std::filesystem::remove_all("local_out");
+    std::filesystem::create_directories("local_share");
+    ph::service* sv = nullptr;
+    std::thread servicet([&] {
+        ph::service_config config;
+        config.cache_dir = "cache_local/";
+        config.local_dir = "local_share";
+        sv = ph::create_service(config);
+        sv->run(1571);
+    });
+    while (!sv) { std::this_thread::yield(); }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    const auto write = [](const std::string& path, const ph::patch& content) {
+        std::ofstream file(path, std::ios::binary);
+        file.write((const char*)content.data, content.file_size);
+    };
+    std::vector<std::string> paths;
+    for (auto i = 0; i < 2; ++i) {
+        paths.push_back("local_share/local_patch" + std::to_string(i));
+        write(paths.back(), *list[i]);
+    }
+    auto client = std::unique_ptr<ph::client>(ph::client::create("localhost", 1571));
+    // copied by the hub itself, nothing is held in memory for the socket
+    const auto uploaded = client->upload_files("local_platform_1", paths);
+    assert(uploaded.size() == 2);
+    for (auto i = 0; i < 2; ++i) {
+        assert(uploaded[i]->name == "local_patch" + std::to_string(i));
+        assert(uploaded[i]->hash == ph::hasher::hash(list[i]->data, list[i]->file_size));
+    }
+    assert(sv->stats().resident_bytes == 0);
+
+    // copied from the hub cache, the hub reads nothing
+    const auto disk_bytes = sv->stats().disk_bytes;
+    const auto downloaded = client->download_files("local_platform_1", "local_out");
+    assert(downloaded.size() == 2 && sv->stats().disk_bytes == disk_bytes);
+    for (const auto& p : downloaded) {
+        const auto& content = *list[p->name.back() - '0'];
+        std::ifstream file("local_out/" + p->name, std::ios::binary);
+        std::vector<uint8_t> got(content.file_size);
+        assert(file.read((char*)got.data(), got.size()) && std::memcmp(got.data(), content.data, got.size()) == 0);
+    }
+
+    // file outside of the local dir goes through the socket
+    write("local_outside", *list[2]);
+    const auto streamed = client->upload_files("local_platform_2", { "local_outside" });
+    assert(streamed.size() == 1 && streamed.front()->hash == ph::hasher::hash(list[2]->data, list[2]->file_size));
+    assert(sv->stats().resident_bytes != 0);
+    // link in the dir to a file outside of it is not followed by the hub, it goes through the socket as well
+    std::error_code ec;
+    std::filesystem::create_symlink(std::filesystem::absolute("local_outside"), "local_share/local_link", ec);
+    if (!ec) {
+        const auto resident = sv->stats().resident_bytes;
+        const auto linked = client->upload_files("local_platform_3", { "local_share/local_link" });
+        assert(linked.size() == 1 && sv->stats().resident_bytes > resident);
+        client->pdelete("local_platform_3");
+    }
+    std::filesystem::remove("local_outside");
+
+    client->pdelete("local_platform_1");
+    client->pdelete("local_platform_2");
+    sv->stop();
+    servicet.join();
+    delete sv;
+}
+
+void run_restore_from_meta() {
+    std::cout << "// ----------- Run restore from meta test // -----------" << std::endl;
+    std::filesystem::remove_all("cache_meta");
+    ph::service_config config;
+    config.cache_dir = "cache_meta/";
+    ph::service* sv = nullptr;
+    std::thread servicet([&] {
+        sv = ph::create_service(config);
+        sv->run(1573);
+    });
+    while (!sv) { std::this_thread::yield(); }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    auto client = std::unique_ptr<ph::client>(ph::client::create("localhost", 1573));
+    ph::client::plist_t uploaded;
+    for (auto i = 0; i < 2; ++i) {
+        auto p = std::make_shared<ph::patch>();
+        p->name = "meta_patch" + std::to_string(i);
+        p->tag = "meta_platform_" + std::to_string(i);
+        p->file_size = list[i]->file_size;
+        p->data = list[i]->data;
+        uploaded.push_back(std::move(p));
+    }
+    client->upload(uploaded);
+    sv->stop();
+    servicet.join();
+    delete sv;
+    sv = nullptr;
+
+    // same size, other bytes
+    {
+        std::fstream file("cache_meta/meta_platform_1/meta_patch1", std::ios::in | std::ios::out | std::ios::binary);
+        file.put(char(~list[1]->data[0]));
+    }
+    // nothing fits the memory, files are restored with hashes of their meta and are not read
+    config.memory_budget = 1;
+    servicet = std::thread([&] {
+        sv = ph::create_service(config);
+        sv->run(1573);
+    });
+    while (!sv) { std::this_thread::yield(); }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    const auto kept = client->download("meta_platform_0");
+    assert(kept.size() == 1 && std::memcmp(kept[0]->data, list[0]->data, list[0]->file_size) == 0);
+    // damage shows on serve, the client checks the hash of what it gets
+    auto thrown = false;
+    try {
+        client->download("meta_platform_1");
+    } catch (const std::exception&) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    client.reset();
+    sv->stop();
+    servicet.join();
+    delete sv;
+    for (auto& p : uploaded) {
+        p->data = nullptr;
+    }
+}
+
+void run_parallel_upload() {
+    std::cout << "// ----------- Run parallel upload test // -----------" << std::endl;
+    std::filesystem::remove_all("cache_parallel");
+    ph::service* sv = nullptr;
+    std::thread servicet([&] {
+        ph::service_config config;
+        config.cache_dir = "cache_parallel/";
+        config.max_multipart_size = 2 * 1024 * 1024;
+        sv = ph::create_service(config);
+        sv->run(1572);
+    });
+    while (!sv) { std::this_thread::yield(); }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    std::vector<uint8_t> content(1024 * 1024 + 17);
+    for (auto& byte : content) {
+        byte = std::rand() % 256;
+    }
+    {
+        std::ofstream file("parallel_patch.pak", std::ios::binary);
+        file.write((const char*)content.data(), content.size());
+    }
+    const auto hash = ph::hasher::hash(content.data(), content.size());
+    auto client = std::unique_ptr<ph::client>(ph::client::create("localhost", 1572));
+    // eleven parts over four connections, the last one is short
+    const auto uploaded = client->upload_parallel("parallel_platform_1", "parallel_patch.pak", 4, 100 * 1024);
+    assert(uploaded.size() == 1 && uploaded.front()->name == "parallel_patch.pak");
+    assert(uploaded.front()->file_size == content.size() && uploaded.front()->hash == hash);
+    // published from disk, parts are not kept in memory
+    assert(sv->stats().resident_bytes == 0);
+    auto downloaded = client->download("parallel_platform_1");
+    assert(downloaded.size() == 1 && downloaded.front()->file_size == content.size());
+    assert(std::memcmp(downloaded.front()->data, content.data(), content.size()) == 0);
+
+    // single part goes as a plain upload
+    const auto plain = client->upload_parallel("parallel_platform_2", "parallel_patch.pak", 4, content.size());
+    assert(plain.size() == 1 && plain.front()->hash == hash);
+
+    // too large to be sent in parts, the hub does not allocate it and the client falls back to a plain upload
+    {
+        std::ofstream file("parallel_large.pak", std::ios::binary);
+        for (auto i = 0; i < 2; ++i) {
+            file.write((const char*)content.data(), content.size());
+        }
+    }
+    client->pdelete("parallel_platform_2");
+    const auto resident = sv->stats().resident_bytes;
+    const auto large = client->upload_parallel("parallel_platform_3", "parallel_large.pak", 4, 100 * 1024);
+    assert(large.size() == 1 && large.front()->file_size == 2 * content.size());
+    // plain uploads are received into memory
+    assert(sv->stats().resident_bytes == resident + 2 * content.size());
+
+    client->pdelete("parallel_platform_1");
+    client->pdelete("parallel_platform_3");
+    std::filesystem::remove("parallel_patch.pak");
+    std::filesystem::remove("parallel_large.pak");
+    sv->stop();
+    servicet.join();
+    delete sv;
+}
+
 void run_integration() {
     ph::service* sv = nullptr;
     std::thread servicet([&]{
         sv = ph::create_service();
-        sv->run();
+        sv->run(1555);
     });
 
     // prepare mock patches
@@ -130,7 +1049,11 @@ void run_integration() {
 
     run_upload();
     run_list();
+    run_legacy_list();
     run_download();
+    run_batch_download();
+    run_sync();
+    run_upload_changed();
     run_delete();
 
     sv->stop();
@@ -138,6 +1061,18 @@ void run_integration() {
     delete sv;
 
     run_cache();
+    run_memory_budget();
+    run_retention();
+    run_admission();
+    run_reaping();
+    run_scheduling();
+    run_subscribe();
+    run_proxy();
+    run_replication();
+    run_sharding();
+    run_local();
+    run_parallel_upload();
+    run_restore_from_meta();
 
     for (auto& p : list) {
         p->data = nullptr;
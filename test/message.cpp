@@ -2,18 +2,47 @@
 
 #include "hope-io/net/event_loop.h"
 #include "ph/message.h"
+#include "ph/crc32c.h"
+#include "ph/retention.h"
+#include "ph/patch_index.h"
+#include "ph/message_pool.h"
+#include "ph/buffer_pool.h"
+#include "ph/timer_wheel.h"
+#include "ph/token_bucket.h"
+#include "ph/block_cache.h"
+#include "ph/hash_ring.h"
+#include <algorithm>
 #include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
 
 void serialize_list_request() {
     ph::list_patches_request request;
     hope::io::event_loop::fixed_size_buffer b;
     ph::event_loop_stream_wrapper stream(b);
 
+    request.tags.value = { "WindowsClient", "LinuxClient" };
     request.write(stream);
     auto request_deserialized = ph::message::peek_request(stream);
     request_deserialized->read(stream);
 
     assert(request_deserialized->get_type() == request.get_type());
+    assert(static_cast<ph::list_patches_request*>(request_deserialized)->tags.value == request.tags.value);
+    delete request_deserialized;
+
+    // peers before filtered lists neither send nor read the tags
+    request.reset();
+    request.set_version(ph::protocol::sized);
+    request.tags.value = { "WindowsClient" };
+    b.reset();
+    ph::event_loop_stream_wrapper sized(b);
+    request.write(sized);
+    request_deserialized = ph::message::peek_request(sized);
+    request_deserialized->read(sized);
+    assert(static_cast<ph::list_patches_request*>(request_deserialized)->tags.value.empty());
+    assert(sized.readable() == 0);
+    delete request_deserialized;
 }
 
 void serialize_list_response() {
@@ -34,7 +63,7 @@ void serialize_list_response() {
 
     assert(response_deserialized->get_type() == response.get_type());
     const auto list_response = static_cast<ph::list_patches_response *>(response_deserialized);
-    for (auto i = 0; i < response.patches.size(); ++i) {
+    for (std::size_t i = 0; i < response.patches.size(); ++i) {
         assert(list_response->patches[i]->name == response.patches[i]->name);
         assert(list_response->patches[i]->tag == response.patches[i]->tag);
         assert(list_response->patches[i]->file_size == response.patches[i]->file_size);
@@ -72,12 +101,126 @@ void serialize_delete_response() {
 
     assert(response_deserialized->get_type() == response.get_type());
     const auto delete_response = static_cast<ph::delete_patch_response *>(response_deserialized);
-    for (auto i = 0; i < response.removed_patches.size(); ++i) {
+    for (std::size_t i = 0; i < response.removed_patches.size(); ++i) {
         assert(delete_response->removed_patches[i]->name == response.removed_patches[i]->name);
         assert(delete_response->removed_patches[i]->file_size == response.removed_patches[i]->file_size);
     }
 }
 
+void serialize_subscribe() {
+    hope::io::event_loop::fixed_size_buffer b;
+    ph::subscribe_request request;
+    request.prefix = "WindowsClient_";
+    request.after = 1ull << 40;
+    request.timeout = 30000;
+    {
+        ph::event_loop_stream_wrapper stream(b);
+        assert(request.write(stream));
+        auto* received = static_cast<ph::subscribe_request*>(ph::message::peek_request(stream));
+        assert(received->get_type() == ph::message::etype::subscribe && !received->is_response());
+        assert(received->read(stream));
+        assert(received->prefix == request.prefix && received->after == request.after
+            && received->timeout == request.timeout);
+        delete received;
+    }
+    b.reset();
+    ph::subscribe_response response;
+    response.sequence = 42;
+    response.missed = 1;
+    response.tags = { "WindowsClient_100500", "WindowsClient_100501" };
+    ph::event_loop_stream_wrapper stream(b);
+    assert(response.write(stream));
+    auto* received = static_cast<ph::subscribe_response*>(ph::message::peek_response(stream));
+    assert(received->read(stream));
+    assert(received->sequence == 42 && received->missed == 1 && received->tags == response.tags);
+    delete received;
+}
+
+void serialize_local_transfer() {
+    hope::io::event_loop::fixed_size_buffer b;
+    ph::local_upload_request request;
+    request.paths = { "/srv/local/win0.pak", "/srv/local/win1.pak" };
+    for (const auto& path : request.paths) {
+        auto p = std::make_shared<ph::patch>();
+        p->name = path.substr(path.rfind('/') + 1);
+        p->tag = "WindowsClient_100500";
+        p->file_size = 5ull << 30;
+        request.patches.push_back(std::move(p));
+    }
+    {
+        ph::event_loop_stream_wrapper stream(b);
+        assert(request.write(stream));
+        auto* received = static_cast<ph::local_upload_request*>(ph::message::peek_request(stream));
+        assert(received->get_type() == ph::message::etype::local_upload && !received->is_response());
+        assert(received->read(stream));
+        assert(received->paths == request.paths && received->patches.size() == 2);
+        assert(received->patches[1]->name == "win1.pak" && received->patches[1]->file_size == 5ull << 30);
+        delete received;
+    }
+    b.reset();
+    ph::local_download_response response;
+    response.patches = request.patches;
+    // second one is not on disk yet
+    response.paths = { "/srv/cache/WindowsClient_100500/win0.pak", "" };
+    ph::event_loop_stream_wrapper stream(b);
+    assert(response.write(stream));
+    auto* received = static_cast<ph::local_download_response*>(ph::message::peek_response(stream));
+    assert(received->get_type() == ph::message::etype::local_download && received->is_response());
+    assert(received->read(stream));
+    assert(received->paths == response.paths && received->patches.size() == 2
+        && received->patches[0]->tag == "WindowsClient_100500");
+    delete received;
+}
+
+void serialize_upload_part() {
+    hope::io::event_loop::fixed_size_buffer b;
+    ph::upload_begin_request begin;
+    begin.tag = "WindowsClient_100500";
+    begin.name = "win0.pak";
+    begin.file_size = 10ull << 30;
+    {
+        ph::event_loop_stream_wrapper stream(b);
+        assert(begin.write(stream));
+        auto* received = static_cast<ph::upload_begin_request*>(ph::message::peek_request(stream));
+        assert(received->get_type() == ph::message::etype::upload_begin && !received->is_response());
+        assert(received->read(stream));
+        assert(received->name == "win0.pak" && received->file_size == 10ull << 30 && received->hash == 0);
+        delete received;
+    }
+    b.reset();
+    std::vector<uint8_t> content(20 * 1024);
+    for (std::size_t i = 0; i < content.size(); ++i) {
+        content[i] = uint8_t(i * 31 + i / 256);
+    }
+    ph::upload_part_request request;
+    request.upload = 7;
+    request.offset = 9ull << 30;
+    auto part = std::make_shared<ph::patch>();
+    part->tag = begin.tag;
+    part->name = begin.name;
+    part->file_size = content.size();
+    part->data = content.data();
+    request.patches.push_back(part);
+    ph::event_loop_stream_wrapper stream(b);
+    auto complete = request.write(stream);
+    auto* received = static_cast<ph::upload_part_request*>(ph::message::peek_request(stream));
+    assert(received->get_type() == ph::message::etype::upload_part && !received->is_response());
+    received->read(stream);
+    // fields of the part go before the patch header
+    assert(received->upload == 7 && received->offset == 9ull << 30 && received->headers_read());
+    while (!complete) {
+        complete = request.write(stream);
+        received->read(stream);
+    }
+    assert(received->patches.size() == 1 && received->patches[0]->file_size == content.size());
+    assert(std::memcmp(received->patches[0]->data, content.data(), content.size()) == 0);
+    part->data = nullptr;
+    // reused for the next part, nothing of this one is left
+    received->reset();
+    assert(received->upload == 0 && received->offset == 0 && received->patches.empty());
+    delete received;
+}
+
 void serialize_upload_request() {
     constexpr static auto buffer_size = 32 * 1024;
     auto* test_buffer = new uint8_t[buffer_size]; // 32k is good
@@ -107,7 +250,7 @@ void serialize_upload_request() {
         complete = request.write(stream);
         request_deserialized->read(stream);
     }
-    for (auto i = 0; i < request.patches.size(); ++i) {
+    for (std::size_t i = 0; i < request.patches.size(); ++i) {
         assert(upload_request->patches[i]->name == request.patches[i]->name);
         assert(upload_request->patches[i]->file_size == request.patches[i]->file_size);
         assert(upload_request->patches[i]->tag == request.patches[i]->tag);
@@ -121,11 +264,55 @@ void serialize_upload_request() {
     delete[] test_buffer;
 }
 
+void serialize_upload_request_from_file() {
+    constexpr static auto file_size = 3 * 1024 * 1024 + 17;
+    std::vector<uint8_t> content(file_size);
+    for (auto& byte : content) {
+        byte = std::rand() % 256;
+    }
+    const auto path = (std::filesystem::temp_directory_path() / "ph_source_test.bin").string();
+    {
+        std::ofstream file(path, std::ios::binary);
+        file.write((const char*)content.data(), file_size);
+    }
+    ph::upload_patch_request request;
+    auto testp = std::make_shared<ph::patch>();
+    testp->tag = "WindowsClient_1";
+    testp->name = "file_backed";
+    testp->source = ph::create_file_source(path);
+    assert(testp->source && testp->source->size() == file_size);
+    testp->file_size = testp->source->size();
+    request.patches.emplace_back(std::move(testp));
+    // same file read ahead by the pool, block size does not match chunk size on purpose
+    ph::reader_pool pool(2);
+    auto prefetched = std::make_shared<ph::patch>();
+    prefetched->tag = "WindowsClient_1";
+    prefetched->name = "prefetched";
+    prefetched->source = ph::create_prefetch_source(ph::create_file_source(path), pool, 64 * 1024 + 3);
+    prefetched->file_size = prefetched->source->size();
+    request.patches.emplace_back(std::move(prefetched));
+
+    hope::io::event_loop::fixed_size_buffer b;
+    ph::event_loop_stream_wrapper stream(b);
+    auto complete = request.write(stream);
+    auto request_deserialized = ph::message::peek_request(stream);
+    request_deserialized->read(stream);
+    while (!complete) {
+        complete = request.write(stream);
+        request_deserialized->read(stream);
+    }
+    const auto upload_request = static_cast<ph::upload_patch_request *>(request_deserialized);
+    for (const auto& p : upload_request->patches) {
+        assert(p->file_size == file_size);
+        assert(std::memcmp(p->data, content.data(), file_size) == 0);
+    }
+    std::filesystem::remove(path);
+}
+
 void serialize_upload_response() {
     ph::upload_patch_response response;
     for (auto i = 0; i < 5; ++i) {
         const auto name = "random_name" + std::to_string(i);
-        const auto size = i * 100000;
         for (auto i = 0; i < 5; ++i) {
             auto testp = std::make_shared<ph::patch>();
             testp->tag = std::string("WindowsClient") + "_" + std::to_string(i);
@@ -143,7 +330,7 @@ void serialize_upload_response() {
    
     assert(response_deserialized->get_type() == response.get_type());
     auto upload_response = static_cast<ph::upload_patch_response *>(response_deserialized);
-    for (auto i = 0; i < response.patches.size(); ++i) {
+    for (std::size_t i = 0; i < response.patches.size(); ++i) {
         assert(response.patches[i]->file_size == upload_response->patches[i]->file_size);
         assert(response.patches[i]->name == upload_response->patches[i]->name);
         assert(response.patches[i]->tag == upload_response->patches[i]->tag);
@@ -167,7 +354,741 @@ void serialize_get_request() {
 }
 
 void serialize_get_response() {
-    // same with upload request
+    // same with upload request, except the receiver streams patches to files
+    constexpr static auto buffer_size = 2 * 1024 * 1024;
+    std::vector<uint8_t> content(buffer_size);
+    for (auto& byte : content) {
+        byte = std::rand() % 256;
+    }
+    ph::get_patches_response response;
+    for (auto i = 0; i < 3; ++i) {
+        auto testp = std::make_shared<ph::patch>();
+        testp->tag = "WindowsClient_1";
+        testp->name = "ph_sink_test" + std::to_string(i);
+        testp->file_size = i == 0 ? 0 : buffer_size - i;
+        testp->data = content.data();
+        response.patches.emplace_back(std::move(testp));
+    }
+    const auto dir = std::filesystem::temp_directory_path();
+    hope::io::event_loop::fixed_size_buffer b;
+    ph::event_loop_stream_wrapper stream(b);
+
+    auto complete = response.write(stream);
+    auto response_deserialized = ph::message::peek_response(stream);
+    const auto get_response = static_cast<ph::get_patches_response *>(response_deserialized);
+    get_response->sink_factory = [&dir](const ph::patch& p) {
+        return ph::create_file_sink((dir / p.name).string(), p.file_size);
+    };
+    get_response->read(stream);
+    while (!complete) {
+        complete = response.write(stream);
+        get_response->read(stream);
+    }
+    for (std::size_t i = 0; i < response.patches.size(); ++i) {
+        const auto& p = get_response->patches[i];
+        assert(p->data == nullptr);
+        p->sink.reset();
+        const auto path = dir / p->name;
+        assert(std::filesystem::file_size(path) == p->file_size);
+        std::vector<uint8_t> stored(p->file_size);
+        std::ifstream file(path, std::ios::binary);
+        file.read((char*)stored.data(), p->file_size);
+        assert(std::memcmp(stored.data(), content.data(), p->file_size) == 0);
+        std::filesystem::remove(path);
+    }
+    for (auto& patch : response.patches) {
+        patch->data = nullptr;
+    }
+}
+
+void serialize_batch_request() {
+    ph::get_batch_request request;
+    request.tags = { "WindowsClient_1", "WindowsDLC_1", "WindowsClient_2" };
+    hope::io::event_loop::fixed_size_buffer b;
+    ph::event_loop_stream_wrapper stream(b);
+
+    request.write(stream);
+
+    auto request_deserialized = ph::message::peek_request(stream);
+    request_deserialized->read(stream);
+
+    assert(request_deserialized->get_type() == request.get_type());
+    const auto batch_request = static_cast<ph::get_batch_request *>(request_deserialized);
+    assert(batch_request->tags == request.tags);
+}
+
+void serialize_legacy_get_request() {
+    ph::get_patches_request request;
+    request.set_version(ph::protocol::legacy);
+    request.tag = std::string("WindowsClient") + "_" + std::to_string(1);
+    hope::io::event_loop::fixed_size_buffer b;
+    ph::event_loop_stream_wrapper stream(b);
+
+    request.write(stream);
+    // legacy peers expect plain type byte right after the frame header
+    const auto [dat, count] = b.used_chunk();
+    assert(count == sizeof(uint32_t) + 1 + sizeof(uint16_t) + request.tag.size());
+    assert(((const uint8_t*)dat)[sizeof(uint32_t)] == (uint8_t)ph::message::etype::get_patches);
+
+    auto request_deserialized = ph::message::peek_request(stream);
+    request_deserialized->read(stream);
+
+    assert(request_deserialized->get_version() == ph::protocol::legacy);
+    const auto get_request = static_cast<ph::get_patches_request *>(request_deserialized);
+    assert(get_request->tag == request.tag);
+}
+
+void serialize_wide_list_response() {
+    // more patches than legacy count limit, sizes above 4gb, does not fit into one chunk
+    ph::list_patches_response response;
+    for (auto i = 0; i < 70000; ++i) {
+        auto p = std::make_shared<ph::patch>();
+        p->tag = std::string("WindowsClient") + "_" + std::to_string(i % 10);
+        p->name = "random_patch_name" + std::to_string(i);
+        p->file_size = (uint64_t(5) << 30) + i;
+        response.patches.push_back(std::move(p));
+    }
+    hope::io::event_loop::fixed_size_buffer b;
+    ph::event_loop_stream_wrapper stream(b);
+
+    auto complete = response.write(stream);
+    auto response_deserialized = ph::message::peek_response(stream);
+    auto read_complete = response_deserialized->read(stream);
+    while (!complete) {
+        complete = response.write(stream);
+        read_complete = response_deserialized->read(stream);
+    }
+    assert(read_complete);
+    assert(response_deserialized->get_version() == ph::protocol::current);
+    const auto list_response = static_cast<ph::list_patches_response *>(response_deserialized);
+    assert(list_response->patches.size() == response.patches.size());
+    for (std::size_t i = 0; i < response.patches.size(); ++i) {
+        assert(list_response->patches[i]->name == response.patches[i]->name);
+        assert(list_response->patches[i]->tag == response.patches[i]->tag);
+        assert(list_response->patches[i]->file_size == response.patches[i]->file_size);
+    }
+}
+
+// a header is never split between chunks, one larger than a whole chunk cannot be sent
+void serialize_oversized_header() {
+    ph::list_patches_response response;
+    auto p = std::make_shared<ph::patch>();
+    p->tag = "WindowsClient_1";
+    hope::io::event_loop::fixed_size_buffer b;
+    p->name = std::string(b.buffer_size, 'n');
+    response.patches.push_back(std::move(p));
+    ph::event_loop_stream_wrapper stream(b);
+
+    auto thrown = false;
+    try {
+        for (auto chunk = 0; chunk < 3; ++chunk) {
+            assert(!response.write(stream));
+        }
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+void serialize_sync_request() {
+    // tag goes once, local list is split between chunks, every chunk gets its own frame header
+    ph::sync_request request;
+    request.tag = "WindowsClient_1";
+    for (auto i = 0; i < 20000; ++i) {
+        auto p = std::make_shared<ph::patch>();
+        p->tag = request.tag;
+        p->name = "random_patch_name" + std::to_string(i);
+        p->file_size = i;
+        p->hash = i + 1;
+        request.local.push_back(std::move(p));
+    }
+    hope::io::event_loop::fixed_size_buffer b;
+    ph::event_loop_stream_wrapper stream(b);
+
+    auto complete = request.write(stream);
+    assert(stream.is_ready_to_read());
+    auto request_deserialized = ph::message::peek_request(stream);
+    auto read_complete = request_deserialized->read(stream);
+    auto chunks = 1;
+    while (!complete) {
+        complete = request.write(stream);
+        assert(stream.is_ready_to_read());
+        read_complete = request_deserialized->read(stream);
+        ++chunks;
+    }
+    assert(read_complete && chunks > 1);
+    const auto sync_request = static_cast<ph::sync_request*>(request_deserialized);
+    assert(sync_request->tag == request.tag);
+    assert(sync_request->local.size() == request.local.size());
+    for (std::size_t i = 0; i < request.local.size(); ++i) {
+        assert(sync_request->local[i]->name == request.local[i]->name);
+        assert(sync_request->local[i]->hash == request.local[i]->hash);
+    }
+    // layout is cleared field by field
+    sync_request->reset();
+    assert(sync_request->tag.empty() && sync_request->local.empty());
+}
+
+void serialize_gathered_upload_request() {
+    // big payload pieces are referenced by segments, the receiver gets the same chunks as if they were copied
+    std::vector<uint8_t> content(300000);
+    for (auto& byte : content) {
+        byte = std::rand() % 256;
+    }
+    ph::upload_patch_request request;
+    for (auto i = 0; i < 3; ++i) {
+        auto p = std::make_shared<ph::patch>();
+        p->tag = "WindowsClient_1";
+        p->name = "random_name" + std::to_string(i);
+        p->file_size = content.size() - i * 1000;
+        p->data = content.data();
+        request.patches.emplace_back(std::move(p));
+    }
+    std::vector<ph::chunk_segment> segments;
+    hope::io::event_loop::fixed_size_buffer out, in;
+    const auto capacity = in.free_space();
+    ph::message* received = nullptr;
+    auto referenced = false;
+    auto complete = false;
+    auto read_complete = false;
+    while (!complete) {
+        ph::event_loop_stream_wrapper out_stream(out, segments);
+        complete = request.write(out_stream);
+        in.reset();
+        for (const auto& [data, size] : segments) {
+            referenced |= data >= (const void*)content.data() && data < (const void*)(content.data() + content.size());
+            in.write(data, size);
+        }
+        ph::event_loop_stream_wrapper in_stream(in);
+        assert(in_stream.is_ready_to_read());
+        if (received == nullptr) {
+            received = ph::message::peek_request(in_stream);
+        }
+        read_complete = received->read(in_stream);
+    }
+    assert(read_complete);
+    assert(referenced || capacity < 2 * ph::event_loop_stream_wrapper::min_referenced);
+    const auto upload_request = static_cast<ph::upload_patch_request*>(received);
+    for (std::size_t i = 0; i < request.patches.size(); ++i) {
+        const auto& p = upload_request->patches[i];
+        assert(p->file_size == request.patches[i]->file_size);
+        assert(std::memcmp(p->data, content.data(), p->file_size) == 0);
+    }
+    for (auto& p : request.patches) {
+        p->data = nullptr;
+    }
+    delete received;
+}
+
+void serialize_limited_chunks() {
+    // sender tells how large chunks it receives, the other side keeps its chunks within the limit
+    std::vector<uint8_t> content(100000, 42);
+    ph::get_patches_response response;
+    for (auto i = 0; i < 3; ++i) {
+        auto p = std::make_shared<ph::patch>();
+        p->tag = "WindowsClient_1";
+        p->name = "random_name" + std::to_string(i);
+        p->file_size = content.size();
+        p->hash = ph::hasher::hash(content.data(), content.size());
+        p->data = content.data();
+        response.patches.emplace_back(std::move(p));
+    }
+    constexpr static uint32_t limit = 4096;
+    response.set_chunk_limit(limit);
+    hope::io::event_loop::fixed_size_buffer b;
+    const auto capacity = b.free_space();
+    ph::event_loop_stream_wrapper stream(b);
+    auto complete = response.write(stream);
+    assert(b.count() <= limit);
+    auto received = ph::message::peek_response(stream);
+    assert(received->get_peer_chunk() == capacity);
+    auto read_complete = received->read(stream);
+    while (!complete) {
+        complete = response.write(stream);
+        assert(b.count() <= limit);
+        read_complete = received->read(stream);
+    }
+    assert(read_complete);
+    const auto get_response = static_cast<ph::get_patches_response*>(received);
+    for (const auto& p : get_response->patches) {
+        assert(p->file_size == content.size() && std::memcmp(p->data, content.data(), content.size()) == 0);
+    }
+    for (auto& p : response.patches) {
+        p->data = nullptr;
+    }
+    delete received;
+}
+
+void buffer_pool_reuse() {
+    ph::buffer_pool pool(1);
+    const void* kept;
+    {
+        auto a = pool.acquire();
+        auto b = pool.acquire();
+        b->write("abc", 3);
+        // released first
+        kept = b.get();
+    }
+    // only one is kept idle, it comes back empty
+    assert(pool.idle() == 1 && pool.created() == 2);
+    auto c = pool.acquire();
+    assert(c.get() == kept && c->count() == 0 && pool.created() == 2);
+}
+
+void timer_wheel_expiry() {
+    ph::timer_wheel wheel;
+    std::vector<uint32_t> fired;
+    // one per level and one beyond the range
+    wheel.arm(1, 10);
+    wheel.arm(2, 100);
+    wheel.arm(3, 5000);
+    wheel.arm(4, 300000);
+    wheel.arm(5, (uint64_t(1) << 24) + 7);
+    wheel.arm(6, 50);
+    wheel.disarm(6);
+    assert(wheel.size() == 5 && !wheel.armed(6));
+    wheel.advance(9, fired);
+    assert(fired.empty());
+    wheel.advance(10, fired);
+    assert(fired == std::vector<uint32_t>{ 1 });
+    // rearmed timer moves
+    wheel.arm(2, 20);
+    wheel.advance(99, fired);
+    assert((fired == std::vector<uint32_t>{ 1, 2 }));
+    // each fires at its tick while the wheel is stepped
+    for (uint64_t tick = 100; tick <= (uint64_t(1) << 24) + 7; tick += 97) {
+        fired.clear();
+        wheel.advance(tick, fired);
+        for (const auto id : fired) {
+            const uint64_t expected[] = { 0, 10, 20, 5000, 300000, (uint64_t(1) << 24) + 7 };
+            assert(tick >= expected[id] && tick < expected[id] + 97);
+        }
+    }
+    fired.clear();
+    wheel.advance((uint64_t(1) << 24) + 7, fired);
+    assert(wheel.size() == 0);
+    fired.clear();
+    // past tick fires right away
+    wheel.arm(7, 3);
+    wheel.advance(wheel.now() + 1, fired);
+    assert(fired == std::vector<uint32_t>{ 7 });
+}
+
+void token_bucket_refill() {
+    const auto start = ph::token_bucket::clock::now();
+    ph::token_bucket bucket(1000, 2000, start);
+    assert(bucket.limited() && bucket.available(start) == 2000);
+    // chunk may go into debt, it is paid by time
+    bucket.consume(2500);
+    assert(bucket.available(start) == 0);
+    assert(bucket.available(start + std::chrono::milliseconds(500)) == 0);
+    assert(bucket.available(start + std::chrono::milliseconds(1000)) == 500);
+    // never above the burst
+    assert(bucket.available(start + std::chrono::seconds(10)) == 2000);
+    assert(!ph::token_bucket().limited() && ph::token_bucket().available(start) == UINT64_MAX);
+}
+
+// bytes are their offsets, counts what is read
+struct counting_source final : ph::patch_source {
+    explicit counting_source(uint64_t in_size, uint64_t& in_read) : total(in_size), read_bytes(in_read) { }
+    std::size_t read(uint64_t offset, uint8_t* out, std::size_t size) override {
+        for (std::size_t i = 0; i < size; ++i) {
+            out[i] = uint8_t(offset + i);
+        }
+        read_bytes += size;
+        return size;
+    }
+    uint64_t size() const override { return total; }
+    const uint64_t total;
+    uint64_t& read_bytes;
+};
+
+void block_cache_sharing() {
+    ph::block_cache cache(8 * 1024, 1024);
+    uint64_t read = 0;
+    auto source = cache.share(std::make_shared<counting_source>(5000, read));
+    // readers of the patch at different offsets, in pieces of different size
+    constexpr static std::size_t readers = 10;
+    uint64_t offsets[readers] = { };
+    uint8_t out[700];
+    for (auto done = false; !done;) {
+        done = true;
+        for (std::size_t i = 0; i < readers; ++i) {
+            const auto size = std::min<uint64_t>(100 + i * 60, source->size() - offsets[i]);
+            if (size == 0) {
+                continue;
+            }
+            done = false;
+            const auto count = source->read(offsets[i], out, size);
+            assert(count > 0 && count <= size);
+            for (std::size_t j = 0; j < count; ++j) {
+                assert(out[j] == uint8_t(offsets[i] + j));
+            }
+            offsets[i] += count;
+        }
+    }
+    // each block once
+    assert(read == 5000 && cache.read_bytes() == 5000);
+    assert(cache.resident() == 5000);
+    // over the budget the oldest blocks go, a gone source takes its blocks along
+    auto other = cache.share(std::make_shared<counting_source>(6000, read));
+    other->read(0, out, 700);
+    for (uint64_t offset = 0; offset < 6000; offset += 1024) {
+        other->read(offset, out, 10);
+    }
+    assert(cache.resident() <= 8 * 1024);
+    source.reset();
+    assert(cache.resident() == 6000);
+    other.reset();
+    assert(cache.resident() == 0);
+    // no budget, every read goes to the source
+    ph::block_cache none(0);
+    auto direct = none.share(std::make_shared<counting_source>(10, read));
+    read = 0;
+    direct->read(0, out, 10);
+    direct->read(0, out, 10);
+    assert(read == 20 && none.read_bytes() == 20 && none.resident() == 0);
+}
+
+// two downloads of a cold patch wait for its blocks, which are read once each by the io side
+void block_cache_loading() {
+    std::deque<std::pair<std::function<void()>, std::function<void()>>> io;
+    ph::block_cache cache(64 * 1024, 1024, [&io](std::function<void()> read, std::function<void()> done) {
+        io.emplace_back(std::move(read), std::move(done));
+    });
+    uint64_t read = 0;
+    auto source = cache.share(std::make_shared<counting_source>(5000, read));
+    struct download final {
+        uint64_t offset{ 0 };
+        bool waiting{ false };
+        std::size_t resumed{ 0 };
+    };
+    download downloads[2];
+    uint8_t out[1500];
+    while (downloads[0].offset != source->size() || downloads[1].offset != source->size()) {
+        for (auto& d : downloads) {
+            if (d.waiting || d.offset == source->size()) {
+                continue;
+            }
+            const auto end = std::min<uint64_t>(d.offset + sizeof(out), source->size());
+            if (!source->ready(d.offset, std::size_t(end - d.offset), [&d] { d.waiting = false; ++d.resumed; })) {
+                d.waiting = true;
+                continue;
+            }
+            // the blocks are in, nothing is read in place
+            const auto before = read;
+            while (d.offset < end) {
+                const auto count = source->read(d.offset, out, std::size_t(end - d.offset));
+                for (std::size_t j = 0; j < count; ++j) {
+                    assert(out[j] == uint8_t(d.offset + j));
+                }
+                d.offset += count;
+            }
+            assert(read == before);
+        }
+        assert(!io.empty() || !downloads[0].waiting || !downloads[1].waiting);
+        // the io thread reads, then the loop takes the block and resumes its readers
+        while (!io.empty()) {
+            auto [load, done] = std::move(io.front());
+            io.pop_front();
+            load();
+            done();
+        }
+    }
+    assert(read == 5000 && cache.read_bytes() == 5000);
+    assert(downloads[0].resumed > 0 && downloads[1].resumed > 0);
+}
+
+void hash_known_values() {
+    assert(ph::hasher::hash("", 0) == 0xef46db3751d8e999ULL);
+    assert(ph::hasher::hash("abc", 3) == 0x44bc2cf5ad770999ULL);
+    const std::string text = "Nobody inspects the spammish repetition";
+    assert(ph::hasher::hash(text.data(), text.size()) == 0xfbcea83c8a378bf1ULL);
+    // split does not matter
+    ph::hasher h;
+    for (std::size_t i = 0; i < text.size(); i += 5) {
+        h.update(text.data() + i, std::min<std::size_t>(5, text.size() - i));
+    }
+    assert(h.digest() == 0xfbcea83c8a378bf1ULL);
+}
+
+void crc32c_known_values() {
+    assert(ph::crc32c("123456789", 9) == 0xe3069283);
+    // long enough for interleaved lanes, any split gives the same value
+    std::vector<uint8_t> data(100000);
+    for (auto& byte : data) {
+        byte = std::rand() % 256;
+    }
+    const auto whole = ph::crc32c(data.data(), data.size());
+    auto crc = ph::crc32c(data.data(), 12345);
+    crc = ph::crc32c(data.data() + 12345, data.size() - 12345, crc);
+    assert(crc == whole);
+}
+
+void serialize_damaged_upload_request() {
+    std::vector<uint8_t> content(1000, 42);
+    ph::upload_patch_request request;
+    auto testp = std::make_shared<ph::patch>();
+    testp->tag = "WindowsClient_1";
+    testp->name = "damaged";
+    testp->file_size = content.size();
+    testp->data = content.data();
+    request.patches.emplace_back(std::move(testp));
+    hope::io::event_loop::fixed_size_buffer b;
+    ph::event_loop_stream_wrapper stream(b);
+
+    // headers go alone, payload in the next chunk
+    assert(!request.write(stream));
+    auto request_deserialized = ph::message::peek_request(stream);
+    assert(!request_deserialized->read(stream));
+    assert(static_cast<ph::upload_patch_request*>(request_deserialized)->headers_read());
+    assert(request.write(stream));
+    // last payload byte, right before the chunk checksum
+    const auto [data, size] = b.used_chunk();
+    ((uint8_t*)const_cast<void*>(data))[size - sizeof(uint32_t) - 1] ^= 1;
+    bool thrown = false;
+    try {
+        request_deserialized->read(stream);
+    } catch (const std::exception&) {
+        thrown = true;
+    }
+    assert(thrown);
+    delete request_deserialized;
+    request.patches.front()->data = nullptr;
+}
+
+// payload announced by the peer is checked against the limit of the reader before it is allocated
+void serialize_oversized_payload() {
+    std::vector<uint8_t> content(600, 42);
+    const auto received = [&content](uint64_t limit) {
+        ph::upload_patch_request request;
+        for (auto i = 0; i < 2; ++i) {
+            auto testp = std::make_shared<ph::patch>();
+            testp->tag = "WindowsClient_1";
+            testp->name = "part" + std::to_string(i);
+            testp->file_size = content.size();
+            testp->data = content.data();
+            request.patches.emplace_back(std::move(testp));
+        }
+        hope::io::event_loop::fixed_size_buffer b;
+        ph::event_loop_stream_wrapper stream(b);
+        auto complete = request.write(stream);
+        auto* msg = static_cast<ph::upload_patch_request*>(ph::message::peek_request(stream));
+        msg->memory_limit = limit;
+        auto thrown = false;
+        try {
+            msg->read(stream);
+            while (!complete) {
+                complete = request.write(stream);
+                msg->read(stream);
+            }
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        const auto taken = thrown ? 0 : msg->memory_payload();
+        delete msg;
+        for (auto& patch : request.patches) {
+            patch->data = nullptr;
+        }
+        return taken;
+    };
+    assert(received(1200) == 1200);
+    // every patch fits alone, both do not
+    assert(received(1000) == 0);
+    assert(received(599) == 0);
+}
+
+// counts and lengths come from the peer, a huge one must not be allocated
+void serialize_oversized_counts() {
+    hope::io::event_loop::fixed_size_buffer b;
+    const auto hostile = [&b](ph::message::etype type, bool response) {
+        b.reset();
+        ph::event_loop_stream_wrapper stream(b);
+        stream.write(uint8_t((uint8_t)type | ph::protocol::versioned_flag));
+        stream.write(ph::protocol::current);
+        stream.set_version(ph::protocol::current);
+        stream.write_count(stream.capacity());
+        stream.write_count(1ull << 62);
+        stream.end_chunk();
+        ph::event_loop_stream_wrapper in(b);
+        auto* msg = response ? ph::message::peek_response(in) : ph::message::peek_request(in);
+        auto thrown = false;
+        try {
+            msg->read(in);
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        delete msg;
+        return thrown;
+    };
+    // tag length and count of tags
+    assert(hostile(ph::message::etype::get_patches, false));
+    assert(hostile(ph::message::etype::get_batch, false));
+    assert(hostile(ph::message::etype::list_patches, false));
+    // patch list may span chunks, nothing is reserved beyond the chunk and nothing is thrown
+    assert(!hostile(ph::message::etype::list_patches, true));
+}
+
+void serialize_unknown_type() {
+    hope::io::event_loop::fixed_size_buffer b;
+    // every peek reads the header, so each one gets it anew
+    const auto unknown = [&b]() -> hope::io::event_loop::fixed_size_buffer& {
+        b.reset();
+        ph::event_loop_stream_wrapper stream(b);
+        stream.write(uint8_t((uint8_t)ph::message::etype::count | ph::protocol::versioned_flag));
+        stream.write(ph::protocol::current);
+        stream.set_version(ph::protocol::current);
+        stream.write_count(stream.capacity());
+        stream.end_chunk();
+        return b;
+    };
+    // a type from a newer peer or a damaged stream is not guessed, the caller drops the connection
+    ph::event_loop_stream_wrapper request(unknown());
+    assert(ph::message::peek_request(request) == nullptr);
+    ph::event_loop_stream_wrapper response(unknown());
+    assert(ph::message::peek_response(response) == nullptr);
+    ph::message_pool pool;
+    ph::event_loop_stream_wrapper pooled(unknown());
+    assert(pool.peek_request(pooled) == nullptr);
+}
+
+void retention_expired_tags() {
+    using namespace std::chrono_literals;
+    const auto now = std::chrono::system_clock::now();
+    std::vector<ph::tag_info> tags;
+    for (auto i = 1; i <= 5; ++i) {
+        tags.push_back({ "WindowsClient_" + std::to_string(i), now - std::chrono::hours(10 - i) });
+        tags.push_back({ "LinuxServer_" + std::to_string(i), now - std::chrono::hours(10 - i) });
+    }
+    tags.push_back({ "nightly", now - 100h });
+    std::vector<ph::retention_rule> rules(2);
+    rules[0].platform = "WindowsClient";
+    rules[0].keep_last = 2;
+    rules[1].max_age = 7h;
+    const auto expired = ph::expired_tags(tags, rules, now);
+    // windows keeps two newest revisions, others are limited by age, oldest go first
+    const std::vector<std::string> expected = {
+        "nightly", "WindowsClient_1", "LinuxServer_1", "WindowsClient_2", "LinuxServer_2", "WindowsClient_3",
+    };
+    assert(expired.size() == expected.size());
+    for (const auto& tag : expected) {
+        assert(std::find(begin(expired), end(expired), tag) != end(expired));
+    }
+    assert(expired.front() == "nightly");
+    std::string platform;
+    uint64_t revision = 0;
+    assert(ph::split_tag("Windows_Client_10", platform, revision) && platform == "Windows_Client" && revision == 10);
+    assert(!ph::split_tag("WindowsClient_rc", platform, revision));
+}
+
+void patch_index_lookup() {
+    ph::patch_index index;
+    std::vector<std::shared_ptr<ph::patch>> patches;
+    for (auto rev = 0; rev < 50; ++rev) {
+        for (auto i = 0; i < 100; ++i) {
+            auto p = std::make_shared<ph::patch>();
+            p->tag = "WindowsClient_" + std::to_string(rev);
+            p->name = "PH_Redist_" + std::to_string(i) + ".pak";
+            p->file_size = i;
+            p->hash = rev * 1000 + i;
+            assert(index.put(p) == nullptr);
+            patches.emplace_back(std::move(p));
+        }
+    }
+    assert(index.size() == patches.size());
+    for (const auto& p : patches) {
+        assert(index.find(p->tag, p->name) == p);
+        assert(index.find_content(p->hash, p->file_size) == p);
+        assert(index.contains(p));
+    }
+    // replace keeps upload order of the tag
+    auto replacement = std::make_shared<ph::patch>(*patches[3]);
+    replacement->hash = 777777;
+    assert(index.put(replacement) == patches[3]);
+    assert(index.find_content(patches[3]->hash, patches[3]->file_size) == nullptr);
+    assert(index.find_content(777777, replacement->file_size) == replacement);
+    std::vector<std::shared_ptr<ph::patch>> tag;
+    assert(index.get("WindowsClient_0", tag) && tag.size() == 100 && tag[3] == replacement);
+    // erased tags release their slots and strings, the rest is still found
+    for (auto rev = 0; rev < 50; rev += 2) {
+        assert(index.erase("WindowsClient_" + std::to_string(rev)).size() == 100);
+    }
+    assert(index.size() == patches.size() / 2);
+    assert(!index.get("WindowsClient_0", tag));
+    for (const auto& p : patches) {
+        const auto rev = p->hash / 1000;
+        assert((index.find(p->tag, p->name) != nullptr) == (rev % 2 == 1));
+    }
+    index.put(patches.front());
+    assert(index.find(patches.front()->tag, patches.front()->name) == patches.front());
+    std::size_t count = 0;
+    index.for_each([&](const auto&) { ++count; });
+    assert(count == index.size());
+}
+
+void message_pool_reuse() {
+    ph::message_pool pool;
+    ph::message* previous = nullptr;
+    for (auto i = 0; i < 3; ++i) {
+        ph::get_patches_request request;
+        request.tag = "WindowsClient_" + std::to_string(i);
+        hope::io::event_loop::fixed_size_buffer b;
+        ph::event_loop_stream_wrapper stream(b);
+        request.write(stream);
+        auto* pooled = pool.peek_request(stream);
+        // released message comes back clean
+        assert(previous == nullptr || pooled == previous);
+        assert(static_cast<ph::get_patches_request*>(pooled)->tag.empty());
+        pooled->read(stream);
+        assert(static_cast<ph::get_patches_request*>(pooled)->tag == request.tag);
+        pool.release(pooled, true);
+        previous = pooled;
+    }
+    // same type of the other side is a different message
+    auto* response = pool.acquire<ph::get_patches_response>();
+    assert(response != previous);
+    response->patches.emplace_back(std::make_shared<ph::patch>());
+    pool.release(response, false);
+    assert(pool.acquire<ph::get_patches_response>() == response && response->patches.empty());
+    pool.release(response, false);
+    assert(pool.created() == 2);
+}
+
+void hash_ring_rebalance() {
+    ph::hash_ring ring;
+    for (auto i = 0; i < 4; ++i) {
+        ring.add("hub" + std::to_string(i) + ":1556");
+    }
+    constexpr static auto tags = 10000;
+    std::vector<std::size_t> before(tags);
+    std::vector<std::size_t> load(5);
+    for (auto i = 0; i < tags; ++i) {
+        before[i] = ring.owner("WindowsClient_" + std::to_string(i));
+        ++load[before[i]];
+    }
+    // virtual nodes keep the nodes within a fair margin of an even share
+    for (auto i = 0; i < 4; ++i) {
+        assert(load[i] > tags / 4 * 7 / 10 && load[i] < tags / 4 * 13 / 10);
+    }
+    // the new node takes about a fifth, only from the others, nothing moves between the old ones
+    ring.add("hub4:1556");
+    ring.add("hub4:1556");
+    assert(ring.size() == 5);
+    std::size_t moved = 0;
+    for (auto i = 0; i < tags; ++i) {
+        const auto now = ring.owner("WindowsClient_" + std::to_string(i));
+        if (now != before[i]) {
+            assert(now == 4);
+            ++moved;
+        }
+    }
+    assert(moved > tags / 5 * 7 / 10 && moved < tags / 5 * 13 / 10);
+    // removing it gives back exactly what it took
+    ring.remove("hub4:1556");
+    for (auto i = 0; i < tags; ++i) {
+        assert(ring.owner("WindowsClient_" + std::to_string(i)) == before[i]);
+    }
+    assert(ring.node(before[0]).rfind("hub", 0) == 0);
 }
 
 void run_tests() {
@@ -175,8 +1096,34 @@ void run_tests() {
     serialize_list_response();
     serialize_delete_request();
     serialize_delete_response();
+    serialize_subscribe();
+    serialize_local_transfer();
+    serialize_upload_part();
     serialize_upload_request();
+    serialize_upload_request_from_file();
     serialize_upload_response();
     serialize_get_request();
     serialize_get_response();
+    serialize_batch_request();
+    serialize_legacy_get_request();
+    serialize_wide_list_response();
+    serialize_oversized_header();
+    serialize_sync_request();
+    serialize_gathered_upload_request();
+    serialize_limited_chunks();
+    buffer_pool_reuse();
+    timer_wheel_expiry();
+    token_bucket_refill();
+    block_cache_sharing();
+    block_cache_loading();
+    hash_ring_rebalance();
+    hash_known_values();
+    crc32c_known_values();
+    serialize_damaged_upload_request();
+    serialize_oversized_payload();
+    serialize_oversized_counts();
+    serialize_unknown_type();
+    retention_expired_tags();
+    patch_index_lookup();
+    message_pool_reuse();
 }
\ No newline at end of file